@@ -1,1267 +1,6683 @@
 #include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
 #include <stdatomic.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <lfht.h>
 
 #if LFHT_DEBUG
-#include <stdio.h>
 #include <assert.h>
 #define CYCLE_THRESHOLD 10000000
 #endif
 
+// static tracepoints (USDT) on restructuring of the trie, nops
+// until a tracer attaches, e.g.:
+//   bpftrace -e 'usdt:./liblfht.so:lfht:expand { @[arg0] = count(); }'
+// every probe carries hash_pos of the level, the bucket index in
+// the level above (expand: in the level expanded) and the retry
+// count of the loop (0 when it does not apply)
+// build with -DLFHT_NO_PROBES to leave them out
+#if !defined(LFHT_NO_PROBES) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define LFHT_PROBES 1
+#endif
+#endif
+
+#if LFHT_PROBES
+#define PROBE(name, hash_pos, bucket, retries) \
+	DTRACE_PROBE3(lfht, name, hash_pos, bucket, retries)
+#else
+#define PROBE(name, hash_pos, bucket, retries) \
+	do { \
+		if(0) { \
+			(void) (hash_pos); \
+			(void) (bucket); \
+			(void) (retries); \
+		} \
+	} while(0)
+#endif
+
+// preemption point before a CAS of the protocol, debug builds
+// may yield there (see: lfht_debug_set_interleave())
+#if LFHT_DEBUG
+#define INTERLEAVE(lfht) \
+	do { \
+		if((lfht)->interleave) { \
+			interleave(lfht); \
+		} \
+	} while(0)
+#else
+#define INTERLEAVE(lfht) ((void) 0)
+#endif
+
 enum ntype {HASH, LEAF, FREEZE, UNFREEZE};
 
 struct lfht_node;
 
+// a bucket slot or chain link as stored: a pointer, or in compact
+// tables a 32 bit offset (see: encode_link())
+#if LFHT_COMPACT
+typedef uint32_t lfht_link;
+#else
+typedef struct lfht_node *lfht_link;
+#endif
+
 // a node of the trie
 // "size" = chunk size
 // on level hash_pos/size of the tree
 // hash_pos is incremented in chunks (see: get_bucket_index())
 // 2^size = length of "array" of buckets
+// "created" = monotonic time of expansion (see: compress_grace)
+// "skipped" = 1 -> compression skipped in the grace period,
+//   retried by the next remove reaching the level
+//   (see: search_remove()), "size" and "hash_pos" are shorts
+//   so it fits and hash nodes are no larger than leaves
+// tables with filters have one filter word per bucket
+// after "array" (see: filter_word())
 struct lfht_node_hash {
-	int size;
-	int hash_pos;
+	short size;
+	short hash_pos;
+	_Atomic(int) skipped;
 	struct lfht_node *prev;
-	_Atomic(struct lfht_node *) array[0];
+	long created;
+	_Atomic(lfht_link) array[0];
 };
 
+// chain links (leaf .next) carry a version in the bits above the
+// address, bumped by every CAS that relinks them, so a CAS holding
+// an old link fails even if the same node was linked there again
+// (chains are reversed by every migration, see: adjust_chain_step())
+// the version wraps: a stale CAS still succeeds if its link was
+// relinked a multiple of 2^LINK_VERSION_BITS times in between
+// on arm64 the top byte is left to TBI/MTE pointer tags
+// user space addresses of 64 bit targets fit in 48 bits unless
+// mappings above were asked for (5 level paging, 52 bit arm64),
+// every node is checked when it is created (see: check_link_address())
+// 32 bit targets have no spare bits and no versions, compact
+// links room for 4 bits of it (see: encode_link())
+// bucket slots carry no version
+#if LFHT_COMPACT && UINTPTR_MAX <= 0xffffffffu
+#error "LFHT_COMPACT needs a 64 bit target"
+#endif
+#if UINTPTR_MAX > 0xffffffffu
+#define LINK_VERSION_SHIFT 48
+#if LFHT_COMPACT
+#define LINK_VERSION_BITS 4
+#elif defined(__aarch64__)
+#define LINK_VERSION_BITS 8
+#else
+#define LINK_VERSION_BITS 16
+#endif
+#define LINK_VERSION_MASK \
+	((((uintptr_t) 1 << LINK_VERSION_BITS) - 1) << LINK_VERSION_SHIFT)
+#endif
+
 // key-value pair node
+// "value" is last, inline values are stored in place of
+// the pointer and may extend past the node (see: value_size)
 struct lfht_node_leaf {
 	size_t hash;
+	_Atomic(lfht_link) next;
 	void *value;
-	_Atomic(struct lfht_node *) next;
 };
 
+// "referenced" = leaf hit since the last sweep (see: lfht_set_capacity())
 struct lfht_node {
 	enum ntype type;
+	_Atomic(unsigned char) referenced;
 	union {
 		struct lfht_node_hash hash;
 		struct lfht_node_leaf leaf;
 	};
 };
 
+// level emptied by the maintenance thread in its grace
+// period, compression retried by its next runs
+// (see: compress_grace)
+struct lfht_pending {
+	struct lfht_node *hnode;
+	size_t hash;
+	struct lfht_pending *next;
+};
+
+// invalidated node waiting to be made unreachable
+// by the maintenance thread
+struct lfht_unlink {
+	_Atomic(struct lfht_node *) node;
+	_Atomic(struct lfht_node *) hnode;
+};
+
+// removes a thread id deferred, pushed by its thread only and
+// taken by the maintenance thread, or by the remover itself once
+// it stopped (see: defer_unreachable())
+// nodes [tail, head) are not unlinked yet
+#define UNLINK_RING 1024
+
+struct lfht_unlink_ring {
+	_Atomic(size_t) head;
+	char pad[CACHE_SIZE - sizeof(size_t)];
+	_Atomic(size_t) tail;
+	char pad2[CACHE_SIZE - sizeof(size_t)];
+	struct lfht_unlink nodes[UNLINK_RING];
+};
+
+// reclamation of the leaves unlinked by the maintenance
+// thread (see: lfht_set_reclaim())
+// "epoch" = announced by API calls in progress, advanced by
+//   every maintenance run
+// "readers" = calls in progress without an id of their own, or
+//   on SHARED_THREAD(lfht)
+// "expansions" = started, finished: a migration may link an
+//   unlinked leaf again, so leaves are only checked while none
+//   runs, and only freed if none started since
+// "leaves" = unlinked, not freed yet, owned by the
+//   maintenance thread
+struct lfht_reclaim {
+	_Atomic(unsigned long) epoch;
+	_Atomic(long) readers;
+	char pad[CACHE_SIZE - sizeof(unsigned long) - sizeof(long)];
+	_Atomic(unsigned long) expansions[2];
+	char pad2[CACHE_SIZE - 2*sizeof(unsigned long)];
+	struct lfht_retire *leaves;
+	size_t count;
+	size_t size;
+};
+
+// epoch == 0 -> not checked yet, otherwise the leaf was found
+//   unlinked in "epoch", after "expansions" migrations started
+struct lfht_retire {
+	struct lfht_node *node;
+	struct lfht_node *hnode;
+	unsigned long epoch;
+	unsigned long expansions;
+};
+
+struct lfht_maintenance {
+	pthread_t thread;
+	// reserved while active (see: lfht_start_maintenance())
+	_Atomic(int) thread_id;
+	long interval;
+	_Atomic(int) active;
+};
+
+// leaves are bump allocated from chunks of ARENA_CHUNK bytes,
+// linked through their first word for free_lfht()
+// (see: lfht_set_arena())
+#define ARENA_CHUNK (1 << 16)
+#define ARENA_HEADER 16
+
+// compact tables (LFHT_COMPACT) allocate every node from a
+// mapping of COMPACT_REGION bytes aligned to its size, leaves,
+// freeze and unfreeze nodes from its lower half, hash nodes from
+// the upper one, each at a multiple of COMPACT_ALIGN bytes
+// (see: encode_link())
+// nothing is freed on its own before free_lfht() unmaps it, except
+// the last node of a half, and the pages of large hash nodes
+#if LFHT_COMPACT
+#define COMPACT_REGION ((uintptr_t) 1 << 32)
+#define COMPACT_HALF (COMPACT_REGION / 2)
+#define COMPACT_ALIGN 32
+#define ARENA_ALIGN COMPACT_ALIGN
+#else
+#define ARENA_ALIGN 8
+#endif
+
+// "base" = start of the mapping
+// "used" = bytes taken from the lower and the upper half
+struct lfht_compact {
+	char *base;
+	_Atomic(size_t) used[2];
+};
+
+// unused part of the chunk a thread allocates leaves from
+struct lfht_arena {
+	char *next;
+	size_t left;
+};
+
+// change feed of a thread id, written by its thread only
+// events [tail, head) are not drained yet, "lost" = events
+// dropped while the ring was full (see: lfht_set_change_feed())
+struct lfht_ring {
+	_Atomic(size_t) head;
+	_Atomic(size_t) lost;
+	char pad[CACHE_SIZE - 2*sizeof(size_t)];
+	_Atomic(size_t) tail;
+	size_t size;
+	char pad2[CACHE_SIZE - 2*sizeof(size_t)];
+	struct lfht_change events[];
+};
+
+// events recorded by a thread id at the API entry points, the
+// first "size" are kept (see: lfht_set_trace())
+struct lfht_trace_buffer {
+	_Atomic(size_t) count;
+	size_t dropped;
+	size_t size;
+	uint64_t *hashes;
+	unsigned char *ops;
+};
+
+// sampled latencies of a thread id, read by lfht_latency()
+// (see: lfht_set_latency_sampling())
+struct lfht_latency_counts {
+	_Atomic(size_t) buckets[LFHT_OPS][LFHT_PATHS][LFHT_LATENCY_BUCKETS];
+};
+
+// log-linear buckets, with LATENCY_SUB_BITS bits below the leading one
+#define LATENCY_SUB_BITS 3
+
+// per thread state, cache aligned
+// "entries" = inserted - removed entries by the thread (cache mode)
+// "hot" = direct mapped hash -> leaf cache of the thread's
+//   searches, hot_size slots (see: lfht_set_hot_cache())
+struct lfht_thread {
+	_Atomic(int) in_use;
+	_Atomic(long) entries;
+	// updates between begin_update() and end_update(), more than
+	// one on SHARED_THREAD(lfht)
+	_Atomic(int) updating;
+	_Atomic(unsigned int) inserts;
+	struct lfht_arena arena;
+	// NULL -> no change feed, or state created before
+	// lfht_set_change_feed() (see: record_change())
+	_Atomic(struct lfht_ring *) changes;
+	// NULL -> no remove deferred to the maintenance thread yet
+	_Atomic(struct lfht_unlink_ring *) unlinks;
+	// epoch of the API call in progress, 0 -> none, "depth" =
+	// calls nested in it (see: reclaim_enter())
+	_Atomic(unsigned long) reading;
+	unsigned int reading_depth;
+	// NULL -> no workload trace
+	struct lfht_trace_buffer *trace;
+	// NULL -> no latency sampling, "path" = slowest path taken
+	// by the sampled call in progress
+	struct lfht_latency_counts *latency;
+	enum lfht_path path;
+	unsigned int hot_size;
+	struct lfht_node *hot[];
+};
+
+// cache mode, the clock hand is the next root bucket swept
+struct lfht_cache {
+	size_t capacity;
+	lfht_visitor evict;
+	void *arg;
+	_Atomic(unsigned int) hand;
+};
+
+// entry expiry, leaves carry an expiry time after their value
+struct lfht_expiry {
+	lfht_visitor expired;
+	void *arg;
+};
+
+// point in time snapshots, leaves carry the epochs they were
+// inserted and removed in after their value (and expiry)
+// "gate" = 1 while a snapshot waits for the updates in progress
+//   before moving to the next epoch, or the last one released
+//   trims "retired"
+// "retired" = leaves removed while snapshots were active,
+//   still visited by them after being unlinked
+struct lfht_snapshots {
+	_Atomic(unsigned long) epoch;
+	_Atomic(int) gate;
+	_Atomic(int) active;
+	_Atomic(struct lfht_retired *) retired;
+};
+
+struct lfht_retired {
+	struct lfht_node *node;
+	struct lfht_retired *next;
+};
+
+// epoch not reached by any snapshot, leaf not removed
+#define EPOCH_NEVER (~0UL)
+
+// table as of "epoch" (see: lfht_snapshot())
+struct lfht_snapshot {
+	struct lfht_head *lfht;
+	unsigned long epoch;
+	long time;
+};
+
+// arguments of snapshot_view_visit()
+struct lfht_snapshot_view {
+	struct lfht_snapshot *snapshot;
+	struct lfht_node **leaves;
+	size_t count;
+	size_t size;
+};
+
+// arguments of expire_visit()
+struct lfht_expire {
+	struct lfht_head *lfht;
+	int thread_id;
+	long now;
+	size_t count;
+};
+
+// leaves found by lfht_search_all()
+struct lfht_search_all {
+	size_t hash;
+	struct lfht_node **found;
+	size_t count;
+	size_t size;
+};
+
+#define SEARCH_ALL_STACK 16
+
+// inserts by a thread between two checks of the table size
+#define CACHE_CHECK 32
+
+// thread id shared by the LFHT_THREAD_AUTO threads registered
+// beyond max_threads (see: resolve_thread()), its state has no
+// arena, hot cache, trace or latency counts, and a change feed
+// of size 0 that loses every event
+#define SHARED_THREAD(lfht) ((lfht)->max_threads)
+
+// thread id of the calling thread on a table
+// (see: LFHT_THREAD_AUTO)
+struct lfht_registration {
+	unsigned long table_id;
+	int thread_id;
+};
+
+static _Thread_local struct lfht_registration *registrations;
+static _Thread_local int registrations_count;
+static _Thread_local int registrations_size;
+
+// calls of the thread left before the next sampled one
+// (see: lfht_set_latency_sampling())
+static _Thread_local unsigned int latency_countdown;
+
+#if LFHT_DEBUG
+// xorshift state of the preemption points of the thread
+static _Thread_local unsigned int interleave_state;
+
+// table whose maintenance thread this is, the only thread
+// using the id reserved for it (see: resolve_thread())
+static _Thread_local struct lfht_head *maintained;
+
+// leaves found by lfht_debug_validate()
+struct lfht_validation {
+	struct lfht_node **leaves;
+	size_t count;
+	size_t size;
+	int violations;
+};
+#endif
+
+static _Atomic(unsigned long) table_counter;
+
+// largest root of lfht_rebuild_root_quiescent()
+#define MAX_ROOT_BITS 24
+
+// an API call on a hash, from api_enter() to api_exit()
+struct lfht_call {
+	int thread_id;
+	// mixed (see: lfht_set_hash_mix())
+	size_t hash;
+	enum lfht_op op;
+	// 0 -> not sampled (see: latency_start())
+	long start;
+};
+
+// arguments of lfht_foreach() for foreach_visit()
+struct lfht_foreach {
+	struct lfht_head *lfht;
+	lfht_visitor visitor;
+	void *arg;
+	// expired entries are skipped, as of the start of the walk
+	long now;
+};
+
+#define SNAPSHOT_MAGIC "LFHTSNAP"
+#define SNAPSHOT_VERSION 2
+#define SNAPSHOT_MULTIMAP 1
+#define SNAPSHOT_KEYS_ONLY 2
+#define SNAPSHOT_BUFFER (1 << 16)
+
+// snapshot file:
+// header | offsets[2^root_hash_size + 1] | records
+// offsets[i] -> file offset of the first record of root bucket i
+struct lfht_snapshot_header {
+	char magic[8];
+	uint32_t version;
+	int32_t root_hash_size;
+	int32_t hash_size;
+	int32_t max_chain_nodes;
+	int32_t hash_mix;
+	// 0 -> records hold values of any length
+	int32_t value_size;
+	uint32_t flags;
+	uint32_t reserved;
+	uint64_t count;
+};
+
+// workload trace file (see: lfht_trace_write()), the header is
+// followed by one stream per thread id with events
+#define TRACE_MAGIC "LFHTTRCE"
+#define TRACE_VERSION 2
+#define TRACE_MULTIMAP 1
+#define TRACE_KEYS_ONLY 2
+
+struct lfht_trace_header {
+	char magic[8];
+	uint32_t version;
+	int32_t max_threads;
+	int32_t root_hash_size;
+	int32_t hash_size;
+	int32_t max_chain_nodes;
+	int32_t hash_mix;
+	int32_t streams_count;
+	// 0 -> values are pointers (see: lfht_set_value_size())
+	int32_t value_size;
+	uint32_t flags;
+	uint32_t reserved;
+};
+
+// "count" hashes follow, then "count" ops padded to 8 bytes
+struct lfht_trace_stream_header {
+	int32_t thread_id;
+	uint32_t reserved;
+	uint64_t count;
+	uint64_t dropped;
+};
+
+// "len" value bytes follow, padded to 8 bytes
+struct lfht_snapshot_record {
+	uint64_t hash;
+	uint64_t len;
+};
+
+struct lfht_snapshot_writer {
+	int fd;
+	unsigned failed;
+	lfht_serializer serializer;
+	// file offset of buf[0]
+	uint64_t offset;
+	size_t used;
+	unsigned char *buf;
+	size_t value_size;
+	unsigned char *value_buf;
+	uint64_t count;
+	// inline values are written as they are (see: lfht_set_value_size())
+	size_t inline_size;
+	// leaves without a value are written with empty values
+	unsigned keys_only;
+	struct lfht_head *lfht;
+	// entries expired as of the start of the write are left
+	// out, the file has no expiry times to keep
+	long now;
+};
+
+// state shared by the threads loading a snapshot
+struct lfht_snapshot_loader {
+	struct lfht_head *lfht;
+	const unsigned char *map;
+	const uint64_t *offsets;
+	lfht_deserializer deserializer;
+	_Atomic(int) next_bucket;
+	_Atomic(int) failed;
+};
+
+// state shared by the threads of lfht_bulk_build()
+// counts[t*buckets + i] = pairs of slice t in root bucket i, then
+// the position of the first of them in "pairs"
+struct lfht_bulk_build {
+	struct lfht_head *lfht;
+	const struct lfht_pair *input;
+	size_t n;
+	int nthreads;
+	int phase;
+	size_t *counts;
+	// input pairs with mixed hashes, grouped by root bucket
+	struct lfht_pair *pairs;
+	// 0/1 root bucket held entries before the build
+	unsigned char *occupied;
+	_Atomic(int) next_bucket;
+	_Atomic(size_t) count;
+};
+
+// worker "index" of a bulk build, running one phase
+// (see: bulk_build_worker())
+struct lfht_bulk_worker {
+	struct lfht_bulk_build *build;
+	int index;
+};
+
+#define BULK_COUNT 0
+#define BULK_SCATTER 1
+#define BULK_BUILD 2
+
 // private functions
 
-void search_remove(
+struct lfht_thread *create_thread_state(
 		struct lfht_head *lfht,
-		int thread_id,
-		struct lfht_node *hnode,
-		size_t hash);
+		int in_use,
+		unsigned shared);
 
-struct lfht_node *search_insert(
+struct lfht_thread *get_thread(
 		struct lfht_head *lfht,
-		int thread_id,
-		struct lfht_node *hnode,
-		size_t hash,
-		void *value);
+		int thread_id);
 
-void compress(
+void free_thread_state(struct lfht_thread *thread);
+
+struct lfht_ring *create_ring(
+		struct lfht_head *lfht,
+		unsigned shared);
+
+void record_change(
 		struct lfht_head *lfht,
 		int thread_id,
-		struct lfht_node *target,
-		size_t hash);
+		enum lfht_change_type type,
+		struct lfht_node *cnode);
 
-int unfreeze(
+void trace_op(
 		struct lfht_head *lfht,
 		int thread_id,
-		struct lfht_node *target,
+		enum lfht_op op,
 		size_t hash);
 
-void abort_compress(
+long latency_start(
+		struct lfht_head *lfht,
+		int thread_id);
+
+void latency_end(
 		struct lfht_head *lfht,
 		int thread_id,
-		struct lfht_node *target,
-		struct lfht_node *freeze,
-		_Atomic(struct lfht_node *) *atomic_bucket);
+		enum lfht_op op,
+		long start);
 
-int expand(
+void tag_path(
 		struct lfht_head *lfht,
 		int thread_id,
-		struct lfht_node **new_hash,
-		struct lfht_node *hnode,
-		struct lfht_node *tail_nxt,
-		size_t hash,
-		_Atomic(struct lfht_node *) *tail_nxt_ptr);
+		enum lfht_path path);
+
+int latency_bucket(long ns);
+
+long latency_bucket_start(int bucket);
+
+int resolve_thread(
+		struct lfht_head *lfht,
+		int thread_id);
 
-void adjust_chain_nodes(
+struct lfht_call api_enter(
 		struct lfht_head *lfht,
 		int thread_id,
-		struct lfht_node *cnode,
-		struct lfht_node *hnode);
+		enum lfht_op op,
+		size_t hash);
 
-void adjust_node(
+void api_exit(
+		struct lfht_head *lfht,
+		struct lfht_call *call);
+
+void set_registration(
+		struct lfht_head *lfht,
+		int thread_id);
+
+unsigned defer_unreachable(
 		struct lfht_head *lfht,
 		int thread_id,
 		struct lfht_node *cnode,
 		struct lfht_node *hnode);
 
-void *search_node(
+unsigned take_unlink(
+		struct lfht_unlink_ring *ring,
+		struct lfht_node **cnode,
+		struct lfht_node **hnode);
+
+void drain_unlinks(
 		struct lfht_head *lfht,
 		int thread_id,
-		struct lfht_node *hnode,
-		size_t hash);
+		struct lfht_unlink_ring *ring);
 
-struct lfht_node *create_hash_node(
-		int size,
-		int hash_pos,
-		struct lfht_node *prev);
+void drain_pending(
+		struct lfht_head *lfht,
+		int thread_id,
+		struct lfht_pending *retry);
 
-struct lfht_node *get_next(
-		struct lfht_node *node);
+struct lfht_pending *run_maintenance(
+		struct lfht_head *lfht,
+		int thread_id,
+		struct lfht_pending *retry);
 
-struct lfht_node *valid_ptr(struct lfht_node *next);
+void *maintenance_loop(void *arg);
 
-struct lfht_node *invalid_ptr(struct lfht_node *next);
+void reclaim_enter(
+		struct lfht_head *lfht,
+		int thread_id);
 
-unsigned is_invalid(struct lfht_node *ptr);
+void reclaim_exit(
+		struct lfht_head *lfht,
+		int thread_id);
 
-unsigned is_compression_node(struct lfht_node *node);
+void begin_expansion(struct lfht_reclaim *reclaim);
 
-unsigned is_empty(struct lfht_node *hnode);
+void end_expansion(struct lfht_reclaim *reclaim);
 
-// debug functions
+void retire_leaf(
+		struct lfht_reclaim *reclaim,
+		struct lfht_node *cnode,
+		struct lfht_node *hnode);
 
-#if LFHT_DEBUG
+unsigned long oldest_reader(struct lfht_head *lfht);
 
-void *lfht_debug_search(
+void reclaim_leaves(
 		struct lfht_head *lfht,
-		size_t hash,
 		int thread_id);
 
-void *debug_search_chain(
+unsigned is_linked(
+		struct lfht_head *lfht,
+		struct lfht_node *cnode);
+
+void collect_reclaimed(
+		struct lfht_head *lfht,
+		struct lfht_node ***nodes,
+		size_t *count,
+		size_t *size);
+
+unsigned remove_node(
+		struct lfht_head *lfht,
+		int thread_id,
 		struct lfht_node *cnode,
+		struct lfht_node *hnode);
+
+unsigned snapshot_remove(
+		struct lfht_head *lfht,
+		int thread_id,
+		struct lfht_node *cnode);
+
+long count_entries(struct lfht_head *lfht);
+
+uint64_t filter_bit(size_t hash);
+
+_Atomic(uint64_t) *filter_word(
 		struct lfht_node *hnode,
 		size_t hash);
 
-void *debug_search_hash(
+void filter_add(
 		struct lfht_node *hnode,
 		size_t hash);
 
-#endif
+size_t expiry_offset(struct lfht_head *lfht);
 
-// public functions
-// defined by the header API
+long *leaf_expiry(
+		struct lfht_head *lfht,
+		struct lfht_node *cnode);
 
-struct lfht_head *init_lfht(int max_threads) {
-	struct lfht_head *lfht = malloc(sizeof(struct lfht_head));
+size_t epochs_offset(struct lfht_head *lfht);
 
-	lfht->entry_hash = create_hash_node(ROOT_HASH_SIZE, 0, NULL);
-	lfht->max_threads = max_threads;
-	lfht->root_hash_size = ROOT_HASH_SIZE;
-	lfht->hash_size = HASH_SIZE;
-	lfht->max_chain_nodes = MAX_NODES;
-#if LFHT_DEBUG
-	lfht->stats = (struct lfht_stats**)malloc(max_threads*sizeof(struct lfht_stats*));
-	for(int i = 0; i < max_threads; i++) {
-		lfht->stats[i] = (struct lfht_stats*)aligned_alloc(CACHE_SIZE, CACHE_SIZE);
-		lfht->stats[i]->compression_counter = 0;
-		lfht->stats[i]->compression_rollback_counter = 0;
-		lfht->stats[i]->expansion_counter = 0;
-		lfht->stats[i]->unfreeze_counter = 0;
-		lfht->stats[i]->freeze_counter = 0;
-		lfht->stats[i]->max_retry_counter = 0;
-		lfht->stats[i]->max_depth = 0;
-	}
-#endif
-	return lfht;
-}
+_Atomic(unsigned long) *leaf_epochs(
+		struct lfht_head *lfht,
+		struct lfht_node *cnode);
 
-struct lfht_head *init_lfht_explicit(
-		int max_threads,
-		int root_hash_size,
-		int hash_size,
-		int max_chain_nodes) {
-	struct lfht_head *lfht = malloc(sizeof(struct lfht_head));
+unsigned long begin_update(
+		struct lfht_head *lfht,
+		int thread_id);
 
-	lfht->entry_hash = create_hash_node(root_hash_size, 0, NULL);
-	lfht->max_threads = max_threads;
-	lfht->root_hash_size = root_hash_size;
-	lfht->hash_size = hash_size;
-	lfht->max_chain_nodes = max_chain_nodes;
-#if LFHT_DEBUG
-	lfht->stats = (struct lfht_stats**)malloc(max_threads*sizeof(struct lfht_stats*));
-	for(int i = 0; i < max_threads; i++) {
-		lfht->stats[i] = (struct lfht_stats*)aligned_alloc(CACHE_SIZE, CACHE_SIZE);
-		lfht->stats[i]->compression_counter = 0;
-		lfht->stats[i]->compression_rollback_counter = 0;
-		lfht->stats[i]->expansion_counter = 0;
-		lfht->stats[i]->unfreeze_counter = 0;
-		lfht->stats[i]->freeze_counter = 0;
-		lfht->stats[i]->max_retry_counter = 0;
-		lfht->stats[i]->max_depth = 0;
-	}
-#endif
-	return lfht;
-}
+void end_update(
+		struct lfht_head *lfht,
+		int thread_id);
 
-void free_lfht(struct lfht_head *lfht) {
-#if LFHT_DEBUG
-	for(int i = 0; i < lfht->max_threads; i++) {
-		free(lfht->stats[i]);
-	}
-	free(lfht->stats);
-#endif
-}
+void close_gate(struct lfht_snapshots *snapshots);
 
-int lfht_init_thread(struct lfht_head *lfht)
-{
-	return 0;
-}
+void free_retired(struct lfht_retired *retired);
 
-void lfht_end_thread(struct lfht_head *lfht, int thread_id)
-{
-}
+unsigned in_snapshot(
+		struct lfht_snapshot *snapshot,
+		struct lfht_node *cnode);
 
-void *lfht_search(
+void snapshot_view_add(
+		struct lfht_snapshot_view *view,
+		struct lfht_node *cnode);
+
+void snapshot_view_visit(
+		struct lfht_node *cnode,
+		struct lfht_node *hnode,
+		void *arg);
+
+unsigned is_expired(
 		struct lfht_head *lfht,
-		size_t hash,
-		int thread_id)
-{
-	return search_node(
-			lfht,
-			thread_id,
-			lfht->entry_hash,
-			hash);
-}
+		struct lfht_node *cnode,
+		long now);
 
-struct lfht_node *lfht_insert(
+unsigned remove_expired(
+		struct lfht_head *lfht,
+		int thread_id,
+		struct lfht_node *cnode,
+		struct lfht_node *hnode);
+
+void cache_inserted(
+		struct lfht_head *lfht,
+		int thread_id);
+
+size_t sweep(
+		struct lfht_head *lfht,
+		int thread_id,
+		size_t excess);
+
+size_t sweep_bucket(
+		struct lfht_head *lfht,
+		int thread_id,
+		struct lfht_node *hnode,
+		int pos,
+		size_t excess);
+
+void walk_hash(
+		struct lfht_node *hnode,
+		void (*visit)(struct lfht_node *, struct lfht_node *, void *),
+		void *arg);
+
+void walk_bucket(
+		struct lfht_node *hnode,
+		int pos,
+		void (*visit)(struct lfht_node *, struct lfht_node *, void *),
+		void *arg);
+
+void walk_prefix(
+		struct lfht_node *hnode,
+		size_t prefix,
+		int prefix_bits,
+		void (*visit)(struct lfht_node *, struct lfht_node *, void *),
+		void *arg);
+
+void foreach_visit(
+		struct lfht_node *cnode,
+		struct lfht_node *hnode,
+		void *arg);
+
+void count_visit(
+		struct lfht_node *cnode,
+		struct lfht_node *hnode,
+		void *arg);
+
+void count_entry(
+		size_t hash,
+		void *value,
+		void *arg);
+
+void expire_visit(
+		struct lfht_node *cnode,
+		struct lfht_node *hnode,
+		void *arg);
+
+void collect_nodes(
+		struct lfht_node *hnode,
+		struct lfht_node ***nodes,
+		size_t *count,
+		size_t *size);
+
+int compare_nodes(const void *a, const void *b);
+
+void snapshot_visit(
+		struct lfht_node *cnode,
+		struct lfht_node *hnode,
+		void *arg);
+
+unsigned write_all(
+		int fd,
+		const void *buf,
+		size_t len,
+		uint64_t offset);
+
+struct lfht_node *build_bucket(
+		struct lfht_head *lfht,
+		struct lfht_node *hnode,
+		struct lfht_pair *pairs,
+		size_t n,
+		struct lfht_arena *arena,
+		size_t *count);
+
+void *bulk_build_worker(void *arg);
+
+struct lfht_node *relink_bucket(
+		struct lfht_head *lfht,
+		struct lfht_node *hnode,
+		struct lfht_node **leaves,
+		size_t n);
+
+void *load_buckets(void *arg);
+
+struct lfht_node *search_remove(
+		struct lfht_head *lfht,
+		int thread_id,
+		struct lfht_node *hnode,
+		size_t hash,
+		void **value);
+
+struct lfht_node *search_insert(
+		struct lfht_head *lfht,
+		int thread_id,
+		struct lfht_node *hnode,
+		size_t hash,
+		void *value,
+		long expires,
+		unsigned *inserted);
+
+void compress(
+		struct lfht_head *lfht,
+		int thread_id,
+		struct lfht_node *target,
+		size_t hash);
+
+int unfreeze(
+		struct lfht_head *lfht,
+		int thread_id,
+		struct lfht_node *target,
+		size_t hash);
+
+void abort_compress(
+		struct lfht_head *lfht,
+		int thread_id,
+		struct lfht_node *target,
+		struct lfht_node *freeze,
+		_Atomic(lfht_link) *atomic_bucket);
+
+int expand(
+		struct lfht_head *lfht,
+		int thread_id,
+		struct lfht_node **new_hash,
+		struct lfht_node *hnode,
+		struct lfht_node *tail_nxt,
+		size_t hash,
+		_Atomic(lfht_link) *tail_nxt_ptr);
+
+int adjust_chain_step(
+		struct lfht_head *lfht,
+		int thread_id,
+		struct lfht_node *hnode,
+		struct lfht_node *new_hash,
+		size_t hash,
+		struct lfht_node **moved);
+
+void adjust_node(
+		struct lfht_head *lfht,
+		int thread_id,
+		struct lfht_node *cnode,
+		struct lfht_node *cnode_nxt,
+		struct lfht_node *hnode);
+
+unsigned is_reachable(
+		struct lfht_node *hnode,
+		struct lfht_node *cnode);
+
+struct lfht_node *search_node(
+		struct lfht_head *lfht,
+		int thread_id,
+		struct lfht_node *hnode,
+		size_t hash);
+
+void search_all_hash(
+		struct lfht_head *lfht,
+		struct lfht_node *hnode,
+		struct lfht_search_all *all);
+
+struct lfht_node *create_hash_node(
+		struct lfht_head *lfht,
+		int size,
+		int hash_pos,
+		struct lfht_node *prev);
+
+size_t leaf_size(struct lfht_head *lfht);
+
+int get_bucket_index(
+		size_t hash,
+		int hash_pos,
+		int size);
+
+void *arena_alloc(
+		struct lfht_head *lfht,
+		struct lfht_arena *arena,
+		size_t size);
+
+void arena_add_chunk(
+		struct lfht_head *lfht,
+		char *chunk);
+
+void arena_free(
+		struct lfht_arena *arena,
+		void *ptr,
+		size_t size);
+
+void *alloc_node(
+		struct lfht_head *lfht,
+		size_t size,
+		enum ntype type);
+
+void free_node(
+		struct lfht_head *lfht,
+		struct lfht_node *node);
+
+size_t hash_node_size(
+		struct lfht_head *lfht,
+		int size);
+
+#if LFHT_COMPACT
+struct lfht_compact *create_compact();
+
+void *compact_alloc(
+		struct lfht_head *lfht,
+		size_t size,
+		int half);
+
+void compact_free(
+		struct lfht_head *lfht,
+		void *ptr,
+		size_t size,
+		int half);
+#endif
+
+struct lfht_node *get_next(
+		struct lfht_node *node);
+
+void *leaf_value(
+		struct lfht_head *lfht,
+		struct lfht_node *cnode);
+
+unsigned same_value(
+		struct lfht_head *lfht,
+		void *a,
+		void *b);
+
+struct lfht_node *valid_ptr(struct lfht_node *next);
+
+struct lfht_node *load_link(
+		struct lfht_node *node);
+
+struct lfht_node *unversioned(
+		struct lfht_node *link);
+
+void check_link_address(struct lfht_node *node);
+
+struct lfht_node *versioned(
+		struct lfht_node *node,
+		struct lfht_node *expect);
+
+struct lfht_node *link_value(
+		struct lfht_node *node,
+		struct lfht_node *expect,
+		_Atomic(lfht_link) *atomic,
+		_Atomic(lfht_link) *bucket);
+
+lfht_link encode_link(
+		_Atomic(lfht_link) *atomic,
+		struct lfht_node *link);
+
+struct lfht_node *decode_link(
+		_Atomic(lfht_link) *atomic,
+		lfht_link link);
+
+struct lfht_node *link_load(
+		_Atomic(lfht_link) *atomic,
+		memory_order order);
+
+void link_store(
+		_Atomic(lfht_link) *atomic,
+		struct lfht_node *link,
+		memory_order order);
+
+void link_init(
+		_Atomic(lfht_link) *atomic,
+		struct lfht_node *link);
+
+unsigned link_cas(
+		_Atomic(lfht_link) *atomic,
+		struct lfht_node **expect,
+		struct lfht_node *desired,
+		memory_order success,
+		memory_order failure);
+
+unsigned is_hash(struct lfht_node *node);
+
+struct lfht_node *invalid_ptr(struct lfht_node *next);
+
+unsigned is_invalid(struct lfht_node *ptr);
+
+unsigned is_compression_node(struct lfht_node *node);
+
+unsigned is_empty(struct lfht_node *hnode);
+
+unsigned is_removed(
+		struct lfht_node *hnode,
+		size_t hash);
+
+size_t mix_hash(
+		struct lfht_head *lfht,
+		size_t hash);
+
+size_t unmix_hash(
+		struct lfht_head *lfht,
+		size_t hash);
+
+long monotonic_time();
+
+unsigned in_grace_period(
+		struct lfht_head *lfht,
+		struct lfht_node *hnode);
+
+// debug functions
+
+#if LFHT_DEBUG
+
+void *lfht_debug_search(
+		struct lfht_head *lfht,
+		size_t hash,
+		int thread_id);
+
+struct lfht_node *debug_search_chain(
+		struct lfht_node *cnode,
+		struct lfht_node *hnode,
+		size_t hash);
+
+struct lfht_node *debug_search_hash(
+		struct lfht_node *hnode,
+		size_t hash);
+
+void interleave(struct lfht_head *lfht);
+
+void validate_hash(
+		struct lfht_head *lfht,
+		struct lfht_node *hnode,
+		size_t prefix,
+		struct lfht_validation *validation);
+
+int compare_leaf_hashes(
+		const void *a,
+		const void *b);
+
+#endif
+
+// public functions
+// defined by the header API
+
+struct lfht_head *init_lfht(int max_threads) {
+	return init_lfht_explicit(
+			max_threads,
+			ROOT_HASH_SIZE,
+			HASH_SIZE,
+			MAX_NODES);
+}
+
+struct lfht_head *init_lfht_explicit(
+		int max_threads,
+		int root_hash_size,
+		int hash_size,
+		int max_chain_nodes) {
+	struct lfht_head *lfht = malloc(sizeof(struct lfht_head));
+
+	lfht->filter = 0;
+	lfht->hot_size = 0;
+	lfht->arena = 0;
+	atomic_init(&(lfht->arena_chunks), NULL);
+	lfht->compact = NULL;
+#if LFHT_COMPACT
+	// every leaf comes from a chunk of the mapping
+	lfht->compact = create_compact();
+	if(lfht->compact == NULL) {
+		free(lfht);
+		return NULL;
+	}
+	lfht->arena = 1;
+#endif
+	lfht->entry_hash = create_hash_node(lfht, root_hash_size, 0, NULL);
+	lfht->table_id = atomic_fetch_add_explicit(
+			&table_counter,
+			1,
+			memory_order_relaxed);
+	lfht->max_threads = max_threads;
+	lfht->threads = malloc((max_threads + 1)*sizeof(struct lfht_thread *));
+	for(int i = 0; i <= max_threads; i++) {
+		atomic_init(&(lfht->threads[i]), NULL);
+	}
+	lfht->root_hash_size = root_hash_size;
+	lfht->hash_size = hash_size;
+	lfht->max_chain_nodes = max_chain_nodes;
+	lfht->compress_grace = COMPRESS_GRACE;
+	lfht->hash_mix = LFHT_MIX_NONE;
+	lfht->value_size = 0;
+	lfht->cache = NULL;
+	lfht->expiry = NULL;
+	lfht->snapshots = NULL;
+	lfht->change_ring_size = 0;
+	lfht->latency_period = 0;
+	lfht->trace_size = 0;
+#if LFHT_DEBUG
+	lfht->interleave = 0;
+#endif
+	lfht->multimap = 0;
+	lfht->keys_only = 0;
+	lfht->reclaim = NULL;
+	lfht->maintenance = malloc(sizeof(struct lfht_maintenance));
+	atomic_init(&(lfht->maintenance->active), 0);
+	atomic_init(&(lfht->maintenance->thread_id), LFHT_THREAD_AUTO);
+	lfht->snapshot_map = NULL;
+	lfht->snapshot_size = 0;
+#if LFHT_DEBUG
+	lfht->stats = (struct lfht_stats**)malloc((max_threads + 1)*sizeof(struct lfht_stats*));
+	for(int i = 0; i <= max_threads; i++) {
+		lfht->stats[i] = (struct lfht_stats*)aligned_alloc(CACHE_SIZE, CACHE_SIZE);
+		lfht->stats[i]->compression_counter = 0;
+		lfht->stats[i]->compression_rollback_counter = 0;
+		lfht->stats[i]->compression_deferred_counter = 0;
+		lfht->stats[i]->expansion_counter = 0;
+		lfht->stats[i]->expansion_help_counter = 0;
+		lfht->stats[i]->unfreeze_counter = 0;
+		lfht->stats[i]->freeze_counter = 0;
+		lfht->stats[i]->max_retry_counter = 0;
+		lfht->stats[i]->reclaimed_counter = 0;
+		lfht->stats[i]->operations = 0;
+		lfht->stats[i]->api_calls = 0;
+		lfht->stats[i]->max_depth = 0;
+	}
+#endif
+	return lfht;
+}
+
+void free_lfht(struct lfht_head *lfht) {
+	lfht_stop_maintenance(lfht);
+
+#if LFHT_COMPACT
+	// every node goes with the mapping
+	munmap(lfht->compact->base, COMPACT_REGION);
+	free(lfht->compact);
+#else
+	// nodes removed from the table were never freed,
+	// free everything still reachable from the root
+	// (leaves of an arena go with its chunks, removed ones too)
+	struct lfht_node **nodes = NULL;
+	size_t count = 0, size = 0;
+	collect_nodes(lfht->entry_hash, &nodes, &count, &size);
+	if(lfht->reclaim) {
+		collect_reclaimed(lfht, &nodes, &count, &size);
+	}
+	qsort(nodes, count, sizeof(struct lfht_node *), compare_nodes);
+	for(size_t i = 0; i < count; i++) {
+		if((i == 0 || nodes[i] != nodes[i-1]) &&
+				!(lfht->arena && nodes[i]->type == LEAF)) {
+			free(nodes[i]);
+		}
+	}
+	free(nodes);
+
+	void *chunk = atomic_load_explicit(
+			&(lfht->arena_chunks),
+			memory_order_relaxed);
+	while(chunk) {
+		void *nxt = *(void **) chunk;
+		free(chunk);
+		chunk = nxt;
+	}
+#endif
+
+	free(lfht->maintenance);
+	if(lfht->reclaim) {
+		free(lfht->reclaim->leaves);
+		free(lfht->reclaim);
+	}
+	free(lfht->cache);
+	free(lfht->expiry);
+	if(lfht->snapshots) {
+		free_retired(atomic_load_explicit(
+				&(lfht->snapshots->retired),
+				memory_order_relaxed));
+		free(lfht->snapshots);
+	}
+	if(lfht->snapshot_map) {
+		munmap(lfht->snapshot_map, lfht->snapshot_size);
+	}
+	for(int i = 0; i <= SHARED_THREAD(lfht); i++) {
+		struct lfht_thread *thread = atomic_load_explicit(
+				&(lfht->threads[i]),
+				memory_order_relaxed);
+		if(thread) {
+			free_thread_state(thread);
+		}
+	}
+	free(lfht->threads);
+#if LFHT_DEBUG
+	for(int i = 0; i <= SHARED_THREAD(lfht); i++) {
+		free(lfht->stats[i]);
+	}
+	free(lfht->stats);
+#endif
+	free(lfht);
+}
+
+void lfht_set_compress_grace(
+		struct lfht_head *lfht,
+		long nanoseconds)
+{
+	lfht->compress_grace = nanoseconds;
+}
+
+void lfht_set_hash_mix(
+		struct lfht_head *lfht,
+		enum lfht_hash_mix mix)
+{
+	lfht->hash_mix = mix;
+}
+
+void lfht_set_capacity(
+		struct lfht_head *lfht,
+		size_t max_entries,
+		lfht_visitor evict,
+		void *arg)
+{
+	if(lfht->cache == NULL) {
+		lfht->cache = malloc(sizeof(struct lfht_cache));
+		atomic_init(&(lfht->cache->hand), 0);
+	}
+	lfht->cache->capacity = max_entries;
+	lfht->cache->evict = evict;
+	lfht->cache->arg = arg;
+}
+
+size_t lfht_size(struct lfht_head *lfht)
+{
+	long entries = count_entries(lfht);
+	return entries > 0 ? entries : 0;
+}
+
+size_t lfht_count(struct lfht_head *lfht)
+{
+	size_t count = 0;
+	lfht_foreach(lfht, count_entry, &count);
+	return count;
+}
+
+size_t lfht_evict(
+		struct lfht_head *lfht,
+		int thread_id)
+{
+	if(lfht->cache == NULL) {
+		return 0;
+	}
+	long excess = count_entries(lfht) - (long) lfht->cache->capacity;
+	if(excess <= 0) {
+		return 0;
+	}
+	thread_id = resolve_thread(lfht, thread_id);
+	if(lfht->reclaim) {
+		reclaim_enter(lfht, thread_id);
+	}
+	size_t evicted = sweep(lfht, thread_id, excess);
+	if(lfht->reclaim) {
+		reclaim_exit(lfht, thread_id);
+	}
+	return evicted;
+}
+
+void lfht_set_expiry(
+		struct lfht_head *lfht,
+		lfht_visitor expired,
+		void *arg)
+{
+	if(lfht->expiry == NULL) {
+		lfht->expiry = malloc(sizeof(struct lfht_expiry));
+	}
+	lfht->expiry->expired = expired;
+	lfht->expiry->arg = arg;
+}
+
+long lfht_time()
+{
+	return monotonic_time();
+}
+
+size_t lfht_expire(
+		struct lfht_head *lfht,
+		int thread_id)
+{
+	if(lfht->expiry == NULL) {
+		return 0;
+	}
+	struct lfht_expire expire = {
+		.lfht = lfht,
+		.thread_id = resolve_thread(lfht, thread_id),
+		.now = monotonic_time(),
+		.count = 0
+	};
+	if(lfht->reclaim) {
+		reclaim_enter(lfht, expire.thread_id);
+	}
+	walk_hash(lfht->entry_hash, expire_visit, &expire);
+	if(lfht->reclaim) {
+		reclaim_exit(lfht, expire.thread_id);
+	}
+	return expire.count;
+}
+
+void lfht_set_multimap(struct lfht_head *lfht)
+{
+	lfht->multimap = 1;
+}
+
+void lfht_set_filter(struct lfht_head *lfht)
+{
+	if(lfht->filter) {
+		return;
+	}
+	// the empty root is replaced by one with filter words,
+	// freed first so a compact table takes its place back
+	int size = lfht->entry_hash->hash.size;
+	free_node(lfht, lfht->entry_hash);
+	lfht->filter = 1;
+	lfht->entry_hash = create_hash_node(
+			lfht,
+			size,
+			0,
+			NULL);
+}
+
+void lfht_set_hot_cache(
+		struct lfht_head *lfht,
+		unsigned int entries)
+{
+	unsigned int size = entries ? 1 : 0;
+	while(size && size < entries) {
+		size <<= 1;
+	}
+	lfht->hot_size = size;
+}
+
+void lfht_set_snapshots(struct lfht_head *lfht)
+{
+	if(lfht->snapshots) {
+		return;
+	}
+	lfht->snapshots = malloc(sizeof(struct lfht_snapshots));
+	atomic_init(&(lfht->snapshots->epoch), 1);
+	atomic_init(&(lfht->snapshots->gate), 0);
+	atomic_init(&(lfht->snapshots->active), 0);
+	atomic_init(&(lfht->snapshots->retired), NULL);
+}
+
+struct lfht_snapshot *lfht_snapshot(struct lfht_head *lfht)
+{
+	struct lfht_snapshots *snapshots = lfht->snapshots;
+	if(snapshots == NULL) {
+		return NULL;
+	}
+
+	close_gate(snapshots);
+	atomic_fetch_add_explicit(&(snapshots->active), 1, memory_order_seq_cst);
+
+	// thread states created from now on see the gate closed
+	for(int i = 0; i <= SHARED_THREAD(lfht); i++) {
+		struct lfht_thread *thread = atomic_load_explicit(
+				&(lfht->threads[i]),
+				memory_order_seq_cst);
+		if(thread) {
+			// a CAS away, unless its thread was preempted
+			while(atomic_load_explicit(&(thread->updating), memory_order_seq_cst)) {
+				sched_yield();
+			}
+		}
+	}
+
+	struct lfht_snapshot *snapshot = malloc(sizeof(struct lfht_snapshot));
+	snapshot->lfht = lfht;
+	snapshot->epoch = atomic_fetch_add_explicit(
+			&(snapshots->epoch),
+			1,
+			memory_order_seq_cst);
+	snapshot->time = lfht->expiry ? monotonic_time() : 0;
+	atomic_store_explicit(&(snapshots->gate), 0, memory_order_seq_cst);
+	return snapshot;
+}
+
+void lfht_snapshot_foreach(
+		struct lfht_snapshot *snapshot,
+		lfht_visitor visitor,
+		void *arg)
+{
+	struct lfht_head *lfht = snapshot->lfht;
+	struct lfht_snapshot_view view = {
+		.snapshot = snapshot,
+		.leaves = NULL,
+		.count = 0,
+		.size = 0
+	};
+
+	// leaves removed after the snapshot and skipped by the
+	// walk were retired before being invalidated
+	walk_hash(lfht->entry_hash, snapshot_view_visit, &view);
+	struct lfht_retired *retired = atomic_load_explicit(
+			&(lfht->snapshots->retired),
+			memory_order_acquire);
+	for(; retired; retired = retired->next) {
+		snapshot_view_add(&view, retired->node);
+	}
+
+	// leaves moved by an expansion during the walk, or retired
+	// during it, are found twice
+	qsort(view.leaves, view.count, sizeof(struct lfht_node *), compare_nodes);
+	for(size_t i = 0; i < view.count; i++) {
+		if(i == 0 || view.leaves[i] != view.leaves[i-1]) {
+			visitor(
+					unmix_hash(lfht, view.leaves[i]->leaf.hash),
+					leaf_value(lfht, view.leaves[i]),
+					arg);
+		}
+	}
+	free(view.leaves);
+}
+
+void lfht_snapshot_release(struct lfht_snapshot *snapshot)
+{
+	struct lfht_snapshots *snapshots = snapshot->lfht->snapshots;
+
+	// the gate keeps snapshots from being taken meanwhile, leaves
+	// retired until now were removed before any later snapshot
+	close_gate(snapshots);
+	struct lfht_retired *retired = NULL;
+	if(atomic_fetch_sub_explicit(&(snapshots->active), 1, memory_order_seq_cst) == 1) {
+		retired = atomic_exchange_explicit(
+				&(snapshots->retired),
+				NULL,
+				memory_order_acquire);
+	}
+	atomic_store_explicit(&(snapshots->gate), 0, memory_order_seq_cst);
+	free_retired(retired);
+	free(snapshot);
+}
+
+void lfht_set_change_feed(
+		struct lfht_head *lfht,
+		size_t ring_size)
+{
+	size_t size = ring_size ? 1 : 0;
+	while(size && size < ring_size) {
+		size <<= 1;
+	}
+	lfht->change_ring_size = size;
+}
+
+size_t lfht_drain_changes(
+		struct lfht_head *lfht,
+		struct lfht_change *changes,
+		size_t max_changes)
+{
+	size_t count = 0;
+	for(int i = 0; i < lfht->max_threads && count < max_changes; i++) {
+		struct lfht_thread *thread = atomic_load_explicit(
+				&(lfht->threads[i]),
+				memory_order_acquire);
+		struct lfht_ring *ring = thread ?
+			atomic_load_explicit(&(thread->changes), memory_order_acquire) :
+			NULL;
+		if(ring == NULL) {
+			continue;
+		}
+
+		size_t tail = atomic_load_explicit(&(ring->tail), memory_order_relaxed);
+		size_t head = atomic_load_explicit(&(ring->head), memory_order_acquire);
+		while(tail != head && count < max_changes) {
+			changes[count++] = ring->events[tail & (ring->size - 1)];
+			tail++;
+		}
+		atomic_store_explicit(&(ring->tail), tail, memory_order_release);
+	}
+	return count;
+}
+
+size_t lfht_changes_lost(struct lfht_head *lfht)
+{
+	size_t lost = 0;
+	for(int i = 0; i <= SHARED_THREAD(lfht); i++) {
+		struct lfht_thread *thread = atomic_load_explicit(
+				&(lfht->threads[i]),
+				memory_order_acquire);
+		struct lfht_ring *ring = thread ?
+			atomic_load_explicit(&(thread->changes), memory_order_acquire) :
+			NULL;
+		if(ring) {
+			lost += atomic_load_explicit(&(ring->lost), memory_order_relaxed);
+		}
+	}
+	return lost;
+}
+
+void lfht_set_latency_sampling(
+		struct lfht_head *lfht,
+		unsigned int period)
+{
+	unsigned int size = period ? 1 : 0;
+	while(size && size < period) {
+		size <<= 1;
+	}
+	lfht->latency_period = size;
+}
+
+void lfht_latency(
+		struct lfht_head *lfht,
+		enum lfht_op op,
+		enum lfht_path path,
+		struct lfht_latency *histogram)
+{
+	memset(histogram, 0, sizeof(struct lfht_latency));
+	for(int i = 0; i < lfht->max_threads; i++) {
+		struct lfht_thread *thread = atomic_load_explicit(
+				&(lfht->threads[i]),
+				memory_order_acquire);
+		if(thread == NULL || thread->latency == NULL) {
+			continue;
+		}
+
+		for(int j = 0; j < LFHT_LATENCY_BUCKETS; j++) {
+			size_t count = atomic_load_explicit(
+					&(thread->latency->buckets[op][path][j]),
+					memory_order_relaxed);
+			histogram->buckets[j] += count;
+			histogram->count += count;
+		}
+	}
+}
+
+long lfht_latency_percentile(
+		const struct lfht_latency *histogram,
+		double percentile)
+{
+	size_t rank = histogram->count * percentile / 100;
+	size_t seen = 0;
+	for(int i = 0; i < LFHT_LATENCY_BUCKETS - 1; i++) {
+		seen += histogram->buckets[i];
+		if(seen > rank) {
+			return latency_bucket_start(i + 1) - 1;
+		}
+	}
+	return latency_bucket_start(LFHT_LATENCY_BUCKETS - 1);
+}
+
+void lfht_set_arena(struct lfht_head *lfht)
+{
+	lfht->arena = 1;
+}
+
+void lfht_set_keys_only(struct lfht_head *lfht)
+{
+	lfht->keys_only = 1;
+	lfht->value_size = 0;
+}
+
+void lfht_set_value_size(
+		struct lfht_head *lfht,
+		size_t value_size)
+{
+	if(!lfht->keys_only) {
+		lfht->value_size = value_size;
+	}
+}
+
+// 64 bit primes of xxhash
+#define PRIME64_1 0x9E3779B185EBCA87ULL
+#define PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define PRIME64_3 0x165667B19E3779F9ULL
+#define PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define PRIME64_5 0x27D4EB2F165667C5ULL
+
+uint64_t rotl64(uint64_t x, int r)
+{
+	return (x << r) | (x >> (64 - r));
+}
+
+uint64_t read64(const unsigned char *p)
+{
+	uint64_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+uint64_t hash_round(uint64_t acc, uint64_t input)
+{
+	acc += input * PRIME64_2;
+	acc = rotl64(acc, 31);
+	return acc * PRIME64_1;
+}
+
+size_t lfht_hash_u64(uint64_t key)
+{
+	// murmur3 fmix64
+	key ^= key >> 33;
+	key *= 0xFF51AFD7ED558CCDULL;
+	key ^= key >> 33;
+	key *= 0xC4CEB9FE1A85EC53ULL;
+	key ^= key >> 33;
+	return key;
+}
+
+size_t lfht_hash_bytes(
+		const void *data,
+		size_t len)
+{
+	const unsigned char *p = data;
+	const unsigned char *end = p + len;
+	uint64_t h;
+
+	if(len >= 32) {
+		// independent lanes, no dependency between them
+		// within a stripe
+		uint64_t lane[4] = {
+			PRIME64_1 + PRIME64_2,
+			PRIME64_2,
+			0,
+			-PRIME64_1
+		};
+		for(; p + 32 <= end; p += 32) {
+			for(int i = 0; i < 4; i++) {
+				lane[i] = hash_round(lane[i], read64(p + 8*i));
+			}
+		}
+		h = rotl64(lane[0], 1) + rotl64(lane[1], 7) +
+			rotl64(lane[2], 12) + rotl64(lane[3], 18);
+		for(int i = 0; i < 4; i++) {
+			h ^= hash_round(0, lane[i]);
+			h = h * PRIME64_1 + PRIME64_4;
+		}
+	} else {
+		h = PRIME64_5;
+	}
+	h += len;
+
+	for(; p + 8 <= end; p += 8) {
+		h ^= hash_round(0, read64(p));
+		h = rotl64(h, 27) * PRIME64_1 + PRIME64_4;
+	}
+	for(; p < end; p++) {
+		h ^= *p * PRIME64_5;
+		h = rotl64(h, 11) * PRIME64_1;
+	}
+
+	// avalanche
+	h ^= h >> 33;
+	h *= PRIME64_2;
+	h ^= h >> 29;
+	h *= PRIME64_3;
+	h ^= h >> 32;
+	return h;
+}
+
+void lfht_set_trace(
+		struct lfht_head *lfht,
+		size_t max_events)
+{
+	lfht->trace_size = max_events;
+}
+
+int lfht_trace_write(
+		struct lfht_head *lfht,
+		int fd)
+{
+	struct lfht_trace_header header = {
+		.magic = TRACE_MAGIC,
+		.version = TRACE_VERSION,
+		.max_threads = lfht->max_threads,
+		.root_hash_size = lfht->root_hash_size,
+		.hash_size = lfht->hash_size,
+		.max_chain_nodes = lfht->max_chain_nodes,
+		.hash_mix = lfht->hash_mix,
+		.streams_count = 0,
+		.value_size = lfht->value_size,
+		.flags = (lfht->multimap ? TRACE_MULTIMAP : 0) |
+			(lfht->keys_only ? TRACE_KEYS_ONLY : 0),
+		.reserved = 0
+	};
+	uint64_t offset = sizeof(header);
+	unsigned success = 1;
+
+	for(int i = 0; i < lfht->max_threads && success; i++) {
+		struct lfht_thread *thread = atomic_load_explicit(
+				&(lfht->threads[i]),
+				memory_order_acquire);
+		if(thread == NULL || thread->trace == NULL) {
+			continue;
+		}
+
+		struct lfht_trace_buffer *trace = thread->trace;
+		struct lfht_trace_stream_header stream = {
+			.thread_id = i,
+			.reserved = 0,
+			.count = atomic_load_explicit(&(trace->count), memory_order_acquire),
+			.dropped = trace->dropped
+		};
+		if(stream.count == 0) {
+			continue;
+		}
+
+		size_t ops_size = (stream.count + 7) & ~7UL;
+		unsigned char *ops = calloc(ops_size, 1);
+		memcpy(ops, trace->ops, stream.count);
+		success = write_all(fd, &stream, sizeof(stream), offset) &&
+			write_all(fd, trace->hashes, stream.count*sizeof(uint64_t), offset + sizeof(stream)) &&
+			write_all(fd, ops, ops_size, offset + sizeof(stream) + stream.count*sizeof(uint64_t));
+		free(ops);
+		offset += sizeof(stream) + stream.count*sizeof(uint64_t) + ops_size;
+		header.streams_count++;
+	}
+
+	return success &&
+		write_all(fd, &header, sizeof(header), 0) &&
+		!ftruncate(fd, offset);
+}
+
+struct lfht_trace *lfht_trace_read(int fd)
+{
+	struct stat st;
+	if(fstat(fd, &st) || (size_t) st.st_size < sizeof(struct lfht_trace_header)) {
+		return NULL;
+	}
+
+	size_t size = st.st_size;
+	unsigned char *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if(map == MAP_FAILED) {
+		return NULL;
+	}
+
+	struct lfht_trace_header *header = (struct lfht_trace_header *) map;
+	if(memcmp(header->magic, TRACE_MAGIC, sizeof(header->magic)) ||
+			header->version != TRACE_VERSION ||
+			header->max_threads < 1 ||
+			header->streams_count < 0 || header->streams_count > header->max_threads ||
+			header->value_size < 0) {
+		munmap(map, size);
+		return NULL;
+	}
+
+	struct lfht_trace *trace = malloc(sizeof(struct lfht_trace));
+	trace->max_threads = header->max_threads;
+	trace->root_hash_size = header->root_hash_size;
+	trace->hash_size = header->hash_size;
+	trace->max_chain_nodes = header->max_chain_nodes;
+	trace->hash_mix = header->hash_mix;
+	trace->value_size = header->value_size;
+	trace->multimap = (header->flags & TRACE_MULTIMAP) != 0;
+	trace->keys_only = (header->flags & TRACE_KEYS_ONLY) != 0;
+	trace->streams_count = header->streams_count;
+	trace->streams = malloc(header->streams_count*sizeof(struct lfht_trace_stream));
+	trace->map = map;
+	trace->size = size;
+
+	// streams must be inside the file
+	uint64_t offset = sizeof(struct lfht_trace_header);
+	for(int i = 0; i < header->streams_count; i++) {
+		struct lfht_trace_stream_header *stream =
+			(struct lfht_trace_stream_header *) (map + offset);
+		if(offset + sizeof(*stream) > size ||
+				stream->thread_id < 0 || stream->thread_id >= header->max_threads ||
+				stream->count > (size - offset) / (sizeof(uint64_t) + 1)) {
+			lfht_trace_free(trace);
+			return NULL;
+		}
+
+		uint64_t ops_size = (stream->count + 7) & ~7UL;
+		uint64_t end = offset + sizeof(*stream) + stream->count*sizeof(uint64_t) + ops_size;
+		if(end > size) {
+			lfht_trace_free(trace);
+			return NULL;
+		}
+
+		trace->streams[i].thread_id = stream->thread_id;
+		trace->streams[i].count = stream->count;
+		trace->streams[i].dropped = stream->dropped;
+		trace->streams[i].hashes = (const uint64_t *) (map + offset + sizeof(*stream));
+		trace->streams[i].ops = map + offset + sizeof(*stream) + stream->count*sizeof(uint64_t);
+		offset = end;
+	}
+	return trace;
+}
+
+void lfht_trace_free(struct lfht_trace *trace)
+{
+	munmap(trace->map, trace->size);
+	free(trace->streams);
+	free(trace);
+}
+
+int lfht_snapshot_write(
+		struct lfht_head *lfht,
+		int fd,
+		lfht_serializer value_serializer)
+{
+	struct lfht_node *root = lfht->entry_hash;
+	int buckets = 1 << root->hash.size;
+	uint64_t *offsets = malloc((buckets + 1) * sizeof(uint64_t));
+	struct lfht_snapshot_writer writer = {
+		.fd = fd,
+		.failed = 0,
+		.serializer = value_serializer,
+		.offset = sizeof(struct lfht_snapshot_header) +
+			(buckets + 1) * sizeof(uint64_t),
+		.used = 0,
+		.buf = malloc(SNAPSHOT_BUFFER),
+		.value_size = CACHE_SIZE,
+		.value_buf = malloc(CACHE_SIZE),
+		.count = 0,
+		.inline_size = lfht->value_size,
+		.keys_only = lfht->keys_only,
+		.lfht = lfht,
+		.now = lfht->expiry ? monotonic_time() : 0
+	};
+
+	if(lfht->reclaim) {
+		reclaim_enter(lfht, -1);
+	}
+	for(int i = 0; i < buckets; i++) {
+		offsets[i] = writer.offset + writer.used;
+		walk_bucket(root, i, snapshot_visit, &writer);
+	}
+	if(lfht->reclaim) {
+		reclaim_exit(lfht, -1);
+	}
+	offsets[buckets] = writer.offset + writer.used;
+
+	struct lfht_snapshot_header header = {
+		.magic = SNAPSHOT_MAGIC,
+		.version = SNAPSHOT_VERSION,
+		.root_hash_size = root->hash.size,
+		.hash_size = lfht->hash_size,
+		.max_chain_nodes = lfht->max_chain_nodes,
+		.hash_mix = lfht->hash_mix,
+		.value_size = lfht->value_size,
+		.flags = (lfht->multimap ? SNAPSHOT_MULTIMAP : 0) |
+			(lfht->keys_only ? SNAPSHOT_KEYS_ONLY : 0),
+		.reserved = 0,
+		.count = writer.count
+	};
+
+	unsigned success = !writer.failed &&
+		write_all(fd, writer.buf, writer.used, writer.offset) &&
+		write_all(fd, offsets, (buckets + 1) * sizeof(uint64_t), sizeof(header)) &&
+		write_all(fd, &header, sizeof(header), 0) &&
+		!ftruncate(fd, offsets[buckets]);
+
+	free(writer.value_buf);
+	free(writer.buf);
+	free(offsets);
+	return success;
+}
+
+struct lfht_head *lfht_load_mmap(
+		int fd,
+		int max_threads,
+		lfht_deserializer value_deserializer,
+		int nthreads)
+{
+	struct stat st;
+	if(fstat(fd, &st) || (size_t) st.st_size < sizeof(struct lfht_snapshot_header)) {
+		return NULL;
+	}
+
+	size_t size = st.st_size;
+	unsigned char *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if(map == MAP_FAILED) {
+		return NULL;
+	}
+
+	struct lfht_snapshot_header *header = (struct lfht_snapshot_header *) map;
+	if(memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic)) ||
+			header->version != SNAPSHOT_VERSION ||
+			header->root_hash_size < 1 || header->root_hash_size > 30 ||
+			header->hash_size < 1 || header->hash_size > 30 ||
+			header->max_chain_nodes < 1 || header->value_size < 0 ||
+			header->hash_mix < LFHT_MIX_NONE || header->hash_mix > LFHT_MIX_MULTIPLY) {
+		munmap(map, size);
+		return NULL;
+	}
+
+	// offsets must be sorted and inside the file
+	int buckets = 1 << header->root_hash_size;
+	const uint64_t *offsets = (const uint64_t *) (map + sizeof(struct lfht_snapshot_header));
+	uint64_t records = sizeof(struct lfht_snapshot_header) + (buckets + 1) * sizeof(uint64_t);
+	if(records > size || offsets[0] != records || offsets[buckets] > size) {
+		munmap(map, size);
+		return NULL;
+	}
+	for(int i = 0; i < buckets; i++) {
+		if(offsets[i] > offsets[i+1] || offsets[i] % 8) {
+			munmap(map, size);
+			return NULL;
+		}
+	}
+
+	struct lfht_head *lfht = init_lfht_explicit(
+			max_threads,
+			header->root_hash_size,
+			header->hash_size,
+			header->max_chain_nodes);
+	lfht->hash_mix = header->hash_mix;
+	lfht->value_size = header->value_size;
+	lfht->multimap = header->flags & SNAPSHOT_MULTIMAP;
+	lfht->keys_only = (header->flags & SNAPSHOT_KEYS_ONLY) != 0;
+
+	struct lfht_snapshot_loader loader = {
+		.lfht = lfht,
+		.map = map,
+		.offsets = offsets,
+		.deserializer = value_deserializer
+	};
+	atomic_init(&(loader.next_bucket), 0);
+	atomic_init(&(loader.failed), 0);
+
+	// root buckets are independent, each is built privately
+	// and published with a single store
+	if(nthreads < 1) {
+		nthreads = 1;
+	}
+	pthread_t *threads = malloc(nthreads * sizeof(pthread_t));
+	int started = 0;
+	while(started < nthreads - 1 &&
+			!pthread_create(&(threads[started]), NULL, load_buckets, &loader)) {
+		started++;
+	}
+	load_buckets(&loader);
+	for(int i = 0; i < started; i++) {
+		pthread_join(threads[i], NULL);
+	}
+	free(threads);
+
+	if(value_deserializer || lfht->value_size) {
+		// values were copied out of the mapping
+		munmap(map, size);
+	} else {
+		lfht->snapshot_map = map;
+		lfht->snapshot_size = size;
+	}
+
+	if(atomic_load_explicit(&(loader.failed), memory_order_relaxed)) {
+		free_lfht(lfht);
+		return NULL;
+	}
+	return lfht;
+}
+
+size_t lfht_bulk_build(
+		struct lfht_head *lfht,
+		const struct lfht_pair *pairs,
+		size_t n,
+		int nthreads,
+		int thread_id)
+{
+	struct lfht_node *root = lfht->entry_hash;
+	int buckets = 1 << root->hash.size;
+
+	if(nthreads < 1) {
+		nthreads = 1;
+	}
+	thread_id = resolve_thread(lfht, thread_id);
+
+	struct lfht_bulk_build build = {
+		.lfht = lfht,
+		.input = pairs,
+		.n = n,
+		.nthreads = nthreads,
+		.counts = calloc((size_t) nthreads * buckets, sizeof(size_t)),
+		.pairs = malloc(n * sizeof(struct lfht_pair)),
+		.occupied = malloc(buckets)
+	};
+	atomic_init(&(build.next_bucket), 0);
+	atomic_init(&(build.count), 0);
+	for(int i = 0; i < buckets; i++) {
+		build.occupied[i] = link_load(
+				&(root->hash.array[i]),
+				memory_order_acquire) != root;
+	}
+
+	struct lfht_bulk_worker *workers = malloc(nthreads * sizeof(struct lfht_bulk_worker));
+	pthread_t *threads = malloc(nthreads * sizeof(pthread_t));
+	unsigned char *started = malloc(nthreads);
+	for(int i = 0; i < nthreads; i++) {
+		workers[i].build = &build;
+		workers[i].index = i;
+	}
+
+	for(build.phase = BULK_COUNT; build.phase <= BULK_BUILD; build.phase++) {
+		for(int i = 1; i < nthreads; i++) {
+			started[i] = !pthread_create(&(threads[i]), NULL, bulk_build_worker, &(workers[i]));
+		}
+		bulk_build_worker(&(workers[0]));
+		for(int i = 1; i < nthreads; i++) {
+			if(started[i]) {
+				pthread_join(threads[i], NULL);
+			} else {
+				// no thread for this slice, run it here
+				bulk_build_worker(&(workers[i]));
+			}
+		}
+
+		if(build.phase == BULK_COUNT) {
+			// counts -> first position of every slice's pairs,
+			// grouped by root bucket then ordered by slice
+			size_t pos = 0;
+			for(int i = 0; i < buckets; i++) {
+				for(int t = 0; t < nthreads; t++) {
+					size_t count = build.counts[(size_t) t * buckets + i];
+					build.counts[(size_t) t * buckets + i] = pos;
+					pos += count;
+				}
+			}
+		} else if(build.phase == BULK_SCATTER) {
+			// every slice now ends where the next one started,
+			// restore the group starts (backwards, slice 0 may be the last)
+			for(int i = buckets - 1; i >= 0; i--) {
+				build.counts[i] = i ? build.counts[(size_t) (nthreads - 1) * buckets + i - 1] : 0;
+			}
+		}
+	}
+
+	size_t count = atomic_load_explicit(&(build.count), memory_order_relaxed);
+	if(lfht->cache) {
+		atomic_fetch_add_explicit(
+				&(get_thread(lfht, thread_id)->entries),
+				count,
+				memory_order_relaxed);
+	}
+
+	// buckets holding entries already are merged by regular inserts
+	for(int i = 0; i < buckets; i++) {
+		if(!build.occupied[i]) {
+			continue;
+		}
+		size_t end = i + 1 < buckets ? build.counts[i+1] : n;
+		for(size_t j = build.counts[i]; j < end; j++) {
+			unsigned inserted;
+			search_insert(
+					lfht,
+					thread_id,
+					root,
+					build.pairs[j].hash,
+					build.pairs[j].value,
+					0,
+					&inserted);
+			count += inserted;
+		}
+	}
+
+	free(started);
+	free(threads);
+	free(workers);
+	free(build.occupied);
+	free(build.pairs);
+	free(build.counts);
+	return count;
+}
+
+int lfht_rebuild_root_quiescent(
+		struct lfht_head *lfht,
+		int root_hash_size)
+{
+	if(root_hash_size < 1 || root_hash_size > MAX_ROOT_BITS) {
+		return 0;
+	}
+	if(atomic_load_explicit(&(lfht->maintenance->active), memory_order_acquire)) {
+		// pending removals point to the current levels
+		return 0;
+	}
+	if(lfht->reclaim && oldest_reader(lfht) != ~0UL) {
+		// announced calls are the only ones a rebuild can see,
+		// they would walk the freed levels
+		return 0;
+	}
+
+	struct lfht_node **nodes = NULL;
+	size_t count = 0, size = 0;
+	collect_nodes(lfht->entry_hash, &nodes, &count, &size);
+	if(lfht->reclaim) {
+		collect_reclaimed(lfht, &nodes, &count, &size);
+	}
+	qsort(nodes, count, sizeof(struct lfht_node *), compare_nodes);
+
+	// valid leaves are kept (with their addresses, hot caches
+	// and expiry), invalid ones stay unreachable and unfreed
+	// like any removed leaf, unless no call keeps removed
+	// leaves (see: lfht_set_reclaim()), the rest is freed below
+	struct lfht_node **leaves = malloc((count + 1) * sizeof(struct lfht_node *));
+	size_t n = 0, freed = 0;
+	for(size_t i = 0; i < count; i++) {
+		if(i > 0 && nodes[i] == nodes[i-1]) {
+			continue;
+		}
+		if(nodes[i]->type == LEAF) {
+			if(!is_invalid(get_next(nodes[i]))) {
+				leaves[n++] = nodes[i];
+			} else if(lfht->reclaim) {
+				nodes[freed++] = nodes[i];
+			}
+		} else {
+			nodes[freed++] = nodes[i];
+		}
+	}
+
+	struct lfht_node *root = create_hash_node(lfht, root_hash_size, 0, NULL);
+	int buckets = 1 << root_hash_size;
+	size_t *start = calloc(buckets + 1, sizeof(size_t));
+	struct lfht_node **sorted = malloc((n + 1) * sizeof(struct lfht_node *));
+	for(size_t i = 0; i < n; i++) {
+		start[get_bucket_index(leaves[i]->leaf.hash, 0, root_hash_size) + 1]++;
+	}
+	for(int i = 0; i < buckets; i++) {
+		start[i+1] += start[i];
+	}
+	for(size_t i = 0; i < n; i++) {
+		int pos = get_bucket_index(leaves[i]->leaf.hash, 0, root_hash_size);
+		sorted[start[pos]++] = leaves[i];
+	}
+	size_t first = 0;
+	for(int i = 0; i < buckets; i++) {
+		link_store(
+				&(root->hash.array[i]),
+				relink_bucket(lfht, root, sorted + first, start[i] - first),
+				memory_order_relaxed);
+		first = start[i];
+	}
+
+	for(size_t i = 0; i < freed; i++) {
+		free_node(lfht, nodes[i]);
+	}
+	atomic_thread_fence(memory_order_release);
+	lfht->entry_hash = root;
+	lfht->root_hash_size = root_hash_size;
+
+	free(sorted);
+	free(start);
+	free(leaves);
+	free(nodes);
+	return 1;
+}
+
+int lfht_tune_root_quiescent(struct lfht_head *lfht)
+{
+	size_t n = 0;
+	walk_hash(lfht->entry_hash, count_visit, &n);
+
+	// smallest root holding full chains on average,
+	// most searches then end in a root bucket
+	int root_hash_size = lfht->hash_size;
+	while(root_hash_size < MAX_ROOT_BITS &&
+			n > ((size_t) lfht->max_chain_nodes << root_hash_size)) {
+		root_hash_size++;
+	}
+
+	// off by one bit is not worth a rebuild
+	int current = lfht->entry_hash->hash.size;
+	if(root_hash_size > current + 1 || root_hash_size < current - 1) {
+		if(lfht_rebuild_root_quiescent(lfht, root_hash_size)) {
+			return root_hash_size;
+		}
+	}
+	return current;
+}
+
+int lfht_start_maintenance(
+		struct lfht_head *lfht,
+		int thread_id,
+		long interval)
+{
+	struct lfht_maintenance *maintenance = lfht->maintenance;
+
+	if(thread_id >= lfht->max_threads) {
+		return 0;
+	}
+
+	int inactive = 0;
+	if(!atomic_compare_exchange_strong_explicit(
+				&(maintenance->active),
+				&inactive,
+				1,
+				memory_order_seq_cst,
+				memory_order_relaxed)) {
+		return 0;
+	}
+
+	// the change feed ring of an id has a single producer, so
+	// the id is taken out of registration until the thread stops
+	// (an auto id is registered by the maintenance thread itself)
+	struct lfht_thread *thread = thread_id >= 0 ?
+		get_thread(lfht, thread_id) :
+		NULL;
+	int unused = 0;
+	if(thread && !atomic_compare_exchange_strong_explicit(
+				&(thread->in_use),
+				&unused,
+				1,
+				memory_order_acq_rel,
+				memory_order_relaxed)) {
+		// registered by another thread
+		atomic_store_explicit(&(maintenance->active), 0, memory_order_release);
+		return 0;
+	}
+
+	atomic_store_explicit(&(maintenance->thread_id), thread_id, memory_order_relaxed);
+	maintenance->interval = interval;
+
+	if(pthread_create(&(maintenance->thread), NULL, maintenance_loop, lfht)) {
+		if(thread) {
+			atomic_store_explicit(&(thread->in_use), 0, memory_order_release);
+		}
+		atomic_store_explicit(&(maintenance->active), 0, memory_order_release);
+		return 0;
+	}
+	return 1;
+}
+
+void lfht_stop_maintenance(struct lfht_head *lfht)
+{
+	struct lfht_maintenance *maintenance = lfht->maintenance;
+
+	if(!atomic_exchange_explicit(&(maintenance->active), 0, memory_order_seq_cst)) {
+		return;
+	}
+	pthread_join(maintenance->thread, NULL);
+
+	int thread_id = atomic_load_explicit(&(maintenance->thread_id), memory_order_relaxed);
+	if(thread_id >= 0) {
+		// auto ids are released by the maintenance thread
+		atomic_store_explicit(
+				&(get_thread(lfht, thread_id)->in_use),
+				0,
+				memory_order_release);
+	}
+	atomic_store_explicit(&(maintenance->thread_id), LFHT_THREAD_AUTO, memory_order_relaxed);
+}
+
+int lfht_set_reclaim(struct lfht_head *lfht)
+{
+	if(lfht->value_size || lfht->hot_size || lfht->arena || lfht->snapshots) {
+		// pointers to leaves outlive the calls
+		return 0;
+	}
+	if(lfht->reclaim == NULL) {
+		struct lfht_reclaim *reclaim = aligned_alloc(
+				CACHE_SIZE,
+				(sizeof(struct lfht_reclaim) + CACHE_SIZE - 1) & ~(CACHE_SIZE - 1));
+		if(reclaim == NULL) {
+			return 0;
+		}
+		atomic_init(&(reclaim->epoch), 1);
+		atomic_init(&(reclaim->readers), 0);
+		atomic_init(&(reclaim->expansions[0]), 0);
+		atomic_init(&(reclaim->expansions[1]), 0);
+		reclaim->leaves = NULL;
+		reclaim->count = 0;
+		reclaim->size = 0;
+		lfht->reclaim = reclaim;
+	}
+	return 1;
+}
+
+int lfht_init_thread(struct lfht_head *lfht)
+{
+	for(int i = 0; i < lfht->max_threads; i++) {
+		struct lfht_thread *thread = atomic_load_explicit(
+				&(lfht->threads[i]),
+				memory_order_acquire);
+
+		if(thread == NULL) {
+			// first use of this id, claim it with its state
+			struct lfht_thread *new_thread = create_thread_state(lfht, 1, 0);
+			if(atomic_compare_exchange_strong_explicit(
+						&(lfht->threads[i]),
+						&thread,
+						new_thread,
+						memory_order_acq_rel,
+						memory_order_acquire)) {
+				set_registration(lfht, i);
+				return i;
+			}
+			free_thread_state(new_thread);
+		}
+
+		int expect = 0;
+		if(atomic_compare_exchange_strong_explicit(
+					&(thread->in_use),
+					&expect,
+					1,
+					memory_order_acq_rel,
+					memory_order_relaxed)) {
+			set_registration(lfht, i);
+			return i;
+		}
+	}
+	return -1;
+}
+
+void lfht_end_thread(struct lfht_head *lfht, int thread_id)
+{
+	for(int i = 0; i < registrations_count; i++) {
+		if(registrations[i].table_id == lfht->table_id &&
+				(thread_id < 0 || registrations[i].thread_id == thread_id)) {
+			thread_id = registrations[i].thread_id;
+			registrations[i] = registrations[--registrations_count];
+			break;
+		}
+	}
+	if(registrations_count == 0) {
+		// nothing left to leak at thread exit
+		free(registrations);
+		registrations = NULL;
+		registrations_size = 0;
+	}
+
+	if(thread_id < 0 || thread_id >= lfht->max_threads) {
+		return;
+	}
+
+	struct lfht_thread *thread = atomic_load_explicit(
+			&(lfht->threads[thread_id]),
+			memory_order_acquire);
+	if(thread) {
+		atomic_store_explicit(&(thread->in_use), 0, memory_order_release);
+	}
+}
+
+void *lfht_search(
+		struct lfht_head *lfht,
+		size_t hash,
+		int thread_id)
+{
+	struct lfht_call call = api_enter(lfht, thread_id, LFHT_OP_SEARCH, hash);
+	struct lfht_node *cnode = search_node(
+			lfht,
+			call.thread_id,
+			lfht->entry_hash,
+			call.hash);
+	api_exit(lfht, &call);
+	return cnode ? leaf_value(lfht, cnode) : NULL;
+}
+
+int lfht_search_value(
+		struct lfht_head *lfht,
+		size_t hash,
+		void **value,
+		int thread_id)
+{
+	struct lfht_call call = api_enter(lfht, thread_id, LFHT_OP_SEARCH, hash);
+	struct lfht_node *cnode = search_node(
+			lfht,
+			call.thread_id,
+			lfht->entry_hash,
+			call.hash);
+	api_exit(lfht, &call);
+	if(cnode == NULL) {
+		return 0;
+	}
+	*value = leaf_value(lfht, cnode);
+	return 1;
+}
+
+int lfht_search_copy(
+		struct lfht_head *lfht,
+		size_t hash,
+		void *value,
+		int thread_id)
+{
+	struct lfht_call call = api_enter(lfht, thread_id, LFHT_OP_SEARCH, hash);
+	struct lfht_node *cnode = search_node(
+			lfht,
+			call.thread_id,
+			lfht->entry_hash,
+			call.hash);
+	api_exit(lfht, &call);
+	if(cnode == NULL) {
+		return 0;
+	}
+	memcpy(value, &(cnode->leaf.value), lfht->value_size);
+	return 1;
+}
+
+int lfht_contains(
+		struct lfht_head *lfht,
+		size_t hash,
+		int thread_id)
+{
+	struct lfht_call call = api_enter(lfht, thread_id, LFHT_OP_SEARCH, hash);
+	struct lfht_node *cnode = search_node(
+			lfht,
+			call.thread_id,
+			lfht->entry_hash,
+			call.hash);
+	api_exit(lfht, &call);
+	return cnode != NULL;
+}
+
+struct lfht_node *lfht_insert(
+		struct lfht_head *lfht,
+		size_t hash,
+		void *value,
+		int thread_id)
+{
+	struct lfht_call call = api_enter(lfht, thread_id, LFHT_OP_INSERT, hash);
+	struct lfht_node *cnode = search_insert(
+			lfht,
+			call.thread_id,
+			lfht->entry_hash,
+			call.hash,
+			value,
+			0,
+			NULL);
+	api_exit(lfht, &call);
+	return cnode;
+}
+
+int lfht_insert_expiring(
+		struct lfht_head *lfht,
+		size_t hash,
+		void *value,
+		long expires,
+		int thread_id)
+{
+	unsigned inserted;
+	struct lfht_call call = api_enter(lfht, thread_id, LFHT_OP_INSERT, hash);
+	search_insert(
+			lfht,
+			call.thread_id,
+			lfht->entry_hash,
+			call.hash,
+			value,
+			expires,
+			&inserted);
+	api_exit(lfht, &call);
+	return inserted;
+}
+
+int lfht_add(
+		struct lfht_head *lfht,
+		size_t hash,
+		int thread_id)
+{
+	unsigned inserted;
+	struct lfht_call call = api_enter(lfht, thread_id, LFHT_OP_INSERT, hash);
+	search_insert(
+			lfht,
+			call.thread_id,
+			lfht->entry_hash,
+			call.hash,
+			NULL,
+			0,
+			&inserted);
+	api_exit(lfht, &call);
+	return inserted;
+}
+
+int lfht_insert_value(
+		struct lfht_head *lfht,
+		size_t hash,
+		void *value,
+		void **present,
+		int thread_id)
+{
+	unsigned inserted;
+	struct lfht_call call = api_enter(lfht, thread_id, LFHT_OP_INSERT, hash);
+	struct lfht_node *cnode = search_insert(
+			lfht,
+			call.thread_id,
+			lfht->entry_hash,
+			call.hash,
+			value,
+			0,
+			&inserted);
+	api_exit(lfht, &call);
+	if(!inserted && present) {
+		*present = leaf_value(lfht, cnode);
+	}
+	return inserted;
+}
+
+int lfht_insert_copy(
+		struct lfht_head *lfht,
+		size_t hash,
+		const void *value,
+		int thread_id)
+{
+	unsigned inserted;
+	struct lfht_call call = api_enter(lfht, thread_id, LFHT_OP_INSERT, hash);
+	search_insert(
+			lfht,
+			call.thread_id,
+			lfht->entry_hash,
+			call.hash,
+			(void *) value,
+			0,
+			&inserted);
+	api_exit(lfht, &call);
+	return inserted;
+}
+
+void lfht_remove(
+		struct lfht_head *lfht,
+		size_t hash,
+		int thread_id)
+{
+	struct lfht_call call = api_enter(lfht, thread_id, LFHT_OP_REMOVE, hash);
+	search_remove(
+			lfht,
+			call.thread_id,
+			lfht->entry_hash,
+			call.hash,
+			NULL);
+	api_exit(lfht, &call);
+}
+
+int lfht_remove_value(
+		struct lfht_head *lfht,
+		size_t hash,
+		void **value,
+		int thread_id)
+{
+	struct lfht_call call = api_enter(lfht, thread_id, LFHT_OP_REMOVE, hash);
+	struct lfht_node *cnode = search_remove(
+			lfht,
+			call.thread_id,
+			lfht->entry_hash,
+			call.hash,
+			NULL);
+	api_exit(lfht, &call);
+	if(cnode == NULL) {
+		return 0;
+	}
+	*value = leaf_value(lfht, cnode);
+	return 1;
+}
+
+int lfht_discard(
+		struct lfht_head *lfht,
+		size_t hash,
+		int thread_id)
+{
+	struct lfht_call call = api_enter(lfht, thread_id, LFHT_OP_REMOVE, hash);
+	struct lfht_node *cnode = search_remove(
+			lfht,
+			call.thread_id,
+			lfht->entry_hash,
+			call.hash,
+			NULL);
+	api_exit(lfht, &call);
+	return cnode != NULL;
+}
+
+int lfht_remove_pair(
+		struct lfht_head *lfht,
+		size_t hash,
+		void *value,
+		int thread_id)
+{
+	struct lfht_call call = api_enter(lfht, thread_id, LFHT_OP_REMOVE, hash);
+	struct lfht_node *cnode = search_remove(
+			lfht,
+			call.thread_id,
+			lfht->entry_hash,
+			call.hash,
+			&value);
+	api_exit(lfht, &call);
+	return cnode != NULL;
+}
+
+size_t lfht_search_all(
+		struct lfht_head *lfht,
+		size_t hash,
+		lfht_visitor visitor,
+		void *arg,
+		int thread_id)
+{
+	struct lfht_node *found[SEARCH_ALL_STACK];
+	struct lfht_search_all all = {
+		.hash = mix_hash(lfht, hash),
+		.found = found,
+		.count = 0,
+		.size = SEARCH_ALL_STACK
+	};
+	if(lfht->reclaim) {
+		thread_id = resolve_thread(lfht, thread_id);
+		reclaim_enter(lfht, thread_id);
+	}
+	search_all_hash(lfht, lfht->entry_hash, &all);
+
+	// leaves being moved by an expansion may be found twice
+	qsort(all.found, all.count, sizeof(struct lfht_node *), compare_nodes);
+	size_t count = 0;
+	for(size_t i = 0; i < all.count; i++) {
+		if(i == 0 || all.found[i] != all.found[i-1]) {
+			visitor(hash, leaf_value(lfht, all.found[i]), arg);
+			count++;
+		}
+	}
+	if(lfht->reclaim) {
+		reclaim_exit(lfht, thread_id);
+	}
+
+	if(all.found != found) {
+		free(all.found);
+	}
+	return count;
+}
+
+void lfht_foreach(
+		struct lfht_head *lfht,
+		lfht_visitor visitor,
+		void *arg)
+{
+	struct lfht_foreach foreach = {
+		.lfht = lfht,
+		.visitor = visitor,
+		.arg = arg,
+		.now = lfht->expiry ? monotonic_time() : 0
+	};
+	if(lfht->reclaim) {
+		reclaim_enter(lfht, -1);
+	}
+	walk_hash(lfht->entry_hash, foreach_visit, &foreach);
+	if(lfht->reclaim) {
+		reclaim_exit(lfht, -1);
+	}
+}
+
+void lfht_scan_prefix(
+		struct lfht_head *lfht,
+		size_t prefix,
+		int prefix_bits,
+		lfht_visitor visitor,
+		void *arg)
+{
+	if(prefix_bits < 0) {
+		return;
+	}
+	if(prefix_bits > (int) (8 * sizeof(size_t))) {
+		// the whole hash, a single entry at most
+		prefix_bits = 8 * sizeof(size_t);
+	}
+
+	struct lfht_foreach foreach = {
+		.lfht = lfht,
+		.visitor = visitor,
+		.arg = arg,
+		.now = lfht->expiry ? monotonic_time() : 0
+	};
+	if(lfht->reclaim) {
+		reclaim_enter(lfht, -1);
+	}
+	walk_prefix(lfht->entry_hash, prefix, prefix_bits, foreach_visit, &foreach);
+	if(lfht->reclaim) {
+		reclaim_exit(lfht, -1);
+	}
+}
+
+struct lfht_sharded *init_lfht_sharded(
+		int shard_bits,
+		int max_threads,
+		enum lfht_hash_mix mix)
+{
+	if(shard_bits < 0 || shard_bits > ROOT_HASH_SIZE) {
+		return NULL;
+	}
+	int root_hash_size = ROOT_HASH_SIZE - shard_bits;
+	if(root_hash_size < HASH_SIZE) {
+		root_hash_size = HASH_SIZE;
+	}
+
+	struct lfht_sharded *sharded = malloc(sizeof(struct lfht_sharded));
+	if(sharded == NULL) {
+		return NULL;
+	}
+	sharded->shard_bits = shard_bits;
+	sharded->shards = malloc((1 << shard_bits) * sizeof(struct lfht_head *));
+	if(sharded->shards == NULL) {
+		free(sharded);
+		return NULL;
+	}
+	for(int i = 0; i < 1 << shard_bits; i++) {
+		sharded->shards[i] = init_lfht_explicit(
+				max_threads,
+				root_hash_size,
+				HASH_SIZE,
+				MAX_NODES);
+		if(sharded->shards[i] == NULL) {
+			while(i > 0) {
+				free_lfht(sharded->shards[--i]);
+			}
+			free(sharded->shards);
+			free(sharded);
+			return NULL;
+		}
+		lfht_set_hash_mix(sharded->shards[i], mix);
+	}
+	return sharded;
+}
+
+void free_lfht_sharded(struct lfht_sharded *sharded)
+{
+	for(int i = 0; i < 1 << sharded->shard_bits; i++) {
+		free_lfht(sharded->shards[i]);
+	}
+	free(sharded->shards);
+	free(sharded);
+}
+
+struct lfht_head *lfht_shard(
+		struct lfht_sharded *sharded,
+		size_t hash)
+{
+	if(sharded->shard_bits == 0) {
+		return sharded->shards[0];
+	}
+	// shards share the mix, the trie of each one
+	// consumes the low bits of the same mixed hash
+	size_t mixed = mix_hash(sharded->shards[0], hash);
+	return sharded->shards[mixed >> (8 * sizeof(size_t) - sharded->shard_bits)];
+}
+
+void lfht_sharded_foreach(
+		struct lfht_sharded *sharded,
+		lfht_visitor visitor,
+		void *arg)
+{
+	for(int i = 0; i < 1 << sharded->shard_bits; i++) {
+		lfht_foreach(sharded->shards[i], visitor, arg);
+	}
+}
+
+size_t lfht_sharded_size(struct lfht_sharded *sharded)
+{
+	size_t size = 0;
+	for(int i = 0; i < 1 << sharded->shard_bits; i++) {
+		size += lfht_size(sharded->shards[i]);
+	}
+	return size;
+}
+
+size_t lfht_sharded_count(struct lfht_sharded *sharded)
+{
+	size_t count = 0;
+	for(int i = 0; i < 1 << sharded->shard_bits; i++) {
+		count += lfht_count(sharded->shards[i]);
+	}
+	return count;
+}
+
+// auxiliary functions
+
+// shared -> state of SHARED_THREAD(lfht), used by several threads
+struct lfht_thread *create_thread_state(
+		struct lfht_head *lfht,
+		int in_use,
+		unsigned shared)
+{
+	size_t size = sizeof(struct lfht_thread) +
+		lfht->hot_size*sizeof(struct lfht_node *);
+	size = (size + CACHE_SIZE - 1) & ~(CACHE_SIZE - 1);
+	struct lfht_thread *thread = aligned_alloc(CACHE_SIZE, size);
+	atomic_init(&(thread->in_use), in_use);
+	atomic_init(&(thread->entries), 0);
+	atomic_init(&(thread->updating), 0);
+	atomic_init(&(thread->inserts), 0);
+	thread->arena.next = NULL;
+	thread->arena.left = 0;
+	atomic_init(
+			&(thread->changes),
+			lfht->change_ring_size ? create_ring(lfht, shared) : NULL);
+	atomic_init(&(thread->unlinks), NULL);
+	atomic_init(&(thread->reading), 0);
+	thread->reading_depth = 0;
+	thread->trace = NULL;
+	if(lfht->trace_size && !shared) {
+		thread->trace = malloc(sizeof(struct lfht_trace_buffer));
+		atomic_init(&(thread->trace->count), 0);
+		thread->trace->dropped = 0;
+		thread->trace->size = lfht->trace_size;
+		thread->trace->hashes = malloc(lfht->trace_size*sizeof(uint64_t));
+		thread->trace->ops = malloc(lfht->trace_size);
+	}
+	thread->latency = NULL;
+	thread->path = LFHT_PATH_FAST;
+	if(lfht->latency_period && !shared) {
+		thread->latency = calloc(1, sizeof(struct lfht_latency_counts));
+	}
+	thread->hot_size = shared ? 0 : lfht->hot_size;
+	for(unsigned int i = 0; i < thread->hot_size; i++) {
+		thread->hot[i] = NULL;
+	}
+	return thread;
+}
+
+// shared -> ring of SHARED_THREAD(lfht), of size 0 as rings
+//   have a single producer
+struct lfht_ring *create_ring(
+		struct lfht_head *lfht,
+		unsigned shared)
+{
+	size_t size = shared ? 0 : lfht->change_ring_size;
+	size_t bytes = sizeof(struct lfht_ring) + size*sizeof(struct lfht_change);
+	struct lfht_ring *ring = aligned_alloc(
+			CACHE_SIZE,
+			(bytes + CACHE_SIZE - 1) & ~(CACHE_SIZE - 1));
+	atomic_init(&(ring->head), 0);
+	atomic_init(&(ring->lost), 0);
+	atomic_init(&(ring->tail), 0);
+	ring->size = size;
+	return ring;
+}
+
+void free_thread_state(struct lfht_thread *thread)
+{
+	free(atomic_load_explicit(&(thread->changes), memory_order_relaxed));
+	free(atomic_load_explicit(&(thread->unlinks), memory_order_relaxed));
+	if(thread->trace) {
+		free(thread->trace->hashes);
+		free(thread->trace->ops);
+		free(thread->trace);
+	}
+	free(thread->latency);
+	free(thread);
+}
+
+// appends an event to the change feed of thread_id, at the
+// linearization point of the update (see: lfht_set_change_feed())
+void record_change(
+		struct lfht_head *lfht,
+		int thread_id,
+		enum lfht_change_type type,
+		struct lfht_node *cnode)
+{
+	struct lfht_thread *thread = get_thread(lfht, thread_id);
+	struct lfht_ring *ring = atomic_load_explicit(
+			&(thread->changes),
+			memory_order_acquire);
+	if(ring == NULL) {
+		// state created before lfht_set_change_feed(), by
+		// lfht_init_thread() or lfht_bulk_build()
+		struct lfht_ring *new_ring = create_ring(
+				lfht,
+				thread_id == SHARED_THREAD(lfht));
+		if(atomic_compare_exchange_strong_explicit(
+					&(thread->changes),
+					&ring,
+					new_ring,
+					memory_order_acq_rel,
+					memory_order_acquire)) {
+			ring = new_ring;
+		} else {
+			free(new_ring);
+		}
+	}
+	size_t head = atomic_load_explicit(&(ring->head), memory_order_relaxed);
+
+	if(head - atomic_load_explicit(&(ring->tail), memory_order_acquire) == ring->size) {
+		atomic_fetch_add_explicit(&(ring->lost), 1, memory_order_relaxed);
+		return;
+	}
+
+	struct lfht_change *change = &(ring->events[head & (ring->size - 1)]);
+	change->type = type;
+	change->hash = unmix_hash(lfht, cnode->leaf.hash);
+	change->value = leaf_value(lfht, cnode);
+	change->id = (uintptr_t) cnode;
+	atomic_store_explicit(&(ring->head), head + 1, memory_order_release);
+}
+
+void trace_op(
+		struct lfht_head *lfht,
+		int thread_id,
+		enum lfht_op op,
+		size_t hash)
+{
+	struct lfht_trace_buffer *trace = get_thread(lfht, thread_id)->trace;
+	if(trace == NULL) {
+		// SHARED_THREAD(lfht), not traced
+		return;
+	}
+	size_t count = atomic_load_explicit(&(trace->count), memory_order_relaxed);
+	if(count == trace->size) {
+		trace->dropped++;
+		return;
+	}
+	trace->hashes[count] = hash;
+	trace->ops[count] = op;
+	// the events before count may be written out concurrently
+	atomic_store_explicit(&(trace->count), count + 1, memory_order_release);
+}
+
+// returns: start time of the call if it is sampled, 0 if not
+long latency_start(
+		struct lfht_head *lfht,
+		int thread_id)
+{
+	if(latency_countdown) {
+		latency_countdown--;
+		return 0;
+	}
+	latency_countdown = lfht->latency_period - 1;
+	struct lfht_thread *thread = get_thread(lfht, thread_id);
+	if(thread->latency == NULL) {
+		// SHARED_THREAD(lfht), not sampled
+		return 0;
+	}
+	thread->path = LFHT_PATH_FAST;
+	return monotonic_time();
+}
+
+void latency_end(
+		struct lfht_head *lfht,
+		int thread_id,
+		enum lfht_op op,
+		long start)
+{
+	struct lfht_thread *thread = get_thread(lfht, thread_id);
+	// only this thread writes its counts
+	_Atomic(size_t) *count = &(thread->latency->buckets[op][thread->path]
+			[latency_bucket(monotonic_time() - start)]);
+	atomic_store_explicit(
+			count,
+			atomic_load_explicit(count, memory_order_relaxed) + 1,
+			memory_order_relaxed);
+}
+
+// records that the call in progress took a slower path
+void tag_path(
+		struct lfht_head *lfht,
+		int thread_id,
+		enum lfht_path path)
+{
+	struct lfht_thread *thread = get_thread(lfht, thread_id);
+	if(thread->latency && thread->path < path) {
+		thread->path = path;
+	}
+}
+
+int latency_bucket(long ns)
+{
+	if(ns < (1 << LATENCY_SUB_BITS)) {
+		return ns < 0 ? 0 : ns;
+	}
+
+	int log = LATENCY_SUB_BITS;
+	while(log < 62 && (ns >> (log + 1))) {
+		log++;
+	}
+	int bucket = ((log - LATENCY_SUB_BITS + 1) << LATENCY_SUB_BITS) +
+		((ns >> (log - LATENCY_SUB_BITS)) & ((1 << LATENCY_SUB_BITS) - 1));
+	return bucket < LFHT_LATENCY_BUCKETS ? bucket : LFHT_LATENCY_BUCKETS - 1;
+}
+
+// returns: lowest latency of bucket
+long latency_bucket_start(int bucket)
+{
+	if(bucket < (1 << LATENCY_SUB_BITS)) {
+		return bucket;
+	}
+
+	int log = (bucket >> LATENCY_SUB_BITS) + LATENCY_SUB_BITS - 1;
+	long sub = (1 << LATENCY_SUB_BITS) + (bucket & ((1 << LATENCY_SUB_BITS) - 1));
+	return sub << (log - LATENCY_SUB_BITS);
+}
+
+// state of a thread id, allocated on its first use
+struct lfht_thread *get_thread(
+		struct lfht_head *lfht,
+		int thread_id)
+{
+	struct lfht_thread *thread = atomic_load_explicit(
+			&(lfht->threads[thread_id]),
+			memory_order_acquire);
+
+	if(thread == NULL) {
+		struct lfht_thread *new_thread = create_thread_state(
+				lfht,
+				0,
+				thread_id == SHARED_THREAD(lfht));
+		if(atomic_compare_exchange_strong_explicit(
+					&(lfht->threads[thread_id]),
+					&thread,
+					new_thread,
+					memory_order_acq_rel,
+					memory_order_acquire)) {
+			return new_thread;
+		}
+		free_thread_state(new_thread);
+	}
+	return thread;
+}
+
+// LFHT_THREAD_AUTO -> id registered by the calling thread
+int resolve_thread(
+		struct lfht_head *lfht,
+		int thread_id)
+{
+#if LFHT_DEBUG
+	// no other thread may use the id of a running maintenance thread
+	assert(maintained == lfht || thread_id < 0 ||
+			thread_id != atomic_load_explicit(
+				&(lfht->maintenance->thread_id),
+				memory_order_relaxed) ||
+			!atomic_load_explicit(&(lfht->maintenance->active), memory_order_relaxed));
+#endif
+	if(thread_id >= 0) {
+		return thread_id;
+	}
+
+	for(int i = registrations_count - 1; i >= 0; i--) {
+		if(registrations[i].table_id == lfht->table_id) {
+			return registrations[i].thread_id;
+		}
+	}
+
+	thread_id = lfht_init_thread(lfht);
+	if(thread_id < 0) {
+		// more than max_threads threads registered
+		thread_id = SHARED_THREAD(lfht);
+		set_registration(lfht, thread_id);
+	}
+	return thread_id;
+}
+
+// common start of the API calls on a hash: resolves the thread
+// id, traces the call, starts its latency sample and mixes hash
+struct lfht_call api_enter(
+		struct lfht_head *lfht,
+		int thread_id,
+		enum lfht_op op,
+		size_t hash)
+{
+	struct lfht_call call;
+	call.thread_id = resolve_thread(lfht, thread_id);
+	if(lfht->reclaim) {
+		reclaim_enter(lfht, call.thread_id);
+	}
+	if(lfht->trace_size) {
+		trace_op(lfht, call.thread_id, op, hash);
+	}
+	call.op = op;
+	call.start = lfht->latency_period ?
+		latency_start(lfht, call.thread_id) :
+		0;
+	call.hash = mix_hash(lfht, hash);
+	return call;
+}
+
+void api_exit(
+		struct lfht_head *lfht,
+		struct lfht_call *call)
+{
+	if(call->start) {
+		latency_end(lfht, call->thread_id, call->op, call->start);
+	}
+	if(lfht->reclaim) {
+		reclaim_exit(lfht, call->thread_id);
+	}
+}
+
+void set_registration(
+		struct lfht_head *lfht,
+		int thread_id)
+{
+	for(int i = 0; i < registrations_count; i++) {
+		if(registrations[i].table_id == lfht->table_id) {
+			registrations[i].thread_id = thread_id;
+			return;
+		}
+	}
+
+	if(registrations_count == registrations_size) {
+		registrations_size = registrations_size ? 2*registrations_size : 4;
+		registrations = realloc(
+				registrations,
+				registrations_size*sizeof(struct lfht_registration));
+	}
+	registrations[registrations_count].table_id = lfht->table_id;
+	registrations[registrations_count].thread_id = thread_id;
+	registrations_count++;
+}
+
+struct lfht_node *create_freeze_node(
+		struct lfht_head *lfht,
+		struct lfht_node *next)
+{
+	struct lfht_node *node = alloc_node(lfht, sizeof(struct lfht_node), FREEZE);
+	check_link_address(node);
+	node->type = FREEZE;
+	atomic_init(&(node->referenced), 0);
+	node->leaf.hash = 0;
+	node->leaf.value = NULL;
+
+	link_init(&(node->leaf.next), next);
+
+#if LFHT_DEBUG
+	assert(next);
+	// a compression node should NEVER point
+	// to another compression node
+	assert(!is_compression_node(next));
+#endif
+
+	return node;
+}
+
+struct lfht_node *create_unfreeze_node(
+		struct lfht_head *lfht,
+		struct lfht_node *next)
+{
+	struct lfht_node *node = alloc_node(lfht, sizeof(struct lfht_node), UNFREEZE);
+	check_link_address(node);
+	node->type = UNFREEZE;
+	atomic_init(&(node->referenced), 0);
+	node->leaf.hash = 0;
+	node->leaf.value = NULL;
+
+	link_init(&(node->leaf.next), next);
+
+#if LFHT_DEBUG
+	assert(next);
+	assert(!is_compression_node(next));
+#endif
+
+	return node;
+}
+
+// value_size > 0 -> the value_size bytes at "value" are copied
+//   into the leaf
+// keys_only -> the leaf ends before its value, "value" is ignored
+// expires is stored after the value if the table has expiry
+// arena == NULL -> malloc()ed, otherwise taken from the arena
+// (always in compact tables, see: arena_alloc())
+struct lfht_node *create_leaf_node(
+		struct lfht_head *lfht,
+		struct lfht_arena *arena,
+		size_t hash,
+		void *value,
+		long expires,
+		struct lfht_node *next)
+{
+	size_t value_size = lfht->value_size;
+	struct lfht_node *node = lfht->arena ?
+		arena_alloc(lfht, arena, leaf_size(lfht)) :
+		malloc(leaf_size(lfht));
+	check_link_address(node);
+	if(lfht->expiry) {
+		*leaf_expiry(lfht, node) = expires;
+	}
+	if(lfht->snapshots) {
+		// built outside of updates (see: build_bucket()),
+		// visible to every snapshot until removed
+		atomic_init(&(leaf_epochs(lfht, node)[0]), 0);
+		atomic_init(&(leaf_epochs(lfht, node)[1]), EPOCH_NEVER);
+	}
+	node->type = LEAF;
+	// new entries survive their first sweep
+	atomic_init(&(node->referenced), 1);
+	node->leaf.hash = hash;
+	if(value_size && value) {
+		memcpy(&(node->leaf.value), value, value_size);
+	} else if(value_size) {
+		// lfht_add(), NULL -> zero filled
+		memset(&(node->leaf.value), 0, value_size);
+	} else if(!lfht->keys_only) {
+		node->leaf.value = value;
+	}
+
+	link_init(&(node->leaf.next), next);
+
+	return node;
+}
+
+size_t leaf_size(struct lfht_head *lfht)
+{
+	size_t size = sizeof(struct lfht_node);
+	if(offsetof(struct lfht_node, leaf.value) + lfht->value_size > size) {
+		size = offsetof(struct lfht_node, leaf.value) + lfht->value_size;
+	}
+	if(lfht->keys_only) {
+		size = offsetof(struct lfht_node, leaf.value);
+	}
+	if(lfht->expiry) {
+		size = expiry_offset(lfht) + sizeof(long);
+	}
+	if(lfht->snapshots) {
+		size = epochs_offset(lfht) + 2 * sizeof(unsigned long);
+	}
+	return size;
+}
+
+// takes size bytes (rounded up to ARENA_ALIGN) from the arena's
+// chunk, starting a new one when it is used up
+// chunks of compact tables are carved from their mapping
+void *arena_alloc(
+		struct lfht_head *lfht,
+		struct lfht_arena *arena,
+		size_t size)
+{
+	size = (size + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1);
+	if(arena == NULL || size > ARENA_CHUNK - ARENA_HEADER) {
+#if LFHT_COMPACT
+		return compact_alloc(lfht, size, 0);
+#else
+		// shared thread id or larger than a chunk, malloc()ed
+		// on its own and listed with the chunks for free_lfht()
+		char *chunk = malloc(ARENA_HEADER + size);
+		arena_add_chunk(lfht, chunk);
+		return chunk + ARENA_HEADER;
+#endif
+	}
+	if(arena->left < size) {
+#if LFHT_COMPACT
+		arena->next = compact_alloc(lfht, ARENA_CHUNK, 0);
+		arena->left = ARENA_CHUNK;
+#else
+		char *chunk = malloc(ARENA_CHUNK);
+		arena_add_chunk(lfht, chunk);
+		arena->next = chunk + ARENA_HEADER;
+		arena->left = ARENA_CHUNK - ARENA_HEADER;
+#endif
+	}
+	void *ptr = arena->next;
+	arena->next += size;
+	arena->left -= size;
+	return ptr;
+}
+
+// pushes chunk on the table's list of chunks
+void arena_add_chunk(
+		struct lfht_head *lfht,
+		char *chunk)
+{
+	void *head = atomic_load_explicit(
+			&(lfht->arena_chunks),
+			memory_order_relaxed);
+	do {
+		*(void **) chunk = head;
+	} while(!atomic_compare_exchange_weak_explicit(
+				&(lfht->arena_chunks),
+				&head,
+				chunk,
+				memory_order_release,
+				memory_order_relaxed));
+}
+
+// returns the last allocation of an arena,
+// anything else stays until free_lfht()
+void arena_free(
+		struct lfht_arena *arena,
+		void *ptr,
+		size_t size)
+{
+	size = (size + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1);
+	if(arena && (char *) ptr + size == arena->next) {
+		arena->next -= size;
+		arena->left += size;
+	}
+}
+
+// hash nodes are malloc()ed, as well as freeze and unfreeze
+// nodes, unless the table is compact
+void *alloc_node(
+		struct lfht_head *lfht,
+		size_t size,
+		enum ntype type)
+{
+#if LFHT_COMPACT
+	return compact_alloc(lfht, size, type == HASH);
+#else
+	(void) lfht;
+	(void) type;
+	return malloc(size);
+#endif
+}
+
+// frees a node of alloc_node(), or a leaf outside of arenas
+void free_node(
+		struct lfht_head *lfht,
+		struct lfht_node *node)
+{
+#if LFHT_COMPACT
+	if(node->type == HASH) {
+		compact_free(lfht, node, hash_node_size(lfht, node->hash.size), 1);
+	} else {
+		compact_free(lfht, node, node->type == LEAF ? leaf_size(lfht) : sizeof(struct lfht_node), 0);
+	}
+#else
+	(void) lfht;
+	free(node);
+#endif
+}
+
+// bytes of a hash node with 2^size buckets, and their
+// filter words (see: filter_word())
+size_t hash_node_size(
+		struct lfht_head *lfht,
+		int size)
+{
+	size_t filter_size = lfht->filter ? ((size_t) 1 << size) * sizeof(uint64_t) : 0;
+	return sizeof(struct lfht_node) + ((size_t) 1 << size) * sizeof(lfht_link) + filter_size;
+}
+
+#if LFHT_COMPACT
+// maps the region of a compact table, aligned by mapping twice
+// its size and unmapping what is left on either side
+// pages are only backed once touched
+// returns: NULL if it could not be mapped
+struct lfht_compact *create_compact()
+{
+	char *map = mmap(
+			NULL,
+			2 * COMPACT_REGION,
+			PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+			-1,
+			0);
+	if(map == MAP_FAILED) {
+		return NULL;
+	}
+	char *base = (char *) (((uintptr_t) map + COMPACT_REGION - 1) & ~(COMPACT_REGION - 1));
+	if(base > map) {
+		munmap(map, base - map);
+	}
+	munmap(base + COMPACT_REGION, map + 2 * COMPACT_REGION - (base + COMPACT_REGION));
+
+	struct lfht_compact *compact = malloc(sizeof(struct lfht_compact));
+	compact->base = base;
+	atomic_init(&(compact->used[0]), 0);
+	atomic_init(&(compact->used[1]), 0);
+	return compact;
+}
+
+// takes size bytes (rounded up to COMPACT_ALIGN) from a half of
+// the mapping, 0 -> leaves and compression nodes, 1 -> hash nodes
+// links cannot point past the mapping, running out of it aborts
+void *compact_alloc(
+		struct lfht_head *lfht,
+		size_t size,
+		int half)
+{
+	struct lfht_compact *compact = lfht->compact;
+	size = (size + COMPACT_ALIGN - 1) & ~(size_t) (COMPACT_ALIGN - 1);
+	// acquire: the bytes may have been handed back (see: compact_free())
+	size_t offset = atomic_fetch_add_explicit(
+			&(compact->used[half]),
+			size,
+			memory_order_acquire);
+	if(offset + size > COMPACT_HALF) {
+		fprintf(stderr,
+				"lfht: compact table out of %s space (%zu MiB)\n",
+				half ? "hash node" : "leaf",
+				(size_t) (COMPACT_HALF >> 20));
+		abort();
+	}
+	return compact->base + half * COMPACT_HALF + offset;
+}
+
+// hands the last allocation of a half back, and the whole pages
+// of anything else to the system, its addresses are not reused
+void compact_free(
+		struct lfht_head *lfht,
+		void *ptr,
+		size_t size,
+		int half)
+{
+	struct lfht_compact *compact = lfht->compact;
+	size = (size + COMPACT_ALIGN - 1) & ~(size_t) (COMPACT_ALIGN - 1);
+	size_t offset = (char *) ptr - (compact->base + half * COMPACT_HALF);
+	size_t end = offset + size;
+	if(atomic_compare_exchange_strong_explicit(
+				&(compact->used[half]),
+				&end,
+				offset,
+				memory_order_release,
+				memory_order_relaxed)) {
+		return;
+	}
+	uintptr_t page = sysconf(_SC_PAGESIZE);
+	uintptr_t first = ((uintptr_t) ptr + page - 1) & ~(page - 1);
+	uintptr_t last = ((uintptr_t) ptr + size) & ~(page - 1);
+	if(first < last) {
+		madvise((void *) first, last - first, MADV_DONTNEED);
+	}
+}
+#endif
+
+struct lfht_node *create_hash_node(
+		struct lfht_head *lfht,
+		int size,
+		int hash_pos,
+		struct lfht_node *prev)
+{
+	size_t filter_size = lfht->filter ? (1<<size)*sizeof(uint64_t) : 0;
+	struct lfht_node *node = alloc_node(lfht, hash_node_size(lfht, size), HASH);
+	check_link_address(node);
+	node->type = HASH;
+	atomic_init(&(node->referenced), 0);
+	node->hash.size = size;
+	node->hash.hash_pos = hash_pos;
+	node->hash.prev = prev;
+	node->hash.created = 0;
+	atomic_init(&(node->hash.skipped), 0);
+	for(int i=0; i < 1<<size; i++) {
+		link_init(&(node->hash.array[i]), node);
+	}
+	if(lfht->filter) {
+		memset(&(node->hash.array[1<<size]), 0, filter_size);
+	}
+	return node;
+}
+
+// for the current hash level, return the chunk of the
+// hash which indexes the bucket array (of size 2^w)
+int get_bucket_index(
+		size_t hash,
+		int hash_pos,
+		int size)
+{
+	// hash_pos does not increment 1 by 1
+	// it increments with the chunk size
+	return (hash >> hash_pos) & ((1 << size) - 1);
+}
+
+// bijective mixing of the caller's hash (see: lfht_set_hash_mix())
+size_t mix_hash(
+		struct lfht_head *lfht,
+		size_t hash)
+{
+	switch(lfht->hash_mix) {
+	case LFHT_MIX_MURMUR3:
+		return lfht_hash_u64(hash);
+	case LFHT_MIX_MULTIPLY:
+		hash *= 0x9E3779B97F4A7C15ULL;
+		return hash ^ (hash >> 32);
+	default:
+		return hash;
+	}
+}
+
+// inverse of mix_hash(), hashes are stored mixed
+size_t unmix_hash(
+		struct lfht_head *lfht,
+		size_t hash)
+{
+	switch(lfht->hash_mix) {
+	case LFHT_MIX_MURMUR3:
+		hash ^= hash >> 33;
+		hash *= 0x9CB4B2F8129337DBULL;
+		hash ^= hash >> 33;
+		hash *= 0x4F74430C22A54005ULL;
+		return hash ^ (hash >> 33);
+	case LFHT_MIX_MULTIPLY:
+		hash ^= hash >> 32;
+		return hash * 0xF1DE83E19937733DULL;
+	default:
+		return hash;
+	}
+}
+
+_Atomic(lfht_link) *get_atomic_bucket(
+		size_t hash,
+		struct lfht_node *hnode)
+{
+	int pos = get_bucket_index(
+			hash,
+			hnode->hash.hash_pos,
+			hnode->hash.size);
+
+	return &(hnode->hash.array[pos]);
+}
+
+// release-consume order get next
+struct lfht_node *get_next(
+		struct lfht_node *node)
+{
+#if LFHT_DEBUG
+		assert(node);
+		assert(&(node->leaf.next));
+		assert(node);
+#endif
+	//return atomic_load_explicit(
+	//		&(node->leaf.next),
+	//		memory_order_consume);
+
+	// avoiding hazards during compress operation WIP
+	struct lfht_node* nxt = link_load(
+			&(node->leaf.next),
+			memory_order_seq_cst);
+
+#if LFHT_DEBUG
+	assert(nxt);
+#endif
+	return unversioned(nxt);
+}
+
+// .next as stored, with its version, for CASes relinking it
+struct lfht_node *load_link(
+		struct lfht_node *node)
+{
+	return link_load(
+			&(node->leaf.next),
+			memory_order_seq_cst);
+}
+
+struct lfht_node *unversioned(
+		struct lfht_node *link)
+{
+#ifdef LINK_VERSION_SHIFT
+	return (struct lfht_node *) ((uintptr_t) link & ~LINK_VERSION_MASK);
+#else
+	return link;
+#endif
+}
+
+// node with the version following the one of expect
+struct lfht_node *versioned(
+		struct lfht_node *node,
+		struct lfht_node *expect)
+{
+#ifdef LINK_VERSION_SHIFT
+	uintptr_t version = (((uintptr_t) expect & LINK_VERSION_MASK) +
+			((uintptr_t) 1 << LINK_VERSION_SHIFT)) & LINK_VERSION_MASK;
+	return (struct lfht_node *) ((uintptr_t) node | version);
+#else
+	(void) expect;
+	return node;
+#endif
+}
+
+// a node whose address uses the version bits could not be linked
+// without corrupting it, the table cannot work on such a system
+void check_link_address(struct lfht_node *node)
+{
+#ifdef LINK_VERSION_SHIFT
+	if((uintptr_t) node & LINK_VERSION_MASK) {
+		fprintf(stderr,
+				"lfht: node at %p overlaps the link version bits %d to %d\n",
+				(void *) node,
+				LINK_VERSION_SHIFT,
+				LINK_VERSION_SHIFT + LINK_VERSION_BITS - 1);
+		abort();
+	}
+#else
+	(void) node;
+#endif
+}
+
+// value replacing expect in atomic, which is either
+// the bucket slot "bucket" or a chain link
+struct lfht_node *link_value(
+		struct lfht_node *node,
+		struct lfht_node *expect,
+		_Atomic(lfht_link) *atomic,
+		_Atomic(lfht_link) *bucket)
+{
+	return atomic == bucket ? node : versioned(node, expect);
+}
+
+// links are handled as pointers, with the invalid bit and the
+// version, and stored as such, except in compact tables
+// (LFHT_COMPACT): there the link holds the offset of the node in
+// the mapping that also holds "atomic" (every node of the table
+// is in it, see: COMPACT_REGION), with the invalid bit in bit 0
+// and the version in bits 1 to 4, left free by COMPACT_ALIGN
+// bit 31 of the offset is set for hash nodes (see: is_hash())
+lfht_link encode_link(
+		_Atomic(lfht_link) *atomic,
+		struct lfht_node *link)
+{
+#if LFHT_COMPACT
+	uintptr_t base = (uintptr_t) atomic & ~(COMPACT_REGION - 1);
+	return (lfht_link) (((uintptr_t) unversioned(link) - base) |
+			(((uintptr_t) link & LINK_VERSION_MASK) >> (LINK_VERSION_SHIFT - 1)));
+#else
+	(void) atomic;
+	return link;
+#endif
+}
+
+struct lfht_node *decode_link(
+		_Atomic(lfht_link) *atomic,
+		lfht_link link)
+{
+#if LFHT_COMPACT
+	uintptr_t base = (uintptr_t) atomic & ~(COMPACT_REGION - 1);
+	lfht_link version = link & (COMPACT_ALIGN - 2);
+	return (struct lfht_node *) ((base + (link - version)) |
+			((uintptr_t) version << (LINK_VERSION_SHIFT - 1)));
+#else
+	(void) atomic;
+	return link;
+#endif
+}
+
+struct lfht_node *link_load(
+		_Atomic(lfht_link) *atomic,
+		memory_order order)
+{
+	return decode_link(atomic, atomic_load_explicit(atomic, order));
+}
+
+void link_store(
+		_Atomic(lfht_link) *atomic,
+		struct lfht_node *link,
+		memory_order order)
+{
+	atomic_store_explicit(atomic, encode_link(atomic, link), order);
+}
+
+void link_init(
+		_Atomic(lfht_link) *atomic,
+		struct lfht_node *link)
+{
+	atomic_init(atomic, encode_link(atomic, link));
+}
+
+// strong compare and exchange, *expect is updated on failure
+unsigned link_cas(
+		_Atomic(lfht_link) *atomic,
+		struct lfht_node **expect,
+		struct lfht_node *desired,
+		memory_order success,
+		memory_order failure)
+{
+	lfht_link stored = encode_link(atomic, *expect);
+	if(atomic_compare_exchange_strong_explicit(
+				atomic,
+				&stored,
+				encode_link(atomic, desired),
+				success,
+				failure)) {
+		return 1;
+	}
+	*expect = decode_link(atomic, stored);
+	return 0;
+}
+
+// node->type == HASH, compact tables tell it from the address
+// of the node alone
+unsigned is_hash(struct lfht_node *node)
+{
+#if LFHT_COMPACT
+	return ((uintptr_t) node & COMPACT_HALF) != 0;
+#else
+	return node->type == HASH;
+#endif
+}
+
+// value of a leaf as seen by the API, the address
+// of the inline bytes for tables with a value_size,
+// NULL for leaves without a value
+void *leaf_value(
+		struct lfht_head *lfht,
+		struct lfht_node *cnode)
+{
+	if(lfht->keys_only) {
+		return NULL;
+	}
+	if(lfht->value_size) {
+		return &(cnode->leaf.value);
+	}
+	return cnode->leaf.value;
+}
+
+// equality of values as seen by the API
+// b == NULL with inline values -> a zero filled value (see: lfht_add())
+unsigned same_value(
+		struct lfht_head *lfht,
+		void *a,
+		void *b)
+{
+	if(lfht->value_size && b == NULL) {
+		for(size_t i = 0; i < lfht->value_size; i++) {
+			if(((unsigned char *) a)[i]) {
+				return 0;
+			}
+		}
+		return 1;
+	}
+	if(lfht->value_size) {
+		return !memcmp(a, b, lfht->value_size);
+	}
+	return a == b;
+}
+
+// we do not use an "is_valid" field.
+// to verify if a node is valid, the least significant bit
+// of the *next field is used (the address, not the node it
+// points to).
+//
+// validating a node using the mask ~1:
+// 0xFFFF & ~1 === 0xFFFF & 0xFFFE = 0xFFFE
+//
+// invalidating a node:
+// 0xFFFE | 1 === 0xFFFE | 0x0001 = 0xFFFF
+//
+// arg: the *next address of the node we want to invalidate
+// return: pointer masked with "valid"
+struct lfht_node *valid_ptr(struct lfht_node *next)
+{
+	return (struct lfht_node *) ((uintptr_t) next & ~1);
+}
+
+struct lfht_node *invalid_ptr(struct lfht_node *next)
+{
+	return (struct lfht_node *) ((uintptr_t) next | 1);
+}
+
+// mask address to get the valid/invalid bit flag
+// 
+// arg: the *next address of the node
+// return: the least significant bit of *next
+unsigned is_invalid(struct lfht_node *ptr)
+{
+	return (uintptr_t) ptr & 1;
+}
+
+unsigned is_compression_node(struct lfht_node *node)
+{
+	return node->type == FREEZE || node->type == UNFREEZE;
+}
+
+unsigned is_empty(struct lfht_node *hnode)
+{
+	for(int i = 0; i < (1<<hnode->hash.size); i++) {
+		struct lfht_node *head;
+		_Atomic(lfht_link) *nxt_atomic_bucket =
+			&(hnode->hash.array[i]);
+
+		head = link_load(
+				nxt_atomic_bucket,
+				memory_order_consume);
+
+		if(head != hnode) {
+			// bucket not empty
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+// hnode -> a level reached from a chain of hnode->hash.prev
+// a level freezes its own buckets only while its bucket in the
+// previous level holds it (see: compress()), so if a chain of
+// that bucket still leads to it, it was compressed since and
+// the chain was relinked in front of it by a stale adjust_node()
+// (freeze nodes pointing to a deeper level belong to the
+// compression of that level instead)
+// returns: 1 if hnode was removed from the trie
+unsigned is_removed(
+		struct lfht_node *hnode,
+		size_t hash)
+{
+	struct lfht_node *head = link_load(
+			get_atomic_bucket(hash, hnode),
+			memory_order_consume);
+	return head->type == FREEZE && get_next(head) == hnode;
+}
+
+long monotonic_time()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+// a freshly expanded level is kept around for a while,
+// even if empty, so a workload oscillating around
+// max_chain_nodes does not keep expanding and compressing it
+unsigned in_grace_period(
+		struct lfht_head *lfht,
+		struct lfht_node *hnode)
+{
+	if(lfht->compress_grace <= 0) {
+		return 0;
+	}
+	return monotonic_time() - hnode->hash.created < lfht->compress_grace;
+}
+
+int mark_invalid(struct lfht_node *cnode)
+{
+#if LFHT_DEBUG
+	assert(cnode);
+	assert(cnode->type == LEAF);
+#endif
+	struct lfht_node *expect = valid_ptr(load_link(cnode));
+
+	// replace .next with the invalid address
+	while(!link_cas(
+				&(cnode->leaf.next),
+				&expect,
+				invalid_ptr(expect),
+				memory_order_acq_rel,
+				memory_order_consume)) {
+#if LFHT_DEBUG
+		assert(expect);
+#endif
+		if(is_invalid(expect)) {
+			// node was invalidated by another thread
+			// aborting
+			return 0;
+		}
+	}
+	return 1;
+}
+
+// this function changes the values of *hnode, *nodeptr, count and *last_valid_atomic
+// *hnode -> will point to the hash node, containing the bucket of
+//   the target node
+// *nodeptr -> will point to the target node, if it exists, otherwise
+//   to the link after the last valid node, as stored (see: load_link())
+// count -> number of nodes of the last traversed chain up until the node was found,
+//   or the length of the chain if the node isn't present
+// *last_valid_atomic -> will point to an atomic node, 
+// pointer to the last valid node of the chain
+// value -> multimap: the node must also hold *value (NULL -> any value),
+//   nodes of the same hash are not counted
+//
+// returns: 0/1 success
+int find_node(
+		struct lfht_head *lfht,
+		int thread_id,
+		size_t hash,
+		void **value,
+		struct lfht_node **hnode,
+		struct lfht_node **nodeptr,
+		_Atomic(lfht_link) **last_valid_atomic,
+		unsigned int *count)
+{
+#if LFHT_DEBUG
+	int trial = 0;
+#endif
+
+start: ;
+#if LFHT_DEBUG
+	assert(nodeptr);
+	assert(hnode);
+	assert(*hnode);
+	assert((*hnode)->type == HASH);
+
+	struct lfht_stats* stats = lfht->stats[thread_id];
+	trial++;
+	if (stats->max_retry_counter < trial) {
+		stats->max_retry_counter = trial;
+	}
+#endif
+
+	_Atomic(lfht_link) *atomic_head =
+		get_atomic_bucket(hash, *hnode);
+
+	struct lfht_node *iter = link_load(
+			atomic_head,
+			memory_order_consume);
+
+	struct lfht_node *head = iter;
+	*nodeptr = head;
+
+	if(last_valid_atomic == NULL && lfht->filter && head->type == LEAF &&
+			!(atomic_load_explicit(
+					filter_word(*hnode, hash),
+					memory_order_seq_cst) & filter_bit(hash))) {
+		// hash never linked in this bucket (see: filter_add())
+		return 0;
+	}
+
+	if(is_compression_node(head)) {
+		// skip compression node
+		iter = valid_ptr(get_next(iter));
+#if LFHT_DEBUG
+		assert(iter);
+		assert(iter->type == HASH);
+#endif
+	}
+
+	if(last_valid_atomic) {
+		*last_valid_atomic = atomic_head;
+		*count = 0;
+	}
+
+	// traverse chain (tail points back to hash node)
+	while(iter != *hnode) {
+
+		if(is_hash(iter)) {
+			// travel down a level and search for the node there
+
+			// important loop!
+			// during adjust (after the node is pointed to its new level)
+			// there is a window when nodes may skip a level
+			while(iter->hash.prev != *hnode) {
+				iter = iter->hash.prev;
+			}
+
+			if(last_valid_atomic && head->type == LEAF) {
+				// bucket is being expanded to iter,
+				// help moving its chain before inserting
+				if(lfht->reclaim) {
+					begin_expansion(lfht->reclaim);
+				}
+				adjust_chain_step(lfht, thread_id, *hnode, iter, hash, NULL);
+				if(lfht->reclaim) {
+					end_expansion(lfht->reclaim);
+				}
+#if LFHT_DEBUG
+				stats->expansion_help_counter++;
+#endif
+			}
+
+			*hnode = iter;
+			goto start;
+		}
+#if LFHT_DEBUG
+		assert(!is_compression_node(head));
+		assert(iter->type == LEAF);
+#endif
+
+		struct lfht_node *nxt_link = load_link(iter);
+		struct lfht_node *nxt_iter = unversioned(nxt_link);
+		if(!is_invalid(nxt_iter)) {
+			// iter is a valid node
+
+			if(iter->leaf.hash == hash &&
+					(value == NULL || same_value(lfht, leaf_value(lfht, iter), *value))) {
+				if(lfht->expiry && is_expired(lfht, iter, monotonic_time())) {
+					// expired nodes are absent, remove it and
+					// start over, *hnode may have been compressed
+					remove_expired(lfht, thread_id, iter, *hnode);
+					*hnode = lfht->entry_hash;
+					goto start;
+				}
+				// found node
+				*nodeptr = iter;
+				return 1;
+			}
+			*nodeptr = nxt_link;
+
+			if(last_valid_atomic) {
+				*last_valid_atomic = &(iter->leaf.next);
+				if(iter->leaf.hash != hash) {
+					// values of one hash cannot be split by expansions
+					(*count)++;
+				}
+			}
+		}
+
+		// advance chain
+		iter = valid_ptr(nxt_iter);
+	}
+	return 0;
+}
+
+void make_unreachable(
+		struct lfht_head *lfht,
+		int thread_id,
+		struct lfht_node *cnode,
+		struct lfht_node *hnode)
+{
+	int trial = 0;
+
+start: ;
+	trial++;
+#if LFHT_DEBUG
+	assert(cnode);
+	assert(hnode);
+	assert(cnode->type == LEAF);
+	assert(hnode->type == HASH);
+
+	struct lfht_stats* stats = lfht->stats[thread_id];
+	if (stats->max_retry_counter < trial) {
+		stats->max_retry_counter = trial;
+	}
+#endif
+	struct lfht_node *iter;
+	struct lfht_node *nxt = valid_ptr(get_next(cnode));
+
+	while(nxt->type == LEAF) {
+		iter = get_next(nxt);
+		if(!is_invalid(iter)) {
+			// found next valid node of the chain
+			break;
+		}
+		nxt = valid_ptr(iter);
+	}
+	iter = nxt;
+
+	// advance to the next hash
+	while(!is_hash(iter)) {
+		iter = valid_ptr(get_next(iter));
+	}
+
+	if(iter != hnode && iter->hash.hash_pos < hnode->hash.hash_pos) {
+		// TODO: current hash level is collapsing on the previous level?
+		return;
+	}
+
+	if(nxt == iter && iter != hnode && iter->hash.prev == hnode &&
+			is_removed(iter, cnode->leaf.hash)) {
+		// cnode was relinked in front of a removed level (see:
+		// is_removed()), unlink it in the bucket of hnode
+		nxt = hnode;
+	} else if(iter != hnode) {
+		hnode = iter;
+		goto start;
+	}
+
+	int pos = get_bucket_index(
+			cnode->leaf.hash,
+			hnode->hash.hash_pos,
+			hnode->hash.size);
+	if(trial > 1) {
+		PROBE(unlink_retry, hnode->hash.hash_pos, pos, trial - 1);
+		if(lfht->latency_period) {
+			tag_path(lfht, thread_id, LFHT_PATH_RETRIED);
+		}
+	}
+	_Atomic(lfht_link) *observed_bucket = &(hnode->hash.array[pos]);
+	_Atomic(lfht_link) *prev_atomic = observed_bucket;
+	struct lfht_node *prev = link_load(
+			prev_atomic,
+			memory_order_consume);
+
+	if(is_compression_node(prev)) {
+		// skip compression node
+		prev = valid_ptr(get_next(prev));
+		return;
+	}
+
+	// let's find the last valid node before our target
+	iter = prev;
+	while(iter != cnode && iter->type == LEAF) {
+		struct lfht_node *nxt_link = load_link(iter);
+		struct lfht_node *nxt_ptr = unversioned(nxt_link);
+
+		if(!is_invalid(nxt_ptr)) {
+			// node is valid, storing its .next atomic field
+			prev_atomic = &(iter->leaf.next);
+			prev = nxt_link;
+		}
+		iter = valid_ptr(nxt_ptr);
+	}
+
+	if(iter == cnode) {
+		// try to disconnect our target from chain
+#if LFHT_DEBUG
+		if (unversioned(prev)->type ==HASH && nxt->type == HASH) {
+			assert(unversioned(prev) == nxt);
+		}
+#endif
+		INTERLEAVE(lfht);
+		if(link_cas(
+					prev_atomic,
+					&prev,
+					link_value(nxt, prev, prev_atomic, observed_bucket),
+					memory_order_acq_rel,
+					memory_order_consume)) {
+
+			if(observed_bucket == prev_atomic) {
+				// our removed node was the last of the chain
+				compress(lfht, thread_id, hnode, cnode->leaf.hash);
+			}
+
+			return;
+		}
+
+		goto start;
+	}
+}
+
+// remove functions
+
+// value -> multimap: remove the node holding *value (NULL -> any)
+// returns: the node removed by this call, NULL if none
+struct lfht_node *search_remove(
+		struct lfht_head *lfht,
+		int thread_id,
+		struct lfht_node *hnode,
+		size_t hash,
+		void **value)
+{
+#if LFHT_DEBUG
+	assert(hnode);
+	assert(hnode->type == HASH);
+#endif
+
+	struct lfht_node *cnode;
+	unsigned found = find_node(lfht, thread_id, hash, value, &hnode, &cnode, NULL, NULL);
+
+	if(atomic_load_explicit(&(hnode->hash.skipped), memory_order_relaxed) &&
+			!in_grace_period(lfht, hnode)) {
+		// empty levels past their grace period are not
+		// compressed otherwise, once no remove empties them
+		atomic_store_explicit(&(hnode->hash.skipped), 0, memory_order_relaxed);
+		compress(lfht, thread_id, hnode, hash);
+	}
+
+	if(!found) {
+		return NULL;
+	}
+
+	if(!remove_node(lfht, thread_id, cnode, hnode)) {
+		return NULL;
+	}
+	return cnode;
+}
+
+// invalidates cnode (found in hnode) and unlinks it
+// returns: 0/1 removed by this call
+unsigned remove_node(
+		struct lfht_head *lfht,
+		int thread_id,
+		struct lfht_node *cnode,
+		struct lfht_node *hnode)
+{
+	INTERLEAVE(lfht);
+	if(lfht->snapshots) {
+		if(!snapshot_remove(lfht, thread_id, cnode)) {
+			return 0;
+		}
+	} else if(!mark_invalid(cnode)) {
+		return 0;
+	}
+
+	if(lfht->change_ring_size) {
+		record_change(lfht, thread_id, LFHT_CHANGE_REMOVE, cnode);
+	}
+
+	if(lfht->cache) {
+		atomic_fetch_sub_explicit(
+				&(get_thread(lfht, thread_id)->entries),
+				1,
+				memory_order_relaxed);
+	}
+
+	struct lfht_maintenance *maintenance = lfht->maintenance;
+	if(atomic_load_explicit(&(maintenance->active), memory_order_acquire) &&
+			defer_unreachable(lfht, thread_id, cnode, hnode)) {
+		// unlinked later by the maintenance thread, unless it
+		// stopped meanwhile and may have drained the rings already
+		if(!atomic_load_explicit(&(maintenance->active), memory_order_seq_cst)) {
+			drain_unlinks(
+					lfht,
+					thread_id,
+					atomic_load_explicit(
+						&(get_thread(lfht, thread_id)->unlinks),
+						memory_order_relaxed));
+		}
+		return 1;
+	}
+
+	make_unreachable(lfht, thread_id, cnode, hnode);
+	return 1;
+}
+
+// mark_invalid() stamped with the epoch of the remove, leaves
+// removed while snapshots are active are also retired
+// returns: 0/1 invalidated by this call
+unsigned snapshot_remove(
+		struct lfht_head *lfht,
+		int thread_id,
+		struct lfht_node *cnode)
+{
+	struct lfht_snapshots *snapshots = lfht->snapshots;
+	unsigned long never = EPOCH_NEVER;
+
+	// allocated before the update, snapshots wait for it
+	struct lfht_retired *retired = NULL;
+	if(atomic_load_explicit(&(snapshots->active), memory_order_relaxed)) {
+		retired = malloc(sizeof(struct lfht_retired));
+	}
+	unsigned long epoch = begin_update(lfht, thread_id);
+
+	// removers racing for cnode are in the same epoch,
+	// unless it was removed before the last snapshot
+	// the first one to stamp it retires it, before invalidating
+	// it, so walks of snapshots that find it invalid then find
+	// it retired
+	if(atomic_compare_exchange_strong_explicit(
+				&(leaf_epochs(lfht, cnode)[1]),
+				&never,
+				epoch,
+				memory_order_relaxed,
+				memory_order_relaxed) &&
+			atomic_load_explicit(&(snapshots->active), memory_order_seq_cst)) {
+		if(retired == NULL) {
+			retired = malloc(sizeof(struct lfht_retired));
+		}
+		retired->node = cnode;
+		retired->next = atomic_load_explicit(
+				&(snapshots->retired),
+				memory_order_relaxed);
+		while(!atomic_compare_exchange_weak_explicit(
+					&(snapshots->retired),
+					&(retired->next),
+					retired,
+					memory_order_release,
+					memory_order_relaxed)) ;
+		retired = NULL;
+	}
+
+	unsigned removed = mark_invalid(cnode);
+	end_update(lfht, thread_id);
+	free(retired);
+	return removed;
+}
+
+// maintenance functions
+
+// pushes cnode on the unlink ring of thread_id, without
+// allocating: the ring is created by the first deferred remove
+// of the id, and a full one is left to the caller
+// returns: 0/1 deferred, 0 on SHARED_THREAD(lfht), whose
+//   ring would have several producers
+unsigned defer_unreachable(
+		struct lfht_head *lfht,
+		int thread_id,
+		struct lfht_node *cnode,
+		struct lfht_node *hnode)
+{
+	if(thread_id == SHARED_THREAD(lfht)) {
+		return 0;
+	}
+	struct lfht_thread *thread = get_thread(lfht, thread_id);
+	struct lfht_unlink_ring *ring = atomic_load_explicit(
+			&(thread->unlinks),
+			memory_order_relaxed);
+	if(ring == NULL) {
+		ring = aligned_alloc(CACHE_SIZE, sizeof(struct lfht_unlink_ring));
+		if(ring == NULL) {
+			return 0;
+		}
+		atomic_init(&(ring->head), 0);
+		atomic_init(&(ring->tail), 0);
+		// seq_cst like the pushes (see below)
+		atomic_store_explicit(&(thread->unlinks), ring, memory_order_seq_cst);
+	}
+
+	size_t head = atomic_load_explicit(&(ring->head), memory_order_relaxed);
+	if(head - atomic_load_explicit(&(ring->tail), memory_order_acquire) == UNLINK_RING) {
+		return 0;
+	}
+	struct lfht_unlink *slot = &(ring->nodes[head & (UNLINK_RING - 1)]);
+	atomic_store_explicit(&(slot->node), cnode, memory_order_relaxed);
+	atomic_store_explicit(&(slot->hnode), hnode, memory_order_relaxed);
+
+	// seq_cst: a remover that finds the maintenance thread still
+	// active after the push knows its last run will see it
+	atomic_store_explicit(&(ring->head), head + 1, memory_order_seq_cst);
+	return 1;
+}
+
+// takes the oldest node of ring, consumers race for it
+// with a CAS, as the remover may drain its own ring while
+// the maintenance thread runs for the last time
+// returns: 0/1 taken
+unsigned take_unlink(
+		struct lfht_unlink_ring *ring,
+		struct lfht_node **cnode,
+		struct lfht_node **hnode)
+{
+	size_t tail = atomic_load_explicit(&(ring->tail), memory_order_relaxed);
+	do {
+		if(tail == atomic_load_explicit(&(ring->head), memory_order_seq_cst)) {
+			return 0;
+		}
+		struct lfht_unlink *slot = &(ring->nodes[tail & (UNLINK_RING - 1)]);
+		*cnode = atomic_load_explicit(&(slot->node), memory_order_relaxed);
+		*hnode = atomic_load_explicit(&(slot->hnode), memory_order_relaxed);
+	} while(!atomic_compare_exchange_weak_explicit(
+				&(ring->tail),
+				&tail,
+				tail + 1,
+				memory_order_release,
+				memory_order_relaxed));
+	return 1;
+}
+
+// unlinks the nodes left in the ring of a remover that found
+// the maintenance thread stopped
+void drain_unlinks(
+		struct lfht_head *lfht,
+		int thread_id,
+		struct lfht_unlink_ring *ring)
+{
+	struct lfht_node *cnode, *hnode;
+	while(take_unlink(ring, &cnode, &hnode)) {
+		make_unreachable(lfht, thread_id, cnode, hnode);
+	}
+}
+
+// unlinks the nodes deferred by every thread id and compresses
+// the levels they leave empty
+//
+// retry -> levels whose compression was deferred in a previous run
+// returns: levels whose compression is still deferred
+struct lfht_pending *run_maintenance(
+		struct lfht_head *lfht,
+		int thread_id,
+		struct lfht_pending *retry)
+{
+	struct lfht_pending *deferred = NULL;
+
+	for(int i = 0; i < lfht->max_threads; i++) {
+		struct lfht_thread *thread = atomic_load_explicit(
+				&(lfht->threads[i]),
+				memory_order_acquire);
+		struct lfht_unlink_ring *ring = thread ?
+			atomic_load_explicit(&(thread->unlinks), memory_order_seq_cst) :
+			NULL;
+		if(ring == NULL) {
+			continue;
+		}
+
+		struct lfht_node *cnode, *hnode;
+		while(take_unlink(ring, &cnode, &hnode)) {
+			make_unreachable(lfht, thread_id, cnode, hnode);
+			if(lfht->reclaim) {
+				retire_leaf(lfht->reclaim, cnode, hnode);
+			}
+			if(hnode->hash.prev == NULL ||
+					!in_grace_period(lfht, hnode) ||
+					!is_empty(hnode)) {
+				continue;
+			}
+
+			// level too young to be compressed, try again later
+			// (or, without memory, on the next remove reaching it,
+			// see: lfht_node_hash.skipped)
+			struct lfht_pending *item = malloc(sizeof(struct lfht_pending));
+			if(item) {
+				item->hnode = hnode;
+				item->hash = cnode->leaf.hash;
+				item->next = deferred;
+				deferred = item;
+			}
+		}
+	}
+
+	while(retry) {
+		struct lfht_pending *item = retry;
+		retry = retry->next;
+		compress(lfht, thread_id, item->hnode, item->hash);
+
+		if(item->hnode->hash.prev != NULL &&
+				in_grace_period(lfht, item->hnode) &&
+				is_empty(item->hnode)) {
+			item->next = deferred;
+			deferred = item;
+			continue;
+		}
+		free(item);
+	}
+
+	if(lfht->reclaim) {
+		reclaim_leaves(lfht, thread_id);
+	}
+	return deferred;
+}
+
+// last run of the maintenance thread, once it stopped: removers
+// that pushed a node before it stopped are seen by this run,
+// later ones drain their own ring (see: remove_node())
+// levels still in their grace period are left to the next
+// remove reaching them (see: lfht_node_hash.skipped)
+void drain_pending(
+		struct lfht_head *lfht,
+		int thread_id,
+		struct lfht_pending *retry)
+{
+	retry = run_maintenance(lfht, thread_id, retry);
+
+	while(retry) {
+		struct lfht_pending *nxt = retry->next;
+		free(retry);
+		retry = nxt;
+	}
+
+	if(lfht->reclaim) {
+		// leaves checked by the last run are freed by the next
+		// one, if no call is in progress, the rest waits for
+		// the next start (or free_lfht())
+		reclaim_leaves(lfht, thread_id);
+	}
+}
+
+// reclamation functions
+
+// announces an API call, the maintenance thread frees no leaf
+// it found unlinked in or after the epoch of a call in progress
+// (the outermost one, calls may be nested in visitors)
+// thread_id < 0 -> call without an id (see: lfht_foreach()),
+//   counted in "readers" like the calls on SHARED_THREAD(lfht)
+void reclaim_enter(
+		struct lfht_head *lfht,
+		int thread_id)
+{
+	struct lfht_reclaim *reclaim = lfht->reclaim;
+
+	if(thread_id < 0 || thread_id == SHARED_THREAD(lfht)) {
+		atomic_fetch_add_explicit(&(reclaim->readers), 1, memory_order_relaxed);
+	} else {
+		struct lfht_thread *thread = get_thread(lfht, thread_id);
+		if(thread->reading_depth++ > 0) {
+			return;
+		}
+		atomic_store_explicit(
+				&(thread->reading),
+				atomic_load_explicit(&(reclaim->epoch), memory_order_relaxed),
+				memory_order_relaxed);
+	}
+	// announced before any link is read (see: oldest_reader())
+	atomic_thread_fence(memory_order_seq_cst);
+}
+
+void reclaim_exit(
 		struct lfht_head *lfht,
-		size_t hash,
-		void *value,
 		int thread_id)
 {
-	return search_insert(
+	struct lfht_reclaim *reclaim = lfht->reclaim;
+
+	if(thread_id < 0 || thread_id == SHARED_THREAD(lfht)) {
+		atomic_fetch_sub_explicit(&(reclaim->readers), 1, memory_order_release);
+		return;
+	}
+	struct lfht_thread *thread = get_thread(lfht, thread_id);
+	if(--thread->reading_depth == 0) {
+		atomic_store_explicit(&(thread->reading), 0, memory_order_release);
+	}
+}
+
+// brackets a chain migration, which may link a node
+// unlinked meanwhile in its new level (see: adjust_node())
+void begin_expansion(struct lfht_reclaim *reclaim)
+{
+	atomic_fetch_add_explicit(&(reclaim->expansions[0]), 1, memory_order_seq_cst);
+}
+
+void end_expansion(struct lfht_reclaim *reclaim)
+{
+	atomic_fetch_add_explicit(&(reclaim->expansions[1]), 1, memory_order_release);
+}
+
+// queues a leaf unlinked by the maintenance thread, a leaf
+// that cannot be queued is left unfreed like without reclamation
+void retire_leaf(
+		struct lfht_reclaim *reclaim,
+		struct lfht_node *cnode,
+		struct lfht_node *hnode)
+{
+	if(reclaim->count == reclaim->size) {
+		size_t size = reclaim->size ? 2 * reclaim->size : 1024;
+		struct lfht_retire *leaves = realloc(
+				reclaim->leaves,
+				size * sizeof(struct lfht_retire));
+		if(leaves == NULL) {
+			return;
+		}
+		reclaim->leaves = leaves;
+		reclaim->size = size;
+	}
+	reclaim->leaves[reclaim->count++] = (struct lfht_retire) {
+		.node = cnode,
+		.hnode = hnode,
+		.epoch = 0,
+		.expansions = 0
+	};
+}
+
+// oldest epoch announced by a call in progress
+// returns: 0 if a call without an epoch of its own is in
+//   progress, ~0UL if no call is
+unsigned long oldest_reader(struct lfht_head *lfht)
+{
+	struct lfht_reclaim *reclaim = lfht->reclaim;
+
+	// pairs with the fence of reclaim_enter(): a call this scan
+	// misses announced itself after it, so it reads the links
+	// as they are now
+	atomic_thread_fence(memory_order_seq_cst);
+	if(atomic_load_explicit(&(reclaim->readers), memory_order_relaxed)) {
+		return 0;
+	}
+
+	unsigned long oldest = ~0UL;
+	for(int i = 0; i < lfht->max_threads; i++) {
+		struct lfht_thread *thread = atomic_load_explicit(
+				&(lfht->threads[i]),
+				memory_order_acquire);
+		unsigned long reading = thread ?
+			atomic_load_explicit(&(thread->reading), memory_order_acquire) :
+			0;
+		if(reading && reading < oldest) {
+			oldest = reading;
+		}
+	}
+	return oldest;
+}
+
+// one reclamation step of a maintenance run:
+// 1. leaves found unlinked by a previous step are freed once
+//    every call announced up to that step has returned, and no
+//    migration started since, which could have linked them again
+//    (they are checked again otherwise)
+// 2. while no migration runs, the leaves not checked yet are
+//    looked up from the root, unlinked ones are stamped with
+//    the current epoch, linked ones are unlinked again
+// 3. the epoch advances, calls starting from now on cannot
+//    reach the leaves stamped in 2
+void reclaim_leaves(
+		struct lfht_head *lfht,
+		int thread_id)
+{
+	struct lfht_reclaim *reclaim = lfht->reclaim;
+
+	unsigned long oldest = oldest_reader(lfht);
+	unsigned long expansions = atomic_load_explicit(
+			&(reclaim->expansions[0]),
+			memory_order_seq_cst);
+	unsigned migrating = expansions != atomic_load_explicit(
+			&(reclaim->expansions[1]),
+			memory_order_seq_cst);
+	unsigned long epoch = atomic_load_explicit(&(reclaim->epoch), memory_order_relaxed);
+
+	size_t kept = 0;
+	for(size_t i = 0; i < reclaim->count; i++) {
+		struct lfht_retire leaf = reclaim->leaves[i];
+
+		if(leaf.epoch && leaf.expansions != expansions) {
+			leaf.epoch = 0;
+		}
+		if(leaf.epoch && leaf.epoch < oldest) {
+			free(leaf.node);
+#if LFHT_DEBUG
+			lfht->stats[thread_id]->reclaimed_counter++;
+#endif
+			continue;
+		}
+
+		if(leaf.epoch == 0 && !migrating) {
+			if(is_linked(lfht, leaf.node)) {
+				make_unreachable(lfht, thread_id, leaf.node, leaf.hnode);
+			} else {
+				leaf.epoch = epoch;
+				leaf.expansions = expansions;
+			}
+		}
+		reclaim->leaves[kept++] = leaf;
+	}
+	reclaim->count = kept;
+
+	atomic_fetch_add_explicit(&(reclaim->epoch), 1, memory_order_seq_cst);
+}
+
+// looks cnode up from the root, while no chain migrates
+// returns: 0/1 cnode is linked, 1 also if the lookup met a
+//   compression and cannot tell
+unsigned is_linked(
+		struct lfht_head *lfht,
+		struct lfht_node *cnode)
+{
+	size_t hash = cnode->leaf.hash;
+	struct lfht_node *hnode = lfht->entry_hash;
+
+start: ;
+	struct lfht_node *iter = link_load(
+			get_atomic_bucket(hash, hnode),
+			memory_order_acquire);
+
+	while(iter != hnode) {
+		if(is_compression_node(iter)) {
+			return 1;
+		}
+
+		if(iter->type == HASH) {
+			// important loop!
+			while(iter->hash.prev != hnode) {
+				if(iter->hash.prev == NULL) {
+					// chain of a level compressed meanwhile
+					return 1;
+				}
+				iter = iter->hash.prev;
+			}
+
+			hnode = iter;
+			goto start;
+		}
+
+		if(iter == cnode) {
+			return 1;
+		}
+		iter = valid_ptr(get_next(iter));
+	}
+	return 0;
+}
+
+// moves the leaves queued for reclamation to a node array of
+// free_lfht() or lfht_rebuild_root_quiescent(), no call is in progress
+void collect_reclaimed(
+		struct lfht_head *lfht,
+		struct lfht_node ***nodes,
+		size_t *count,
+		size_t *size)
+{
+	struct lfht_reclaim *reclaim = lfht->reclaim;
+
+	if(*count + reclaim->count > *size) {
+		*size = *count + reclaim->count;
+		*nodes = realloc(*nodes, *size * sizeof(struct lfht_node *));
+	}
+	for(size_t i = 0; i < reclaim->count; i++) {
+		(*nodes)[(*count)++] = reclaim->leaves[i].node;
+	}
+	reclaim->count = 0;
+}
+
+void *maintenance_loop(void *arg)
+{
+	struct lfht_head *lfht = arg;
+	struct lfht_maintenance *maintenance = lfht->maintenance;
+	struct lfht_pending *retry = NULL;
+#if LFHT_DEBUG
+	maintained = lfht;
+#endif
+	int thread_id = resolve_thread(
 			lfht,
-			thread_id,
-			lfht->entry_hash,
-			hash,
-			value);
+			atomic_load_explicit(&(maintenance->thread_id), memory_order_relaxed));
+	struct timespec interval = {
+		.tv_sec = maintenance->interval / 1000000000L,
+		.tv_nsec = maintenance->interval % 1000000000L
+	};
+
+	while(atomic_load_explicit(&(maintenance->active), memory_order_acquire)) {
+		lfht_expire(lfht, thread_id);
+		if(lfht->cache) {
+			long excess = count_entries(lfht) - (long) lfht->cache->capacity;
+			if(excess > 0) {
+				sweep(lfht, thread_id, excess);
+			}
+		}
+		retry = run_maintenance(lfht, thread_id, retry);
+		nanosleep(&interval, NULL);
+	}
+
+	drain_pending(lfht, thread_id, retry);
+
+	if(atomic_load_explicit(&(maintenance->thread_id), memory_order_relaxed) < 0) {
+		lfht_end_thread(lfht, thread_id);
+	}
+	return NULL;
+}
+
+// cache functions
+
+// sum of the per thread counters, concurrent updates may be missed
+long count_entries(struct lfht_head *lfht)
+{
+	long entries = 0;
+	for(int i = 0; i <= SHARED_THREAD(lfht); i++) {
+		struct lfht_thread *thread = atomic_load_explicit(
+				&(lfht->threads[i]),
+				memory_order_acquire);
+		if(thread) {
+			entries += atomic_load_explicit(
+					&(thread->entries),
+					memory_order_relaxed);
+		}
+	}
+	return entries;
+}
+
+// counts an insert, the inserting thread evicts
+// unless the maintenance thread is sweeping
+void cache_inserted(
+		struct lfht_head *lfht,
+		int thread_id)
+{
+	struct lfht_thread *thread = get_thread(lfht, thread_id);
+	atomic_fetch_add_explicit(&(thread->entries), 1, memory_order_relaxed);
+
+	// the table size is only checked every CACHE_CHECK inserts,
+	// counted atomically as several threads may insert through
+	// SHARED_THREAD(lfht)
+	unsigned int inserts = atomic_fetch_add_explicit(
+			&(thread->inserts),
+			1,
+			memory_order_relaxed);
+	if((inserts + 1) % CACHE_CHECK != 0 ||
+			atomic_load_explicit(&(lfht->maintenance->active), memory_order_relaxed)) {
+		return;
+	}
+
+	long excess = count_entries(lfht) - (long) lfht->cache->capacity;
+	if(excess > 0) {
+		sweep(lfht, thread_id, excess);
+	}
+}
+
+// CLOCK: sweeps root buckets from the hand, clearing reference
+// bits and evicting unreferenced leaves
+// returns: number of evicted leaves
+size_t sweep(
+		struct lfht_head *lfht,
+		int thread_id,
+		size_t excess)
+{
+	struct lfht_node *root = lfht->entry_hash;
+	unsigned int buckets = 1 << root->hash.size;
+	size_t evicted = 0;
+
+	// the first round may only clear reference bits
+	for(unsigned int i = 0; i < 2 * buckets && evicted < excess; i++) {
+		unsigned int pos = atomic_fetch_add_explicit(
+				&(lfht->cache->hand),
+				1,
+				memory_order_relaxed) & (buckets - 1);
+		evicted += sweep_bucket(lfht, thread_id, root, pos, excess - evicted);
+	}
+	return evicted;
+}
+
+size_t sweep_bucket(
+		struct lfht_head *lfht,
+		int thread_id,
+		struct lfht_node *hnode,
+		int pos,
+		size_t excess)
+{
+	size_t evicted = 0;
+	struct lfht_node *iter = link_load(
+			&(hnode->hash.array[pos]),
+			memory_order_consume);
+
+	if(is_compression_node(iter)) {
+		// skip compression node
+		iter = valid_ptr(get_next(iter));
+	}
+
+	while(iter != hnode && evicted < excess) {
+		if(iter->type == HASH) {
+			// important loop!
+			while(iter->hash.prev != hnode) {
+				iter = iter->hash.prev;
+			}
+
+			for(int i = 0; i < (1<<iter->hash.size) && evicted < excess; i++) {
+				evicted += sweep_bucket(lfht, thread_id, iter, i, excess - evicted);
+			}
+			return evicted;
+		}
+
+		struct lfht_node *nxt_ptr = get_next(iter);
+		if(!is_invalid(nxt_ptr)) {
+			if(atomic_load_explicit(&(iter->referenced), memory_order_relaxed)) {
+				// second chance
+				atomic_store_explicit(&(iter->referenced), 0, memory_order_relaxed);
+			} else if(remove_node(lfht, thread_id, iter, hnode)) {
+				evicted++;
+				if(lfht->cache->evict) {
+					lfht->cache->evict(
+							unmix_hash(lfht, iter->leaf.hash),
+							leaf_value(lfht, iter),
+							lfht->cache->arg);
+				}
+			}
+		}
+		iter = valid_ptr(nxt_ptr);
+	}
+	return evicted;
 }
 
-void lfht_remove(
-		struct lfht_head *lfht,
-		size_t hash,
-		int thread_id)
+// filter functions
+//
+// every bucket has a 64 bit filter word, with one bit set for
+// each hash ever linked in it. a search reaching a chain whose
+// filter lacks the bit of its hash misses without reading any leaf.
+// bits are never cleared, removed hashes only cost false positives
+// until their level is compressed or its chain moved to a new
+// level, which starts with empty filters
+
+// fingerprint of hash, the top 6 bits of a multiplicative mix
+// of all of its bits (so including the ones indexing buckets,
+// hashes of one bucket share them and do not bias the bit)
+uint64_t filter_bit(size_t hash)
 {
-	return search_remove(
-			lfht,
-			thread_id,
-			lfht->entry_hash,
-			hash);
+	return 1ULL << ((hash * 0x9E3779B97F4A7C15ULL) >> 58);
 }
 
-// auxiliary functions
+_Atomic(uint64_t) *filter_word(
+		struct lfht_node *hnode,
+		size_t hash)
+{
+	_Atomic(uint64_t) *filter =
+		(_Atomic(uint64_t) *) &(hnode->hash.array[1<<hnode->hash.size]);
+	return &(filter[get_bucket_index(
+				hash,
+				hnode->hash.hash_pos,
+				hnode->hash.size)]);
+}
 
-struct lfht_node *create_freeze_node(
-		struct lfht_node *next)
+// records hash in its bucket of hnode, before it is linked there
+//
+// chains being moved to deeper levels still hang from the buckets
+// of previous levels, and searches stop at those buckets' filters,
+// so the bit is also set on every previous level whose bucket
+// is still a chain (not only the closest one, expansions of the
+// levels a chain is moving to may complete first)
+void filter_add(
+		struct lfht_node *hnode,
+		size_t hash)
 {
-	struct lfht_node *node = malloc(sizeof(struct lfht_node));
-	node->type = FREEZE;
-	node->leaf.hash = 0;
-	node->leaf.value = NULL;
+	uint64_t bit = filter_bit(hash);
+	unsigned chain = 1;
+	while(hnode) {
+		_Atomic(uint64_t) *word = filter_word(hnode, hash);
+		// read first, filter words are shared by all readers
+		if(chain && !(atomic_load_explicit(word, memory_order_seq_cst) & bit)) {
+			atomic_fetch_or_explicit(word, bit, memory_order_seq_cst);
+		}
 
-	atomic_init(&(node->leaf.next), next);
+		hnode = hnode->hash.prev;
+		chain = hnode && link_load(
+				get_atomic_bucket(hash, hnode),
+				memory_order_seq_cst)->type == LEAF;
+	}
+}
 
-#if LFHT_DEBUG
-	assert(next);
-	// a compression node should NEVER point
-	// to another compression node
-	assert(!is_compression_node(next));
-#endif
+// expiry functions
 
-	return node;
+// offset of the expiry time in a leaf, after its value
+size_t expiry_offset(struct lfht_head *lfht)
+{
+	if(lfht->keys_only) {
+		return offsetof(struct lfht_node, leaf.value);
+	}
+	size_t value_size = lfht->value_size > sizeof(void *) ?
+		lfht->value_size :
+		sizeof(void *);
+	return offsetof(struct lfht_node, leaf.value) +
+		((value_size + sizeof(long) - 1) & ~(sizeof(long) - 1));
 }
 
-struct lfht_node *create_unfreeze_node(
-		struct lfht_node *next)
+long *leaf_expiry(
+		struct lfht_head *lfht,
+		struct lfht_node *cnode)
 {
-	struct lfht_node *node = malloc(sizeof(struct lfht_node));
-	node->type = UNFREEZE;
-	node->leaf.hash = 0;
-	node->leaf.value = NULL;
+	return (long *) ((char *) cnode + expiry_offset(lfht));
+}
 
-	atomic_init(&(node->leaf.next), next);
+unsigned is_expired(
+		struct lfht_head *lfht,
+		struct lfht_node *cnode,
+		long now)
+{
+	long expires = *leaf_expiry(lfht, cnode);
+	return expires != 0 && expires <= now;
+}
 
-#if LFHT_DEBUG
-	assert(next);
-	assert(!is_compression_node(next));
-#endif
+// point in time snapshot functions
 
-	return node;
+// the insert and remove epochs follow the expiry time,
+// or take its place
+size_t epochs_offset(struct lfht_head *lfht)
+{
+	return expiry_offset(lfht) + (lfht->expiry ? sizeof(long) : 0);
 }
 
-struct lfht_node *create_leaf_node(
-		size_t hash,
-		void *value,
-		struct lfht_node *next)
+// [0] = epoch of the insert, [1] = epoch of the remove
+_Atomic(unsigned long) *leaf_epochs(
+		struct lfht_head *lfht,
+		struct lfht_node *cnode)
 {
-	struct lfht_node *node = malloc(sizeof(struct lfht_node));
-	node->type = LEAF;
-	node->leaf.hash = hash;
-	node->leaf.value = value;
-
-	atomic_init(&(node->leaf.next), next);
-
-	return node;
+	return (_Atomic(unsigned long) *) ((char *) cnode + epochs_offset(lfht));
 }
 
-struct lfht_node *create_hash_node(
-		int size,
-		int hash_pos,
-		struct lfht_node *prev)
+// updates take effect in the epoch returned, a snapshot moves
+// to the next one only once no update is in progress, so an
+// update is either entirely before or entirely after it
+unsigned long begin_update(
+		struct lfht_head *lfht,
+		int thread_id)
 {
-	struct lfht_node *node = malloc(
-			sizeof(struct lfht_node) + (1<<size)*sizeof(struct lfht_node *));
-	node->type = HASH;
-	node->hash.size = size;
-	node->hash.hash_pos = hash_pos;
-	node->hash.prev = prev;
-	for(int i=0; i < 1<<size; i++) {
-		atomic_init(&(node->hash.array[i]), node);
+	struct lfht_snapshots *snapshots = lfht->snapshots;
+	struct lfht_thread *thread = get_thread(lfht, thread_id);
+
+	for(;;) {
+		atomic_fetch_add_explicit(&(thread->updating), 1, memory_order_seq_cst);
+		if(!atomic_load_explicit(&(snapshots->gate), memory_order_seq_cst)) {
+			return atomic_load_explicit(&(snapshots->epoch), memory_order_seq_cst);
+		}
+		atomic_fetch_sub_explicit(&(thread->updating), 1, memory_order_release);
+		while(atomic_load_explicit(&(snapshots->gate), memory_order_acquire)) {
+			sched_yield();
+		}
 	}
-	return node;
 }
 
-// for the current hash level, return the chunk of the
-// hash which indexes the bucket array (of size 2^w)
-int get_bucket_index(
-		size_t hash,
-		int hash_pos,
-		int size)
+void end_update(
+		struct lfht_head *lfht,
+		int thread_id)
 {
-	// hash_pos does not increment 1 by 1
-	// it increments with the chunk size
-	return (hash >> hash_pos) & ((1 << size) - 1);
+	atomic_fetch_sub_explicit(
+			&(get_thread(lfht, thread_id)->updating),
+			1,
+			memory_order_release);
 }
 
-_Atomic(struct lfht_node *) *get_atomic_bucket(
-		size_t hash,
-		struct lfht_node *hnode)
+// one lfht_snapshot() or lfht_snapshot_release() at a time
+// closes the gate, begin_update() waits while it is closed
+void close_gate(struct lfht_snapshots *snapshots)
 {
-	int pos = get_bucket_index(
-			hash,
-			hnode->hash.hash_pos,
-			hnode->hash.size);
+	int open = 0;
+	while(!atomic_compare_exchange_weak_explicit(
+				&(snapshots->gate),
+				&open,
+				1,
+				memory_order_seq_cst,
+				memory_order_relaxed)) {
+		open = 0;
+		sched_yield();
+	}
+}
 
-	return &(hnode->hash.array[pos]);
+void free_retired(struct lfht_retired *retired)
+{
+	while(retired) {
+		struct lfht_retired *nxt = retired->next;
+		free(retired);
+		retired = nxt;
+	}
 }
 
-// release-consume order get next
-struct lfht_node *get_next(
-		struct lfht_node *node)
+// returns: 0/1 cnode is an entry of the table as of the snapshot
+unsigned in_snapshot(
+		struct lfht_snapshot *snapshot,
+		struct lfht_node *cnode)
 {
-#if LFHT_DEBUG
-		assert(node);
-		assert(&(node->leaf.next));
-		assert(node);
-#endif
-	//return atomic_load_explicit(
-	//		&(node->leaf.next),
-	//		memory_order_consume);
+	struct lfht_head *lfht = snapshot->lfht;
+	_Atomic(unsigned long) *epochs = leaf_epochs(lfht, cnode);
 
-	// avoiding hazards during compress operation WIP
-	struct lfht_node* nxt = atomic_load_explicit(
-			&(node->leaf.next),
-			memory_order_seq_cst);
+	return atomic_load_explicit(&(epochs[0]), memory_order_relaxed) <= snapshot->epoch &&
+		atomic_load_explicit(&(epochs[1]), memory_order_relaxed) > snapshot->epoch &&
+		!(lfht->expiry && is_expired(lfht, cnode, snapshot->time));
+}
 
-#if LFHT_DEBUG
-	assert(nxt);
-#endif
-	return nxt;
+void snapshot_view_add(
+		struct lfht_snapshot_view *view,
+		struct lfht_node *cnode)
+{
+	if(!in_snapshot(view->snapshot, cnode)) {
+		return;
+	}
+	if(view->count == view->size) {
+		view->size = view->size ? 2 * view->size : 1024;
+		view->leaves = realloc(view->leaves, view->size * sizeof(struct lfht_node *));
+	}
+	view->leaves[view->count++] = cnode;
 }
 
-// we do not use an "is_valid" field.
-// to verify if a node is valid, the least significant bit
-// of the *next field is used (the address, not the node it
-// points to).
-//
-// validating a node using the mask ~1:
-// 0xFFFF & ~1 === 0xFFFF & 0xFFFE = 0xFFFE
-//
-// invalidating a node:
-// 0xFFFE | 1 === 0xFFFE | 0x0001 = 0xFFFF
-//
-// arg: the *next address of the node we want to invalidate
-// return: pointer masked with "valid"
-struct lfht_node *valid_ptr(struct lfht_node *next)
+void snapshot_view_visit(
+		struct lfht_node *cnode,
+		struct lfht_node *hnode,
+		void *arg)
 {
-	return (struct lfht_node *) ((uintptr_t) next & ~1);
+	(void) hnode;
+	snapshot_view_add(arg, cnode);
 }
 
-struct lfht_node *invalid_ptr(struct lfht_node *next)
+// returns: 0/1 removed by this call
+unsigned remove_expired(
+		struct lfht_head *lfht,
+		int thread_id,
+		struct lfht_node *cnode,
+		struct lfht_node *hnode)
 {
-	return (struct lfht_node *) ((uintptr_t) next | 1);
+	if(!remove_node(lfht, thread_id, cnode, hnode)) {
+		return 0;
+	}
+	if(lfht->expiry->expired) {
+		lfht->expiry->expired(
+				unmix_hash(lfht, cnode->leaf.hash),
+				leaf_value(lfht, cnode),
+				lfht->expiry->arg);
+	}
+	return 1;
 }
 
-// mask address to get the valid/invalid bit flag
-// 
-// arg: the *next address of the node
-// return: the least significant bit of *next
-unsigned is_invalid(struct lfht_node *ptr)
+void expire_visit(
+		struct lfht_node *cnode,
+		struct lfht_node *hnode,
+		void *arg)
 {
-	return (uintptr_t) ptr & 1;
+	struct lfht_expire *expire = arg;
+	if(is_expired(expire->lfht, cnode, expire->now) &&
+			remove_expired(expire->lfht, expire->thread_id, cnode, hnode)) {
+		expire->count++;
+	}
 }
 
-unsigned is_compression_node(struct lfht_node *node)
+// insertion functions
+
+// expires -> see: lfht_insert_expiring()
+// inserted (may be NULL) -> 0 if hash was already present
+struct lfht_node *search_insert(
+		struct lfht_head *lfht,
+		int thread_id,
+		struct lfht_node *hnode,
+		size_t hash,
+		void *value,
+		long expires,
+		unsigned *inserted)
 {
-	return node->type == FREEZE || node->type == UNFREEZE;
+	int trial = 0;
+
+start: ;
+	trial++;
+#if LFHT_DEBUG
+	struct lfht_stats* stats = lfht->stats[thread_id];
+	if (stats->max_retry_counter < trial) {
+		stats->max_retry_counter = trial;
+	}
+#endif
+
+	if(trial > 1) {
+		PROBE(
+				insert_retry,
+				hnode->hash.hash_pos,
+				get_bucket_index(hash, hnode->hash.hash_pos, hnode->hash.size),
+				trial - 1);
+		if(lfht->latency_period) {
+			tag_path(lfht, thread_id, LFHT_PATH_RETRIED);
+		}
+	}
+
+	struct lfht_node *cnode;
+	_Atomic(lfht_link) *last_valid_atomic;
+	unsigned int count;
+
+	if(find_node(
+				lfht,
+				thread_id,
+				hash,
+				lfht->multimap ? &value : NULL,
+				&hnode,
+				&cnode,
+				&last_valid_atomic,
+				&count)) {
+		// node already inserted
+		if(inserted) {
+			*inserted = 0;
+		}
+		return cnode;
+	}
+
+	if(unversioned(cnode)->type == FREEZE && !unfreeze(lfht, thread_id, hnode, hash)) {
+#if LFHT_DEBUG
+		assert(count == 0);
+		assert(get_next(cnode) == hnode);
+#endif
+		if(hnode->hash.prev != NULL) {
+			// starting to insert a node in an already deleted
+			// hash level will cause an infinite cycle
+			hnode = hnode->hash.prev;
+		}
+		goto start;
+	}
+#if LFHT_DEBUG
+	assert(unversioned(cnode)->type != UNFREEZE);
+#endif
+
+	// expand hash level
+	if(count >= (unsigned int) lfht->max_chain_nodes) {
+		struct lfht_node *new_hash;
+		// add new level to tail of chain
+		if(expand(lfht, thread_id, &new_hash, hnode, cnode, hash, last_valid_atomic)) {
+			// level added
+			hnode = new_hash;
+		}
+
+		goto start;
+	}
+
+	if(lfht->filter) {
+		filter_add(hnode, hash);
+	}
+
+	// insert new node in current bucket
+	struct lfht_arena *arena = lfht->arena && thread_id != SHARED_THREAD(lfht) ?
+		&(get_thread(lfht, thread_id)->arena) :
+		NULL;
+	struct lfht_node *new_node = create_leaf_node(
+			lfht,
+			arena,
+			hash,
+			value,
+			expires,
+			hnode);
+	INTERLEAVE(lfht);
+	if(lfht->snapshots) {
+		atomic_init(
+				&(leaf_epochs(lfht, new_node)[0]),
+				begin_update(lfht, thread_id));
+	}
+	unsigned linked = link_cas(
+			last_valid_atomic,
+			&cnode,
+			link_value(
+				new_node,
+				cnode,
+				last_valid_atomic,
+				get_atomic_bucket(hash, hnode)),
+			memory_order_acq_rel,
+			memory_order_consume);
+	if(lfht->snapshots) {
+		end_update(lfht, thread_id);
+	}
+	if(linked) {
+		if(inserted) {
+			*inserted = 1;
+		}
+		if(lfht->change_ring_size) {
+			record_change(lfht, thread_id, LFHT_CHANGE_INSERT, new_node);
+		}
+		if(lfht->cache) {
+			cache_inserted(lfht, thread_id);
+		}
+		return new_node;
+	}
+
+	if(lfht->arena) {
+		arena_free(arena, new_node, leaf_size(lfht));
+	} else {
+		free(new_node);
+	}
+	goto start;
 }
 
-unsigned is_empty(struct lfht_node *hnode)
+// compression functions
+
+void compress(
+		struct lfht_head *lfht,
+		int thread_id,
+		struct lfht_node *target,
+		size_t hash)
 {
-	for(int i = 0; i < (1<<hnode->hash.size); i++) {
-		struct lfht_node *head;
-		_Atomic(struct lfht_node *) *nxt_atomic_bucket =
-			&(hnode->hash.array[i]);
+	int trial = 0;
 
-		head = atomic_load_explicit(
-				nxt_atomic_bucket,
-				memory_order_consume);
+start: ;
+	trial++;
+#if LFHT_DEBUG
+	assert(target);
+	assert(target->type == HASH);
 
-		if(head != hnode) {
-			// bucket not empty
-			return 0;
-		}
+	struct lfht_stats* stats = lfht->stats[thread_id];
+	if (stats->max_retry_counter < trial) {
+		stats->max_retry_counter = trial;
 	}
+#endif
 
-	return 1;
-}
+	if(target->hash.prev == NULL || !is_empty(target)) {
+		// we cannot compress the root hash or a non empty hash
+		return;
+	}
 
-int mark_invalid(struct lfht_node *cnode)
-{
+	if(in_grace_period(lfht, target)) {
+		// level expanded recently, keep it for now
+		atomic_store_explicit(&(target->hash.skipped), 1, memory_order_relaxed);
 #if LFHT_DEBUG
-	assert(cnode);
-	assert(cnode->type == LEAF);
+		stats->compression_deferred_counter++;
 #endif
-	struct lfht_node *expect = valid_ptr(get_next(cnode));
+		return;
+	}
 
-	// replace .next with the invalid address
-	while(!atomic_compare_exchange_weak_explicit(
-				&(cnode->leaf.next),
+	struct lfht_node *freeze = create_freeze_node(lfht, target);
+	struct lfht_node *expect;
+	struct lfht_node *prev_hash = target->hash.prev;
+	_Atomic(lfht_link) *atomic_bucket =
+		get_atomic_bucket(hash, prev_hash);
+	int pos = atomic_bucket - prev_hash->hash.array;
+
+	INTERLEAVE(lfht);
+	// try to place freeze node in front of bucket,
+	// pointing to target hash
+	expect = target;
+	if(!link_cas(
+				atomic_bucket,
 				&expect,
-				invalid_ptr(expect),
+				freeze,
 				memory_order_acq_rel,
 				memory_order_consume)) {
-#if LFHT_DEBUG
-		assert(expect);
-#endif
-		if(is_invalid(expect)) {
-			// node was invalidated by another thread
-			// aborting
-			return 0;
-		}
+		free_node(lfht, freeze);
+		return;
+	}
+	PROBE(compress_start, target->hash.hash_pos, pos, trial - 1);
+	if(lfht->latency_period) {
+		tag_path(lfht, thread_id, LFHT_PATH_COMPRESSED);
 	}
-	return 1;
-}
-
-// retries CAS until it succeeds
-int force_cas(struct lfht_node *node, struct lfht_node *replace)
-{
 #if LFHT_DEBUG
-	assert(node);
-	assert(replace);
-	assert(node->type == LEAF);
+	stats->freeze_counter++;
 #endif
-	struct lfht_node *expect = get_next(node);
 
-	if(is_invalid(expect)) {
-		return 0;
-	}
+	// freeze empty buckets
+	for(int i = 0; i < (1<<target->hash.size); i++) {
+		_Atomic(lfht_link) *nxt_atomic_bucket =
+			&(target->hash.array[i]);
 
-	if(expect == replace) {
-		// value already in place
-		return 1;
+		expect = target;
+		if(!link_cas(
+					nxt_atomic_bucket,
+					&expect,
+					freeze,
+					memory_order_acq_rel,
+					memory_order_consume)) {
+			// bucket not empty
+
+			// WARNING: be careful with the ABA problem
+			// if we free() freeze node here, some other
+			// thread might have it in local storage
+			//
+			//free(freeze);
+
+			abort_compress(lfht, thread_id, target, freeze, atomic_bucket);
+			goto start;
+		}
 	}
 
-	while(!atomic_compare_exchange_weak_explicit(
-				&(node->leaf.next),
+	INTERLEAVE(lfht);
+	// removing hash from the trie (commit)
+	expect = freeze;
+	if(!link_cas(
+				atomic_bucket,
 				&expect,
-				replace,
+				prev_hash,
 				memory_order_acq_rel,
 				memory_order_consume)) {
-		if(is_invalid(expect)) {
-			return 0;
-		}
+
+		// WARNING: be careful with the ABA problem
+		// if we free() freeze node here, some other
+		// thread might have it in local storage
+		//
+		//free(freeze);
+
+		abort_compress(lfht, thread_id, target, freeze, atomic_bucket);
+		goto start;
 	}
-	return 1;
+
+	// compressed level
+	PROBE(compress_commit, target->hash.hash_pos, pos, trial - 1);
+#if LFHT_DEBUG
+	stats->compression_counter++;
+#endif
+	// try to compress previous level
+	target = target->hash.prev;
+	goto start;
 }
 
-// this function changes the values of *hnode, *nodeptr, count and *last_valid_atomic
-// *hnode -> will point to the hash node, containing the bucket of
-//   the target node
-// *nodeptr -> will point to the target node, if it exists
-// count -> number of nodes of the last traversed chain up until the node was found,
-//   or the length of the chain if the node isn't present
-// *last_valid_atomic -> will point to an atomic node, 
-// pointer to the last valid node of the chain
-//
-// returns: 0/1 success
-int find_node(
+// notify compressing thread to abort compression
+int unfreeze(
 		struct lfht_head *lfht,
 		int thread_id,
-		size_t hash,
-		struct lfht_node **hnode,
-		struct lfht_node **nodeptr,
-		_Atomic(struct lfht_node *) **last_valid_atomic,
-		unsigned int *count)
+		struct lfht_node *target,
+		size_t hash)
 {
 #if LFHT_DEBUG
-	int trial = 0;
-#endif
-
-start: ;
-#if LFHT_DEBUG
-	assert(nodeptr);
-	assert(hnode);
-	assert(*hnode);
-	assert((*hnode)->type == HASH);
-
-	struct lfht_stats* stats = lfht->stats[thread_id];
-	trial++;
-	if (stats->max_retry_counter < trial) {
-		stats->max_retry_counter = trial;
-	}
+	assert(target);
+	assert(target->type == HASH);
 #endif
+	_Atomic(lfht_link) *atomic_bucket =
+		get_atomic_bucket(hash, target->hash.prev);
 
-	_Atomic(struct lfht_node *) *atomic_head =
-		get_atomic_bucket(hash, *hnode);
-
-	struct lfht_node *iter = atomic_load_explicit(
-			atomic_head,
+	struct lfht_node *head = link_load(
+			atomic_bucket,
 			memory_order_consume);
 
-	struct lfht_node *head = iter;
-	*nodeptr = head;
+	if(head == target) {
+		// compression rolled back successfully
+		return 1;
+	}
 
-	if(is_compression_node(head)) {
-		// skip compression node
-		iter = valid_ptr(get_next(iter));
-#if LFHT_DEBUG
-		assert(iter);
-		assert(iter->type == HASH);
-#endif
+	if(head->type == UNFREEZE) {
+		return get_next(head) == target;
 	}
 
-	if(last_valid_atomic) {
-		*last_valid_atomic = atomic_head;
-		*count = 0;
+	if(head->type != FREEZE || get_next(head) != target) {
+		// level already removed
+		return 0;
 	}
 
-	// traverse chain (tail points back to hash node)
-	while(iter != *hnode) {
+	INTERLEAVE(lfht);
+	struct lfht_node *unfreeze = create_unfreeze_node(lfht, target);
 
-		if(iter->type == HASH) {
-			// travel down a level and search for the node there
+	// try to place unfreeze node in front of bucket,
+	// pointing to freeze node
+	if(!link_cas(
+				atomic_bucket,
+				&head,
+				unfreeze,
+				memory_order_acq_rel,
+				memory_order_consume)) {
+		// already compressed, unfrozen or removed
+		free_node(lfht, unfreeze);
 
-			// important loop!
-			// during adjust (after force_cas)
-			// there is a window when nodes may skip a level
-			while(iter->hash.prev != *hnode) {
-				iter = iter->hash.prev;
-			}
+		if(head == target) {
+			// compression rolled back successfully
+			return 1;
+		}
 
-			*hnode = iter;
-			goto start;
+		if(head->type == UNFREEZE) {
+			return get_next(head) == target;
 		}
+
+		return 0;
+	}
+
+	PROBE(
+			unfreeze,
+			target->hash.hash_pos,
+			atomic_bucket - target->hash.prev->hash.array,
+			0);
 #if LFHT_DEBUG
-		assert(!is_compression_node(head));
-		assert(iter->type == LEAF);
+	struct lfht_stats* stats = lfht->stats[thread_id];
+	stats->unfreeze_counter++;
 #endif
+	return 1;
+}
 
-		struct lfht_node *nxt_iter = get_next(iter);
-		if(!is_invalid(nxt_iter)) {
-			// iter is a valid node
-
-			if(iter->leaf.hash == hash) {
-				// found node
-				*nodeptr = iter;
-				return 1;
-			}
-			*nodeptr = nxt_iter;
+// target -> hash level we wanted to compress
+// atomic_bucket -> atomic object of the previous level
+//   bucket pointing to our target
+void abort_compress(
+		struct lfht_head *lfht,
+		int thread_id,
+		struct lfht_node *target,
+		struct lfht_node *freeze,
+		_Atomic(lfht_link) *atomic_bucket)
+{
+	struct lfht_node *expect;
+	struct lfht_node *compression_node = link_load(
+			atomic_bucket,
+			memory_order_consume);
+#if LFHT_DEBUG
+	assert(compression_node);
+	assert(target);
+	// no other thread must interfere with
+	// this thread's compression procedure
+	assert(is_compression_node(compression_node));
+	assert(target->type == HASH);
+#endif
 
-			if(last_valid_atomic) {
-				*last_valid_atomic = &(iter->leaf.next);
-				(*count)++;
-			}
-		}
+	// point all buckets to target
+	for(int i = 0; i < (1<<target->hash.size); i++) {
+		_Atomic(lfht_link) *nxt_atomic_bucket = &(target->hash.array[i]);
+		expect = freeze;
 
-		// advance chain
-		iter = valid_ptr(nxt_iter);
+		// ignoring CAS failure
+		// just making sure all buckets point to target
+		// if it fails, they already do point to target or have a chain
+		link_cas(
+				nxt_atomic_bucket,
+				&expect,
+				target,
+				memory_order_acq_rel,
+				memory_order_consume);
 	}
-	return 0;
+
+	// commit level by removing compression bridge node
+	link_store(
+			atomic_bucket,
+			target,
+			memory_order_release);
+	PROBE(
+			compress_rollback,
+			target->hash.hash_pos,
+			atomic_bucket - target->hash.prev->hash.array,
+			0);
+#if LFHT_DEBUG
+	struct lfht_stats* stats = lfht->stats[thread_id];
+	stats->compression_rollback_counter++;
+#endif
 }
 
-void make_unreachable(
+// expansion functions
+
+int expand(
 		struct lfht_head *lfht,
 		int thread_id,
-		struct lfht_node *cnode,
-		struct lfht_node *hnode)
+		struct lfht_node **new_hash,
+		struct lfht_node *hnode,
+		struct lfht_node *tail_nxt,
+		size_t hash,
+		_Atomic(lfht_link) *tail_nxt_ptr)
 {
 #if LFHT_DEBUG
-	int trial = 0;
-#endif
-
-start: ;
-#if LFHT_DEBUG
-	assert(cnode);
+	assert(tail_nxt);
 	assert(hnode);
-	assert(cnode->type == LEAF);
+	// or invalid nodes left for the maintenance thread
+	assert(unversioned(tail_nxt)->type == HASH ||
+			is_invalid(get_next(unversioned(tail_nxt))));
 	assert(hnode->type == HASH);
-
-	struct lfht_stats* stats = lfht->stats[thread_id];
-	trial++;
-	if (stats->max_retry_counter < trial) {
-		stats->max_retry_counter = trial;
-	}
 #endif
-	struct lfht_node *iter;
-	struct lfht_node *nxt = valid_ptr(get_next(cnode));
-
-	while(nxt->type == LEAF) {
-		iter = get_next(nxt);
-		if(!is_invalid(iter)) {
-			// found next valid node of the chain
-			break;
-		}
-		nxt = valid_ptr(iter);
-	}
-	iter = nxt;
-
-	// advance to the next hash
-	while(iter->type != HASH) {
-		iter = valid_ptr(get_next(iter));
-	}
-
-	if(iter != hnode && iter->hash.hash_pos < hnode->hash.hash_pos) {
-		// TODO: current hash level is collapsing on the previous level?
-		return;
-	}
-
-	if(iter != hnode) {
-		hnode = iter;
-		goto start;
+	if(lfht->reclaim) {
+		begin_expansion(lfht->reclaim);
 	}
 
-	int pos = get_bucket_index(
-			cnode->leaf.hash,
-			hnode->hash.hash_pos,
-			hnode->hash.size);
-	_Atomic(struct lfht_node *) *observed_bucket = &(hnode->hash.array[pos]);
-	_Atomic(struct lfht_node *) *prev_atomic = observed_bucket;
-	struct lfht_node *prev = atomic_load_explicit(
-			prev_atomic,
-			memory_order_consume);
-
-	if(is_compression_node(prev)) {
-		// skip compression node
-		prev = valid_ptr(get_next(prev));
-		return;
+	*new_hash = create_hash_node(
+			lfht,
+			lfht->hash_size,
+			hnode->hash.hash_pos + hnode->hash.size,
+			hnode);
+	if(lfht->compress_grace > 0) {
+		(*new_hash)->hash.created = monotonic_time();
 	}
 
-	// let's find the last valid node before our target
-	iter = prev;
-	while(iter != cnode && iter->type == LEAF) {
-		iter = get_next(iter);
-
-		if(!is_invalid(iter)) {
-			// node is valid, storing its .next atomic field
-			prev_atomic = &(prev->leaf.next);
-			prev = iter;
-			continue;
+	INTERLEAVE(lfht);
+	// add new hash level to tail of chain
+	if(link_cas(
+				tail_nxt_ptr,
+				&tail_nxt,
+				link_value(
+					*new_hash,
+					tail_nxt,
+					tail_nxt_ptr,
+					get_atomic_bucket(hash, hnode)),
+				memory_order_acq_rel,
+				memory_order_consume)) {
+		// level added
+		// move all nodes of chain to new level,
+		// other inserters reaching the new level help
+		PROBE(
+				expand,
+				(*new_hash)->hash.hash_pos,
+				get_bucket_index(hash, hnode->hash.hash_pos, hnode->hash.size),
+				0);
+		if(lfht->latency_period) {
+			tag_path(lfht, thread_id, LFHT_PATH_EXPANDED);
 		}
-		iter = valid_ptr(iter);
-	}
-
-	if(iter == cnode) {
-		// try to disconnect our target from chain
+		struct lfht_node *moved = NULL;
+		while(adjust_chain_step(lfht, thread_id, hnode, *new_hash, hash, &moved)) ;
 #if LFHT_DEBUG
-		if (prev->type ==HASH && nxt->type == HASH) {
-			assert(prev == nxt);
+		struct lfht_stats* stats = lfht->stats[thread_id];
+		stats->expansion_counter++;
+		int level = (*new_hash)->hash.hash_pos / (*new_hash)->hash.size;
+		if(stats->max_depth < level) {
+			stats->max_depth = level;
 		}
 #endif
-		if(atomic_compare_exchange_strong_explicit(
-					prev_atomic,
-					&prev,
-					nxt,
-					memory_order_acq_rel,
-					memory_order_consume)) {
-
-			if(observed_bucket == prev_atomic) {
-				// our removed node was the last of the chain
-				compress(lfht, thread_id, hnode, cnode->leaf.hash);
-			}
-
-			return;
+		if(lfht->reclaim) {
+			end_expansion(lfht->reclaim);
 		}
+		return 1;
+	}
 
-		goto start;
+	// failed
+	free_node(lfht, *new_hash);
+	if(lfht->reclaim) {
+		end_expansion(lfht->reclaim);
 	}
+	return 0;
 }
 
-// remove functions
-
-void search_remove(
+// one step of a chain's migration to the level it is
+// expanding to (new_hash, at the tail of the chain)
+//
+// nodes are moved from the tail to the head, so the nodes
+// after a moved one are always reachable from the new level.
+// the last valid node not yet reachable from the new level is
+// moved, or, if there is none, the chain is replaced by the
+// new level in the bucket. every step may be repeated or run
+// concurrently by several threads
+//
+// moved (may be NULL) -> cursor of a thread running every step:
+//   the node it moved last, so the next step checks the
+//   reachability of two nodes instead of every unmoved one
+//   (the nodes from the first reachable one on were moved)
+// returns: 0 when the migration is complete
+int adjust_chain_step(
 		struct lfht_head *lfht,
 		int thread_id,
 		struct lfht_node *hnode,
-		size_t hash)
+		struct lfht_node *new_hash,
+		size_t hash,
+		struct lfht_node **moved)
 {
 #if LFHT_DEBUG
 	assert(hnode);
+	assert(new_hash);
 	assert(hnode->type == HASH);
+	assert(new_hash->type == HASH);
 #endif
+	_Atomic(lfht_link) *atomic_bucket =
+		get_atomic_bucket(hash, hnode);
 
-	struct lfht_node *cnode;
-	if(!find_node(lfht, thread_id, hash, &hnode, &cnode, NULL, NULL)) {
-		return;
+	struct lfht_node *head = link_load(
+			atomic_bucket,
+			memory_order_consume);
+
+	if(head->type != LEAF) {
+		// chain already replaced by the new level
+		return 0;
 	}
 
-	if(!mark_invalid(cnode)) {
-		return;
+	// the node moved by the previous step, unless that
+	// step failed or the node was removed since
+	struct lfht_node *boundary = moved ? *moved : NULL;
+	if(boundary && !is_reachable(new_hash, boundary)) {
+		boundary = NULL;
 	}
 
-	make_unreachable(lfht, thread_id, cnode, hnode);
-}
+	// find the last node that still has to be moved
+	struct lfht_node *cnode = NULL;
+	struct lfht_node *cnode_nxt = NULL;
+	struct lfht_node *iter = head;
+	while(iter->type == LEAF && iter != boundary) {
+		struct lfht_node *nxt_link = load_link(iter);
+		struct lfht_node *nxt_ptr = unversioned(nxt_link);
+
+		if(!is_invalid(nxt_ptr)) {
+			if(boundary == NULL && is_reachable(new_hash, iter)) {
+				// the rest of the chain was already moved
+				break;
+			}
+			cnode = iter;
+			cnode_nxt = nxt_link;
+		}
+		iter = valid_ptr(nxt_ptr);
+	}
 
-// insertion functions
+	if(iter->type == HASH) {
+		// important loop!
+		while(iter != hnode && iter->hash.prev != hnode &&
+				iter->hash.prev != NULL) {
+			iter = iter->hash.prev;
+		}
+		if(iter != new_hash) {
+			// the chain is not moving to new_hash, which was
+			// committed and compressed while this thread was
+			// away, the bucket now holds a newer chain
+			return 0;
+		}
+		if(cnode == NULL && is_removed(new_hash, hash)) {
+			// no node of the chain is reachable from a removed
+			// level, so all of them are invalid: empty the
+			// bucket instead of committing new_hash again
+			return !link_cas(
+					atomic_bucket,
+					&head,
+					hnode,
+					memory_order_acq_rel,
+					memory_order_consume);
+		}
+	}
 
-struct lfht_node *search_insert(
+	if(cnode && boundary && is_reachable(new_hash, cnode)) {
+		// moved by another thread since the previous step
+		*moved = cnode;
+		return 1;
+	}
+
+	INTERLEAVE(lfht);
+	if(cnode == NULL) {
+		// every node moved, commit the new level
+		return !link_cas(
+				atomic_bucket,
+				&head,
+				new_hash,
+				memory_order_acq_rel,
+				memory_order_consume);
+	}
+
+	// move cnode to new level
+	adjust_node(lfht, thread_id, cnode, cnode_nxt, new_hash);
+	if(moved) {
+		*moved = cnode;
+	}
+	return 1;
+}
+
+// inserts cnode in the chain of hnode (or of a deeper level),
+// cnode_nxt -> the successor of cnode in the chain it is moved from
+void adjust_node(
 		struct lfht_head *lfht,
 		int thread_id,
-		struct lfht_node *hnode,
-		size_t hash,
-		void *value)
+		struct lfht_node *cnode,
+		struct lfht_node *cnode_nxt,
+		struct lfht_node *hnode)
 {
-#if LFHT_DEBUG
 	int trial = 0;
-#endif
 
 start: ;
+	trial++;
 #if LFHT_DEBUG
+	assert(cnode);
+	assert(hnode);
+	assert(cnode->type == LEAF);
+	assert(hnode->type == HASH);
+
 	struct lfht_stats* stats = lfht->stats[thread_id];
-	trial++;
 	if (stats->max_retry_counter < trial) {
 		stats->max_retry_counter = trial;
 	}
 #endif
-
-	struct lfht_node *cnode;
-	 _Atomic(struct lfht_node*) *last_valid_atomic;
-	unsigned int count;
-
-	if(find_node(lfht, thread_id, hash, &hnode, &cnode, &last_valid_atomic, &count)) {
-		// node already inserted
-		return cnode;
+	unsigned int count = 0;
+	size_t hash = cnode->leaf.hash;
+	if(trial > 1) {
+		PROBE(
+				adjust_retry,
+				hnode->hash.hash_pos,
+				get_bucket_index(hash, hnode->hash.hash_pos, hnode->hash.size),
+				trial - 1);
+		if(lfht->latency_period) {
+			tag_path(lfht, thread_id, LFHT_PATH_RETRIED);
+		}
 	}
+	_Atomic(lfht_link) *current_valid =
+		get_atomic_bucket(hash, hnode);
+	struct lfht_node *expect = valid_ptr(link_load(
+				current_valid,
+				memory_order_consume));
+	struct lfht_node *iter = expect;
 
-	if(cnode->type == FREEZE && !unfreeze(lfht, thread_id, hnode, hash)) {
-#if LFHT_DEBUG
-		assert(count == 0);
-		assert(cnode->leaf.next == hnode);
-#endif
-		if(hnode->hash.prev != NULL) {
-			// starting to insert a node in an already deleted
-			// hash level will cause an infinite cycle
-			hnode = hnode->hash.prev;
+	if(is_compression_node(iter)) {
+		if(!unfreeze(lfht, thread_id, hnode, hash)) {
+			// level already removed
+			return;
 		}
-		goto start;
-	}
+
+		// skip compression node
+		iter = valid_ptr(get_next(iter));
 #if LFHT_DEBUG
-	assert(cnode->type != UNFREEZE);
+		assert(iter);
+		assert(iter->type == HASH);
 #endif
+	}
 
-	// expand hash level
-	if(count >= MAX_NODES) {
-		struct lfht_node *new_hash;
-		// add new level to tail of chain
-		if(expand(lfht, thread_id, &new_hash, hnode, cnode, hash, last_valid_atomic)) {
-			// level added
-			hnode = new_hash;
+	// find tail of target bucket on new hash level
+	while(iter->type == LEAF) {
+		if(iter == cnode) {
+			// node moved by another thread
+			return;
 		}
 
-		goto start;
-	}
+		struct lfht_node *nxt_link = load_link(iter);
+		struct lfht_node *nxt_ptr = unversioned(nxt_link);
 
-	// insert new node in current bucket
-	struct lfht_node *new_node = create_leaf_node(
-			hash,
-			value,
-			hnode);
-	if(atomic_compare_exchange_strong_explicit(
-				last_valid_atomic,
-				&cnode,
-				new_node,
-				memory_order_acq_rel,
-				memory_order_consume)) {
-		return new_node;
+		if(is_invalid(nxt_ptr)) {
+			// skip invalid node
+			iter = valid_ptr(nxt_ptr);
+			continue;
+		}
+
+		current_valid = &(iter->leaf.next);
+		expect = nxt_link;
+		if(iter->leaf.hash != hash) {
+			// values of one hash cannot be split (see: multimap)
+			count++;
+		}
+		iter = nxt_ptr;
 	}
 
-	free(new_node);
-	goto start;
-}
+	if(iter != hnode) {
+		// important loop!
+		// during adjust (after the node is pointed to its new level)
+		// there is a window when nodes may skip a level
+		while(iter->hash.prev != hnode) {
+			iter = iter->hash.prev;
+		}
 
-// compression functions
+		hnode = iter;
+		goto start;
+	}
 
-void compress(
-		struct lfht_head *lfht,
-		int thread_id,
-		struct lfht_node *target,
-		size_t hash)
-{
-#if LFHT_DEBUG
-	int trial = 0;
-#endif
+	// expansion required?
+	if(count >= (unsigned int) lfht->max_chain_nodes) {
+		struct lfht_node *new_hash;
+		if(expand(lfht, thread_id, &new_hash, hnode, expect, hash, current_valid)) {
+			// adjust node at new level
+			hnode = new_hash;
+		}
 
-start: ;
-#if LFHT_DEBUG
-	assert(target);
-	assert(target->type == HASH);
+		goto start;
+	}
 
-	struct lfht_stats* stats = lfht->stats[thread_id];
-	trial++;
-	if (stats->max_retry_counter < trial) {
-		stats->max_retry_counter = trial;
+	if(lfht->filter) {
+		filter_add(hnode, hash);
 	}
-#endif
 
-	if(target->hash.prev == NULL || !is_empty(target)) {
-		// we cannot compress the root hash or a non empty hash
-		return;
+	INTERLEAVE(lfht);
+	// point node to newer level
+	// cnode_nxt is versioned: the CAS fails if the node was moved
+	// since, even if migrations brought its successor back
+	if(unversioned(cnode_nxt) != hnode) {
+		struct lfht_node *pointed = versioned(hnode, cnode_nxt);
+		if(link_cas(
+					&(cnode->leaf.next),
+					&cnode_nxt,
+					pointed,
+					memory_order_acq_rel,
+					memory_order_consume)) {
+			cnode_nxt = pointed;
+		} else if(unversioned(cnode_nxt) != hnode) {
+			// node invalidated, its successor removed or node
+			// moved by another thread in the meantime
+			return;
+		}
 	}
 
-	struct lfht_node *freeze = create_freeze_node(target);
-	struct lfht_node *expect;
-	struct lfht_node *prev_hash = target->hash.prev;
-	_Atomic(struct lfht_node *) *atomic_bucket =
-		get_atomic_bucket(hash, prev_hash);
+	if(get_next(cnode) != hnode) {
+		// node invalidated or linked (and appended to) by
+		// another thread, which also changed the link found
+		// as the tail, so the CAS below would fail anyway
+		return;
+	}
 
-	// try to place freeze node in front of bucket,
-	// pointing to target hash
-	expect = target;
-	if(!atomic_compare_exchange_strong_explicit(
-				atomic_bucket,
+	INTERLEAVE(lfht);
+	// inserting node in chain of the newer level
+	// expect is versioned: the CAS fails if the tail was relinked
+	// since it was found, e.g. to cnode by another thread
+	if(link_cas(
+				current_valid,
 				&expect,
-				freeze,
+				link_value(
+					cnode,
+					expect,
+					current_valid,
+					get_atomic_bucket(hash, hnode)),
 				memory_order_acq_rel,
 				memory_order_consume)) {
-		free(freeze);
+		PROBE(
+				adjust,
+				hnode->hash.hash_pos,
+				get_bucket_index(hash, hnode->hash.hash_pos, hnode->hash.size),
+				trial - 1);
+		if(is_invalid(get_next(cnode))) {
+			// node invalidated while it was being adjusted
+			make_unreachable(lfht, thread_id, cnode, hnode);
+		}
 		return;
 	}
-#if LFHT_DEBUG
-	stats->freeze_counter++;
-#endif
-
-	// freeze empty buckets
-	for(int i = 0; i < (1<<target->hash.size); i++) {
-		_Atomic(struct lfht_node *) *nxt_atomic_bucket =
-			&(target->hash.array[i]);
+	// insertion failed
+	goto start;
+}
 
-		expect = target;
-		if(!atomic_compare_exchange_strong_explicit(
-					nxt_atomic_bucket,
-					&expect,
-					freeze,
-					memory_order_acq_rel,
-					memory_order_consume)) {
-			// bucket not empty
+// returns: 1 if cnode is in the chain of hash node
+//   hnode, or in one of its deeper levels
+unsigned is_reachable(
+		struct lfht_node *hnode,
+		struct lfht_node *cnode)
+{
+	size_t hash = cnode->leaf.hash;
 
-			// WARNING: be careful with the ABA problem
-			// if we free() freeze node here, some other
-			// thread might have it in local storage
-			//
-			//free(freeze);
+start: ;
+	struct lfht_node *iter = link_load(
+			get_atomic_bucket(hash, hnode),
+			memory_order_consume);
 
-			abort_compress(lfht, thread_id, target, freeze, atomic_bucket);
-			goto start;
-		}
+	if(is_compression_node(iter)) {
+		// skip compression node
+		iter = valid_ptr(get_next(iter));
 	}
 
-	// removing hash from the trie (commit)
-	expect = freeze;
-	if(!atomic_compare_exchange_strong_explicit(
-				atomic_bucket,
-				&expect,
-				prev_hash,
-				memory_order_acq_rel,
-				memory_order_consume)) {
+	while(iter != hnode) {
+		if(is_hash(iter)) {
+			// important loop!
+			while(iter->hash.prev != hnode) {
+				iter = iter->hash.prev;
+			}
 
-		// WARNING: be careful with the ABA problem
-		// if we free() freeze node here, some other
-		// thread might have it in local storage
-		//
-		//free(freeze);
+			hnode = iter;
+			goto start;
+		}
 
-		abort_compress(lfht, thread_id, target, freeze, atomic_bucket);
-		goto start;
+		if(iter == cnode) {
+			return 1;
+		}
+		iter = valid_ptr(get_next(iter));
 	}
-
-	// compressed level
-#if LFHT_DEBUG
-	stats->compression_counter++;
-#endif
-	// try to compress previous level
-	target = target->hash.prev;
-	goto start;
+	return 0;
 }
 
-// notify compressing thread to abort compression
-int unfreeze(
+// searching functions
+
+// returns: the valid leaf holding hash, NULL if none
+struct lfht_node *search_node(
 		struct lfht_head *lfht,
 		int thread_id,
-		struct lfht_node *target,
+		struct lfht_node *hnode,
 		size_t hash)
 {
 #if LFHT_DEBUG
-	assert(target);
-	assert(target->type == HASH);
+	assert(hnode);
+	assert(hnode->type == HASH);
 #endif
-	_Atomic(struct lfht_node *) *atomic_bucket =
-		get_atomic_bucket(hash, target->hash.prev);
+	struct lfht_node *cnode;
+	struct lfht_node **slot = NULL;
+
+	if(lfht->hot_size) {
+		struct lfht_thread *thread = get_thread(lfht, thread_id);
+		if(thread->hot_size) {
+			slot = &(thread->hot[hash & (thread->hot_size - 1)]);
+			cnode = *slot;
+			// leaves are only freed with the table, a cached one
+			// is still in it as long as it was not invalidated
+			if(cnode && cnode->leaf.hash == hash &&
+					!is_invalid(get_next(cnode)) &&
+					!(lfht->expiry && is_expired(lfht, cnode, monotonic_time()))) {
+				goto found;
+			}
+		}
+	}
 
-	struct lfht_node *head = atomic_load_explicit(
-			atomic_bucket,
+	if(!find_node(lfht, thread_id, hash, NULL, &hnode, &cnode, NULL, NULL)) {
+		return NULL;
+	}
+	if(slot) {
+		*slot = cnode;
+	}
+
+found:
+	if(lfht->cache &&
+			!atomic_load_explicit(&(cnode->referenced), memory_order_relaxed)) {
+		// read first, hot leaves are not written on every hit
+		atomic_store_explicit(&(cnode->referenced), 1, memory_order_relaxed);
+	}
+	return cnode;
+}
+
+// appends every valid, unexpired leaf of all->hash to all->found
+void search_all_hash(
+		struct lfht_head *lfht,
+		struct lfht_node *hnode,
+		struct lfht_search_all *all)
+{
+	struct lfht_node *iter = link_load(
+			get_atomic_bucket(all->hash, hnode),
 			memory_order_consume);
 
-	if(head == target) {
-		// compression rolled back successfully
-		return 1;
+	if(is_compression_node(iter)) {
+		// skip compression node
+		iter = valid_ptr(get_next(iter));
 	}
 
-	if(head->type == UNFREEZE) {
-		return get_next(head) == target;
+	long now = lfht->expiry ? monotonic_time() : 0;
+	while(iter != hnode) {
+		if(is_hash(iter)) {
+			// important loop!
+			while(iter->hash.prev != hnode) {
+				iter = iter->hash.prev;
+			}
+			search_all_hash(lfht, iter, all);
+			return;
+		}
+
+		struct lfht_node *nxt_ptr = get_next(iter);
+		if(!is_invalid(nxt_ptr) && iter->leaf.hash == all->hash &&
+				!(lfht->expiry && is_expired(lfht, iter, now))) {
+			if(all->count == all->size) {
+				struct lfht_node **found = malloc(
+						2 * all->size * sizeof(struct lfht_node *));
+				memcpy(found, all->found, all->count * sizeof(struct lfht_node *));
+				if(all->size != SEARCH_ALL_STACK) {
+					free(all->found);
+				}
+				all->found = found;
+				all->size *= 2;
+			}
+			all->found[all->count++] = iter;
+		}
+		iter = valid_ptr(nxt_ptr);
 	}
+}
 
-	if(head->type != FREEZE || get_next(head) != target) {
-		// level already removed
-		return 0;
+// traversal functions
+
+// calls visit() for every valid leaf reachable from hnode,
+// with the hash node of the chain it was found in
+// weakly consistent, nodes being moved by an expansion
+// may be visited twice
+void walk_hash(
+		struct lfht_node *hnode,
+		void (*visit)(struct lfht_node *, struct lfht_node *, void *),
+		void *arg)
+{
+	for(int i = 0; i < (1<<hnode->hash.size); i++) {
+		walk_bucket(hnode, i, visit, arg);
 	}
+}
+
+void walk_bucket(
+		struct lfht_node *hnode,
+		int pos,
+		void (*visit)(struct lfht_node *, struct lfht_node *, void *),
+		void *arg)
+{
+	struct lfht_node *iter = link_load(
+			&(hnode->hash.array[pos]),
+			memory_order_consume);
 
-	struct lfht_node *unfreeze = create_unfreeze_node(target);
+	if(is_compression_node(iter)) {
+		// skip compression node
+		iter = valid_ptr(get_next(iter));
+	}
 
-	// try to place unfreeze node in front of bucket,
-	// pointing to freeze node
-	if(!atomic_compare_exchange_strong_explicit(
-				atomic_bucket,
-				&head,
-				unfreeze,
-				memory_order_acq_rel,
-				memory_order_consume)) {
-		// already compressed, unfrozen or removed
-		free(unfreeze);
+	while(iter != hnode) {
+		if(is_hash(iter)) {
+			// important loop!
+			while(iter->hash.prev != hnode) {
+				iter = iter->hash.prev;
+			}
 
-		if(head == target) {
-			// compression rolled back successfully
-			return 1;
+			walk_hash(iter, visit, arg);
+			return;
 		}
 
-		if(head->type == UNFREEZE) {
-			return get_next(head) == target;
+		struct lfht_node *nxt_ptr = get_next(iter);
+		if(!is_invalid(nxt_ptr)) {
+			visit(iter, hnode, arg);
 		}
-
-		return 0;
+		iter = valid_ptr(nxt_ptr);
 	}
-
-#if LFHT_DEBUG
-	struct lfht_stats* stats = lfht->stats[thread_id];
-	stats->unfreeze_counter++;
-#endif
-	return 1;
 }
 
-// target -> hash level we wanted to compress
-// atomic_bucket -> atomic object of the previous level
-//   bucket pointing to our target
-void abort_compress(
-		struct lfht_head *lfht,
-		int thread_id,
-		struct lfht_node *target,
-		struct lfht_node *freeze,
-		_Atomic(struct lfht_node *) *atomic_bucket)
+// calls visit() for every valid leaf reachable from hnode whose
+// hash has the prefix_bits low bits of prefix, descending only
+// into the buckets that cover them (see: walk_hash())
+void walk_prefix(
+		struct lfht_node *hnode,
+		size_t prefix,
+		int prefix_bits,
+		void (*visit)(struct lfht_node *, struct lfht_node *, void *),
+		void *arg)
 {
-	struct lfht_node *expect;
-	struct lfht_node *compression_node = atomic_load_explicit(
-			atomic_bucket,
+	int fixed = prefix_bits - hnode->hash.hash_pos;
+
+	if(fixed < hnode->hash.size) {
+		// the prefix ends at this level, every bucket agreeing
+		// with its last bits holds matching leaves only
+		int first = get_bucket_index(prefix, hnode->hash.hash_pos, fixed);
+		for(int i = first; i < (1<<hnode->hash.size); i += 1<<fixed) {
+			walk_bucket(hnode, i, visit, arg);
+		}
+		return;
+	}
+
+	size_t mask = prefix_bits < (int) (8 * sizeof(size_t)) ?
+		((size_t) 1 << prefix_bits) - 1 :
+		~(size_t) 0;
+	struct lfht_node *iter = link_load(
+			get_atomic_bucket(prefix, hnode),
 			memory_order_consume);
-#if LFHT_DEBUG
-	assert(compression_node);
-	assert(target);
-	// no other thread must interfere with
-	// this thread's compression procedure
-	assert(is_compression_node(compression_node));
-	assert(target->type == HASH);
-#endif
 
-	// point all buckets to target
-	for(int i = 0; i < (1<<target->hash.size); i++) {
-		_Atomic(struct lfht_node *) *nxt_atomic_bucket = &(target->hash.array[i]);
-		expect = freeze;
+	if(is_compression_node(iter)) {
+		// skip compression node
+		iter = valid_ptr(get_next(iter));
+	}
 
-		// ignoring CAS failure
-		// just making sure all buckets point to target
-		// if it fails, they already do point to target or have a chain
-		atomic_compare_exchange_strong_explicit(
-				nxt_atomic_bucket,
-				&expect,
-				target,
-				memory_order_acq_rel,
-				memory_order_consume);
+	while(iter != hnode) {
+		if(is_hash(iter)) {
+			// important loop!
+			while(iter->hash.prev != hnode) {
+				iter = iter->hash.prev;
+			}
+
+			walk_prefix(iter, prefix, prefix_bits, visit, arg);
+			return;
+		}
+
+		// chain leaves only share the bits up to this level
+		struct lfht_node *nxt_ptr = get_next(iter);
+		if(!is_invalid(nxt_ptr) && (iter->leaf.hash & mask) == (prefix & mask)) {
+			visit(iter, hnode, arg);
+		}
+		iter = valid_ptr(nxt_ptr);
 	}
+}
 
-	// commit level by removing compression bridge node
-	atomic_store_explicit(
-			atomic_bucket,
-			target,
-			memory_order_release);
-#if LFHT_DEBUG
-	struct lfht_stats* stats = lfht->stats[thread_id];
-	stats->compression_rollback_counter++;
-#endif
+void foreach_visit(
+		struct lfht_node *cnode,
+		struct lfht_node *hnode,
+		void *arg)
+{
+	(void) hnode;
+	struct lfht_foreach *foreach = arg;
+	if(foreach->lfht->expiry && is_expired(foreach->lfht, cnode, foreach->now)) {
+		// not removed yet
+		return;
+	}
+	foreach->visitor(
+			unmix_hash(foreach->lfht, cnode->leaf.hash),
+			leaf_value(foreach->lfht, cnode),
+			foreach->arg);
+}
+
+void count_entry(
+		size_t hash,
+		void *value,
+		void *arg)
+{
+	(void) hash;
+	(void) value;
+	(*(size_t *) arg)++;
 }
 
-// expansion functions
+void count_visit(
+		struct lfht_node *cnode,
+		struct lfht_node *hnode,
+		void *arg)
+{
+	(void) cnode;
+	(void) hnode;
+	(*(size_t *) arg)++;
+}
 
-int expand(
-		struct lfht_head *lfht,
-		int thread_id,
-		struct lfht_node **new_hash,
+// appends every node reachable from hnode (hnode included) to
+// the growing array "nodes", a node may be appended more than once
+// not thread safe
+void collect_nodes(
 		struct lfht_node *hnode,
-		struct lfht_node *tail_nxt,
-		size_t hash,
-		_Atomic(struct lfht_node *) *tail_nxt_ptr)
+		struct lfht_node ***nodes,
+		size_t *count,
+		size_t *size)
 {
-#if LFHT_DEBUG
-	assert(tail_nxt);
-	assert(hnode);
-	assert(tail_nxt->type == HASH);
-	assert(hnode->type == HASH);
-#endif
+	if(*count == *size) {
+		*size = *size ? 2 * *size : 1024;
+		*nodes = realloc(*nodes, *size * sizeof(struct lfht_node *));
+	}
+	(*nodes)[(*count)++] = hnode;
 
-	*new_hash = create_hash_node(
-			HASH_SIZE,
-			hnode->hash.hash_pos + hnode->hash.size,
-			hnode);
+	for(int i = 0; i < (1<<hnode->hash.size); i++) {
+		struct lfht_node *iter = link_load(
+				&(hnode->hash.array[i]),
+				memory_order_relaxed);
+
+		while(iter != hnode) {
+			if(iter->type == HASH) {
+				// important loop!
+				while(iter->hash.prev != hnode) {
+					iter = iter->hash.prev;
+				}
+				collect_nodes(iter, nodes, count, size);
+				break;
+			}
 
-	// add new hash level to tail of chain
-	if(atomic_compare_exchange_strong_explicit(
-				tail_nxt_ptr,
-				&tail_nxt,
-				*new_hash,
-				memory_order_acq_rel,
-				memory_order_consume)) {
-		// level added
-		int pos = get_bucket_index(
-				hash,
-				hnode->hash.hash_pos,
-				hnode->hash.size);
+			if(*count == *size) {
+				*size *= 2;
+				*nodes = realloc(*nodes, *size * sizeof(struct lfht_node *));
+			}
+			(*nodes)[(*count)++] = iter;
+			iter = valid_ptr(get_next(iter));
+		}
+	}
+}
 
-		// move all nodes of chain to new level
-		_Atomic(struct lfht_node *) *atomic_bucket =
-			&(hnode->hash.array[pos]);
+int compare_nodes(const void *a, const void *b)
+{
+	uintptr_t x = (uintptr_t) *(struct lfht_node * const *) a;
+	uintptr_t y = (uintptr_t) *(struct lfht_node * const *) b;
+	return (x > y) - (x < y);
+}
 
-		struct lfht_node *bucket = atomic_load_explicit(
-				atomic_bucket,
-				memory_order_consume);
+// snapshot functions
 
-		if(bucket->type != LEAF) {
-			free(*new_hash);
-			return 0;
+void snapshot_visit(
+		struct lfht_node *cnode,
+		struct lfht_node *hnode,
+		void *arg)
+{
+	(void) hnode;
+	struct lfht_snapshot_writer *writer = arg;
+	if(writer->lfht->expiry && is_expired(writer->lfht, cnode, writer->now)) {
+		// loaded, it would never expire
+		return;
+	}
+	void *value = writer->keys_only ? NULL : cnode->leaf.value;
+	const void *bytes = &value;
+	size_t len = sizeof(value);
+
+	if(writer->keys_only) {
+		len = 0;
+	} else if(writer->inline_size) {
+		bytes = &(cnode->leaf.value);
+		len = writer->inline_size;
+	} else if(writer->serializer) {
+		len = writer->serializer(value, writer->value_buf, writer->value_size);
+		if(len > writer->value_size) {
+			free(writer->value_buf);
+			writer->value_size = len;
+			writer->value_buf = malloc(len);
+			len = writer->serializer(value, writer->value_buf, writer->value_size);
 		}
+		bytes = writer->value_buf;
+	}
 
-		adjust_chain_nodes(lfht, thread_id, bucket, *new_hash);
-
-		// store() might interfere with freeze()
-		// checking if bucket's head is still our
-		// first observed node
-		while(!atomic_compare_exchange_strong_explicit(
-				atomic_bucket,
-				&bucket,
-				*new_hash,
-				memory_order_acq_rel,
-				memory_order_consume)) ;
-#if LFHT_DEBUG
-		struct lfht_stats* stats = lfht->stats[thread_id];
-		stats->expansion_counter++;
-		int level = (*new_hash)->hash.hash_pos / (*new_hash)->hash.size;
-		if(stats->max_depth < level) {
-			stats->max_depth = level;
+	struct lfht_snapshot_record record = {
+		.hash = cnode->leaf.hash,
+		.len = len
+	};
+	size_t padding = -len & 7;
+	static const unsigned char zero[8];
+	const void *parts[] = {&record, bytes, zero};
+	size_t lens[] = {sizeof(record), len, padding};
+
+	for(int i = 0; i < 3; i++) {
+		const unsigned char *src = parts[i];
+		size_t remaining = lens[i];
+		while(remaining > 0) {
+			if(writer->used == SNAPSHOT_BUFFER) {
+				writer->failed |= !write_all(
+						writer->fd,
+						writer->buf,
+						writer->used,
+						writer->offset);
+				writer->offset += writer->used;
+				writer->used = 0;
+			}
+			size_t chunk = SNAPSHOT_BUFFER - writer->used;
+			if(chunk > remaining) {
+				chunk = remaining;
+			}
+			memcpy(writer->buf + writer->used, src, chunk);
+			writer->used += chunk;
+			src += chunk;
+			remaining -= chunk;
 		}
-#endif
-		return 1;
 	}
+	writer->count++;
+}
 
-	// failed
-	free(*new_hash);
-	return 0;
+// returns: 0/1 success
+unsigned write_all(
+		int fd,
+		const void *buf,
+		size_t len,
+		uint64_t offset)
+{
+	const unsigned char *src = buf;
+	while(len > 0) {
+		ssize_t written = pwrite(fd, src, len, offset);
+		if(written <= 0) {
+			return 0;
+		}
+		src += written;
+		len -= written;
+		offset += written;
+	}
+	return 1;
 }
 
-void adjust_chain_nodes(
+// builds the content of a bucket of hnode holding the n pairs,
+// without synchronization (the result is not reachable yet):
+// hnode itself if empty, a chain of leaves or a new hash level
+// pairs with a hash already present are dropped (multimap: pairs
+// with a (hash, value) already present)
+// leaves come from arena (if not NULL), and count (if not NULL)
+// is incremented by the leaves created
+struct lfht_node *build_bucket(
 		struct lfht_head *lfht,
-		int thread_id,
-		struct lfht_node *cnode,
-		struct lfht_node *hnode)
+		struct lfht_node *hnode,
+		struct lfht_pair *pairs,
+		size_t n,
+		struct lfht_arena *arena,
+		size_t *count)
 {
-#if LFHT_DEBUG
-	assert(cnode);
-	assert(hnode);
-	assert(cnode->type == LEAF);
-	assert(hnode->type == HASH);
-#endif
-	struct lfht_node *nxt_ptr = get_next(cnode);
-	struct lfht_node *nxt = valid_ptr(nxt_ptr);
+	int hash_pos = hnode->hash.hash_pos + hnode->hash.size;
+	unsigned single_hash = 1;
+	for(size_t i = 1; i < n && single_hash; i++) {
+		single_hash = pairs[i].hash == pairs[0].hash;
+	}
 
-	if(nxt != hnode) {
-		adjust_chain_nodes(lfht, thread_id, nxt, hnode);
+	if(n <= (size_t) lfht->max_chain_nodes || single_hash ||
+			hash_pos + lfht->hash_size > (int) (8 * sizeof(size_t))) {
+		struct lfht_node *head = hnode;
+		for(size_t i = 0; i < n; i++) {
+			// the chain built so far holds distinct hashes, at most
+			// max_chain_nodes or as many as the bits left below
+			// this level, multimaps hold distinct (hash, value) pairs
+			struct lfht_node *iter = head;
+			while(iter != hnode) {
+				if(iter->leaf.hash == pairs[i].hash && (!lfht->multimap ||
+							lfht->keys_only ||
+							same_value(lfht, leaf_value(lfht, iter), pairs[i].value))) {
+					break;
+				}
+				iter = get_next(iter);
+			}
+			if(iter == hnode) {
+				if(lfht->filter) {
+					atomic_fetch_or_explicit(
+							filter_word(hnode, pairs[i].hash),
+							filter_bit(pairs[i].hash),
+							memory_order_relaxed);
+				}
+				head = create_leaf_node(
+						lfht,
+						arena,
+						pairs[i].hash,
+						pairs[i].value,
+						0,
+						head);
+				if(count) {
+					(*count)++;
+				}
+			}
+		}
+		return head;
 	}
-	// cnode is the chain's current tail
 
-	if(is_invalid(nxt_ptr) || is_compression_node(cnode)) {
-		return;
+	// too many nodes for a chain, distribute them on a new level
+	struct lfht_node *new_hash = create_hash_node(
+			lfht,
+			lfht->hash_size,
+			hash_pos,
+			hnode);
+	int buckets = 1 << lfht->hash_size;
+	size_t *start = calloc(buckets + 1, sizeof(size_t));
+	struct lfht_pair *sorted = malloc(n * sizeof(struct lfht_pair));
+
+	for(size_t i = 0; i < n; i++) {
+		start[get_bucket_index(pairs[i].hash, hash_pos, lfht->hash_size) + 1]++;
+	}
+	for(int i = 0; i < buckets; i++) {
+		start[i+1] += start[i];
+	}
+	for(size_t i = 0; i < n; i++) {
+		int pos = get_bucket_index(pairs[i].hash, hash_pos, lfht->hash_size);
+		sorted[start[pos]++] = pairs[i];
 	}
 
-	// move cnode to new level
-	adjust_node(lfht, thread_id, cnode, hnode);
+	// start[i] now points to the end of bucket i
+	size_t first = 0;
+	for(int i = 0; i < buckets; i++) {
+		link_store(
+				&(new_hash->hash.array[i]),
+				build_bucket(lfht, new_hash, sorted + first, start[i] - first, arena, count),
+				memory_order_relaxed);
+		first = start[i];
+	}
+
+	free(sorted);
+	free(start);
+	return new_hash;
 }
 
-void adjust_node(
+// as build_bucket(), with existing (distinct, valid) leaves
+// moved instead of pairs copied
+struct lfht_node *relink_bucket(
 		struct lfht_head *lfht,
-		int thread_id,
-		struct lfht_node *cnode,
-		struct lfht_node *hnode)
+		struct lfht_node *hnode,
+		struct lfht_node **leaves,
+		size_t n)
 {
-#if LFHT_DEBUG
-	int trial = 0;
-#endif
+	int hash_pos = hnode->hash.hash_pos + hnode->hash.size;
+	unsigned single_hash = 1;
+	for(size_t i = 1; i < n && single_hash; i++) {
+		single_hash = leaves[i]->leaf.hash == leaves[0]->leaf.hash;
+	}
 
-start: ;
-#if LFHT_DEBUG
-	assert(cnode);
-	assert(hnode);
-	assert(cnode->type == LEAF);
-	assert(hnode->type == HASH);
+	if(n <= (size_t) lfht->max_chain_nodes || single_hash ||
+			hash_pos + lfht->hash_size > (int) (8 * sizeof(size_t))) {
+		struct lfht_node *head = hnode;
+		for(size_t i = 0; i < n; i++) {
+			if(lfht->filter) {
+				atomic_fetch_or_explicit(
+						filter_word(hnode, leaves[i]->leaf.hash),
+						filter_bit(leaves[i]->leaf.hash),
+						memory_order_relaxed);
+			}
+			link_store(&(leaves[i]->leaf.next), head, memory_order_relaxed);
+			head = leaves[i];
+		}
+		return head;
+	}
 
-	struct lfht_stats* stats = lfht->stats[thread_id];
-	trial++;
-	if (stats->max_retry_counter < trial) {
-		stats->max_retry_counter = trial;
+	// too many nodes for a chain, distribute them on a new level
+	struct lfht_node *new_hash = create_hash_node(
+			lfht,
+			lfht->hash_size,
+			hash_pos,
+			hnode);
+	int buckets = 1 << lfht->hash_size;
+	size_t *start = calloc(buckets + 1, sizeof(size_t));
+	struct lfht_node **sorted = malloc(n * sizeof(struct lfht_node *));
+
+	for(size_t i = 0; i < n; i++) {
+		start[get_bucket_index(leaves[i]->leaf.hash, hash_pos, lfht->hash_size) + 1]++;
+	}
+	for(int i = 0; i < buckets; i++) {
+		start[i+1] += start[i];
+	}
+	for(size_t i = 0; i < n; i++) {
+		int pos = get_bucket_index(leaves[i]->leaf.hash, hash_pos, lfht->hash_size);
+		sorted[start[pos]++] = leaves[i];
 	}
-#endif
-	unsigned int count = 0;
-	size_t hash = cnode->leaf.hash;
-	_Atomic(struct lfht_node *) *current_valid =
-		get_atomic_bucket(hash, hnode);
-	struct lfht_node *expect = valid_ptr(atomic_load_explicit(
-				current_valid,
-				memory_order_consume));
-	struct lfht_node *iter = expect;
 
-	if(is_compression_node(iter)) {
-		if(!unfreeze(lfht, thread_id, hnode, hash)) {
-			// level already removed
-			return;
+	size_t first = 0;
+	for(int i = 0; i < buckets; i++) {
+		link_store(
+				&(new_hash->hash.array[i]),
+				relink_bucket(lfht, new_hash, sorted + first, start[i] - first),
+				memory_order_relaxed);
+		first = start[i];
+	}
+
+	free(sorted);
+	free(start);
+	return new_hash;
+}
+
+void *load_buckets(void *arg)
+{
+	struct lfht_snapshot_loader *loader = arg;
+	struct lfht_node *root = loader->lfht->entry_hash;
+	int buckets = 1 << root->hash.size;
+	struct lfht_pair *pairs = NULL;
+	size_t capacity = 0;
+
+	for(;;) {
+		int pos = atomic_fetch_add_explicit(
+				&(loader->next_bucket),
+				1,
+				memory_order_relaxed);
+		if(pos >= buckets) {
+			break;
 		}
 
-		// skip compression node
-		iter = valid_ptr(get_next(iter));
-#if LFHT_DEBUG
-		assert(iter);
-		assert(iter->type == HASH);
-#endif
-	}
+		const unsigned char *iter = loader->map + loader->offsets[pos];
+		const unsigned char *end = loader->map + loader->offsets[pos+1];
+		size_t max_records = (end - iter) / sizeof(struct lfht_snapshot_record);
+		if(max_records > capacity) {
+			free(pairs);
+			capacity = max_records;
+			pairs = malloc(capacity * sizeof(struct lfht_pair));
+		}
 
-	// find tail of target bucket on new hash level
-	while(iter->type == LEAF) {
-		struct lfht_node *nxt_ptr = get_next(iter);
+		size_t n = 0;
+		while(iter < end) {
+			const struct lfht_snapshot_record *record =
+				(const struct lfht_snapshot_record *) iter;
+			iter += sizeof(struct lfht_snapshot_record);
+
+			size_t value_size = loader->lfht->value_size;
+			if(iter > end || record->len > (size_t) (end - iter) ||
+					(value_size && record->len != value_size) ||
+					(loader->lfht->keys_only && record->len != 0) ||
+					(size_t) get_bucket_index(record->hash, 0, root->hash.size) != (size_t) pos) {
+				atomic_store_explicit(&(loader->failed), 1, memory_order_relaxed);
+				break;
+			}
 
-		if(is_invalid(nxt_ptr)) {
-			// skip invalid node
-			iter = valid_ptr(nxt_ptr);
-			continue;
+			pairs[n].hash = record->hash;
+			pairs[n].value = loader->deserializer && !value_size &&
+					!loader->lfht->keys_only ?
+				loader->deserializer(iter, record->len) :
+				(void *) iter;
+			n++;
+			iter += (record->len + 7) & ~(uint64_t) 7;
 		}
 
-		current_valid = &(iter->leaf.next);
-		expect = valid_ptr(nxt_ptr);
-		iter = expect;
-		count++;
+		link_store(
+				&(root->hash.array[pos]),
+				build_bucket(loader->lfht, root, pairs, n, NULL, NULL),
+				memory_order_release);
 	}
 
-	if(iter != hnode) {
-		// important loop!
-		// during adjust (after force_cas)
-		// there is a window when nodes may skip a level
-		while(iter->hash.prev != hnode) {
-			iter = iter->hash.prev;
+	free(pairs);
+	return NULL;
+}
+
+// phases of lfht_bulk_build(), each run by all workers:
+// BULK_COUNT -> counts the pairs of slice "index" per root bucket
+// BULK_SCATTER -> copies them to their root bucket's group
+// BULK_BUILD -> builds the unoccupied root buckets, claimed one by one
+void *bulk_build_worker(void *arg)
+{
+	struct lfht_bulk_worker *worker = arg;
+	struct lfht_bulk_build *build = worker->build;
+	struct lfht_head *lfht = build->lfht;
+	struct lfht_node *root = lfht->entry_hash;
+	int buckets = 1 << root->hash.size;
+	size_t *counts = build->counts + (size_t) worker->index * buckets;
+	size_t first = build->n * worker->index / build->nthreads;
+	size_t last = build->n * (worker->index + 1) / build->nthreads;
+
+	switch(build->phase) {
+	case BULK_COUNT:
+		for(size_t i = first; i < last; i++) {
+			size_t hash = mix_hash(lfht, build->input[i].hash);
+			counts[get_bucket_index(hash, 0, root->hash.size)]++;
+		}
+		break;
+	case BULK_SCATTER:
+		// slices are placed in order, the input order of
+		// pairs is kept within every root bucket
+		for(size_t i = first; i < last; i++) {
+			size_t hash = mix_hash(lfht, build->input[i].hash);
+			struct lfht_pair *pair =
+				&(build->pairs[counts[get_bucket_index(hash, 0, root->hash.size)]++]);
+			pair->hash = hash;
+			pair->value = build->input[i].value;
 		}
+		break;
+	case BULK_BUILD: ;
+		// a private arena, its chunks belong to the table anyway
+		struct lfht_arena arena = {NULL, 0};
+		size_t count = 0;
+		for(;;) {
+			int pos = atomic_fetch_add_explicit(
+					&(build->next_bucket),
+					1,
+					memory_order_relaxed);
+			if(pos >= buckets) {
+				break;
+			}
+			if(build->occupied[pos]) {
+				continue;
+			}
 
-		hnode = iter;
-		goto start;
+			// counts[pos] (of slice 0) is where the bucket's group starts
+			size_t start = build->counts[pos];
+			size_t end = pos + 1 < buckets ? build->counts[pos+1] : build->n;
+			if(start == end) {
+				continue;
+			}
+			link_store(
+					&(root->hash.array[pos]),
+					build_bucket(
+						lfht,
+						root,
+						build->pairs + start,
+						end - start,
+						lfht->arena ? &arena : NULL,
+						&count),
+					memory_order_release);
+		}
+		atomic_fetch_add_explicit(&(build->count), count, memory_order_relaxed);
+		break;
 	}
+	return NULL;
+}
 
-	// expansion required?
-	if(count >= MAX_NODES) {
-		struct lfht_node *new_hash;
-		if(expand(lfht, thread_id, &new_hash, hnode, expect, hash, current_valid)) {
-			// adjust node at new level
-			hnode = new_hash;
-		}
+// debug functions
 
-		goto start;
+#if LFHT_DEBUG
+
+void *lfht_debug_search(
+		struct lfht_head *lfht,
+		size_t hash,
+		int thread_id)
+{
+	struct lfht_node *cnode = debug_search_hash(
+			lfht->entry_hash,
+			mix_hash(lfht, hash));
+	return cnode ? leaf_value(lfht, cnode) : NULL;
+}
+
+void lfht_sharded_debug_stats(
+		struct lfht_sharded *sharded,
+		struct lfht_stats *stats)
+{
+	memset(stats, 0, sizeof(struct lfht_stats));
+	for(int i = 0; i < 1 << sharded->shard_bits; i++) {
+		struct lfht_head *lfht = sharded->shards[i];
+		for(int j = 0; j <= SHARED_THREAD(lfht); j++) {
+			struct lfht_stats *shard_stats = lfht->stats[j];
+			stats->compression_counter += shard_stats->compression_counter;
+			stats->compression_rollback_counter += shard_stats->compression_rollback_counter;
+			stats->compression_deferred_counter += shard_stats->compression_deferred_counter;
+			stats->expansion_counter += shard_stats->expansion_counter;
+			stats->expansion_help_counter += shard_stats->expansion_help_counter;
+			stats->unfreeze_counter += shard_stats->unfreeze_counter;
+			stats->freeze_counter += shard_stats->freeze_counter;
+			stats->operations += shard_stats->operations;
+			stats->api_calls += shard_stats->api_calls;
+			if(stats->max_retry_counter < shard_stats->max_retry_counter) {
+				stats->max_retry_counter = shard_stats->max_retry_counter;
+			}
+			if(stats->max_depth < shard_stats->max_depth) {
+				stats->max_depth = shard_stats->max_depth;
+			}
+		}
 	}
+}
 
-	// point node to newer level
-	if(!force_cas(cnode, hnode)) {
-		// node invalidated in the meantime
-		return;
+void lfht_debug_set_interleave(
+		struct lfht_head *lfht,
+		unsigned int one_in)
+{
+	lfht->interleave = one_in;
+}
+
+int lfht_debug_validate(struct lfht_head *lfht)
+{
+	struct lfht_validation validation = {
+		.leaves = malloc(CACHE_SIZE*sizeof(struct lfht_node *)),
+		.count = 0,
+		.size = CACHE_SIZE,
+		.violations = 0
+	};
+	validate_hash(lfht, lfht->entry_hash, 0, &validation);
+
+	// a leaf reachable from two levels is found twice
+	qsort(validation.leaves, validation.count, sizeof(struct lfht_node *), compare_nodes);
+	for(size_t i = 1; i < validation.count; i++) {
+		if(validation.leaves[i] == validation.leaves[i-1]) {
+			fprintf(stderr, "leaf %p reachable more than once\n", (void *) validation.leaves[i]);
+			validation.violations++;
+		}
 	}
 
-	// inserting node in chain of the newer level
-	if(atomic_compare_exchange_strong_explicit(
-				current_valid,
-				&expect,
-				cnode,
-				memory_order_acq_rel,
-				memory_order_consume)) {
-		if(is_invalid(get_next(cnode))) {
-			// node invalidated while it was being adjusted
-			make_unreachable(lfht, thread_id, cnode, hnode);
+	if(!lfht->multimap) {
+		qsort(validation.leaves, validation.count, sizeof(struct lfht_node *), compare_leaf_hashes);
+		for(size_t i = 1; i < validation.count; i++) {
+			if(validation.leaves[i] != validation.leaves[i-1] &&
+					validation.leaves[i]->leaf.hash == validation.leaves[i-1]->leaf.hash) {
+				fprintf(stderr, "hash %zx present more than once\n", validation.leaves[i]->leaf.hash);
+				validation.violations++;
+			}
 		}
-		return;
 	}
-	// insertion failed
-	goto start;
-}
 
-// searching functions
+	free(validation.leaves);
+	return validation.violations;
+}
 
-void *search_node(
+// prefix -> bits of the hash below hnode->hash.hash_pos
+// leading to hnode
+void validate_hash(
 		struct lfht_head *lfht,
-		int thread_id,
 		struct lfht_node *hnode,
-		size_t hash)
+		size_t prefix,
+		struct lfht_validation *validation)
 {
-#if LFHT_DEBUG
-	assert(hnode);
-	assert(hnode->type == HASH);
-#endif
-	struct lfht_node *cnode;
-	if(find_node(lfht, thread_id, hash, &hnode, &cnode, NULL, NULL)) {
-		return cnode->leaf.value;
+	int bits = hnode->hash.hash_pos + hnode->hash.size;
+	size_t mask = bits >= 8*(int) sizeof(size_t) ? ~(size_t) 0 : ((size_t) 1 << bits) - 1;
+
+	for(int i = 0; i < (1 << hnode->hash.size); i++) {
+		size_t bucket_prefix = prefix | ((size_t) i << hnode->hash.hash_pos);
+		struct lfht_node *iter = link_load(
+				&(hnode->hash.array[i]),
+				memory_order_seq_cst);
+		struct lfht_node *head = iter;
+		long length = 0;
+
+		if(is_compression_node(iter)) {
+			fprintf(stderr, "compression node left in bucket %d of the level at bit %d\n",
+					i, hnode->hash.hash_pos);
+			validation->violations++;
+			iter = valid_ptr(get_next(iter));
+			head = iter;
+		}
+
+		while(iter != hnode) {
+			if(iter->type == HASH) {
+				if(iter->hash.prev != hnode ||
+						iter->hash.hash_pos != bits) {
+					fprintf(stderr, "bucket %d of the level at bit %d skips to the level at bit %d\n",
+							i, hnode->hash.hash_pos, iter->hash.hash_pos);
+					validation->violations++;
+					break;
+				}
+				if(iter != head) {
+					fprintf(stderr, "chain of bucket %d of the level at bit %d still expanding\n",
+							i, hnode->hash.hash_pos);
+					validation->violations++;
+				}
+				validate_hash(lfht, iter, bucket_prefix, validation);
+				break;
+			}
+
+			if(iter->type != LEAF) {
+				fprintf(stderr, "compression node inside bucket %d of the level at bit %d\n",
+						i, hnode->hash.hash_pos);
+				validation->violations++;
+				break;
+			}
+
+			if(++length > CYCLE_THRESHOLD) {
+				fprintf(stderr, "cycle in bucket %d of the level at bit %d\n",
+						i, hnode->hash.hash_pos);
+				validation->violations++;
+				break;
+			}
+
+			struct lfht_node *nxt_ptr = get_next(iter);
+			if(!is_invalid(nxt_ptr)) {
+				if((iter->leaf.hash & mask) != bucket_prefix) {
+					fprintf(stderr, "hash %zx in bucket %d of the level at bit %d\n",
+							iter->leaf.hash, i, hnode->hash.hash_pos);
+					validation->violations++;
+				}
+				if(validation->count == validation->size) {
+					validation->size *= 2;
+					validation->leaves = realloc(
+							validation->leaves,
+							validation->size*sizeof(struct lfht_node *));
+				}
+				validation->leaves[validation->count++] = iter;
+			}
+			iter = valid_ptr(nxt_ptr);
+		}
 	}
-	return NULL;
 }
 
-// debug functions
-
-#if LFHT_DEBUG
+int compare_leaf_hashes(
+		const void *a,
+		const void *b)
+{
+	size_t x = (*(struct lfht_node * const *) a)->leaf.hash;
+	size_t y = (*(struct lfht_node * const *) b)->leaf.hash;
+	return (x > y) - (x < y);
+}
 
-void *lfht_debug_search(
-		struct lfht_head *lfht,
-		size_t hash,
-		int thread_id)
+// yields one time in lfht->interleave
+void interleave(struct lfht_head *lfht)
 {
-	return debug_search_hash(lfht->entry_hash, hash);
+	unsigned int x = interleave_state;
+	if(x == 0) {
+		x = (unsigned int) (uintptr_t) &interleave_state | 1;
+	}
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	interleave_state = x;
+	if(x % lfht->interleave == 0) {
+		sched_yield();
+	}
 }
 
-void *debug_search_hash(
+struct lfht_node *debug_search_hash(
 		struct lfht_node *hnode,
 		size_t hash)
 {
@@ -1269,7 +6685,7 @@ void *debug_search_hash(
 			hash,
 			hnode->hash.hash_pos,
 			hnode->hash.size);
-	struct lfht_node *next_node = atomic_load_explicit(
+	struct lfht_node *next_node = link_load(
 			&(hnode->hash.array[pos]),
 			memory_order_seq_cst);
 	if(next_node == hnode)
@@ -1280,22 +6696,18 @@ void *debug_search_hash(
 		return debug_search_chain(next_node, hnode, hash);
 }
 
-void *debug_search_chain(
+struct lfht_node *debug_search_chain(
 		struct lfht_node *cnode,
 		struct lfht_node *hnode,
 		size_t hash)
 {
 	if(cnode->leaf.hash == hash) {
-		if(is_invalid(atomic_load_explicit(
-						&(cnode->leaf.next),
-						memory_order_seq_cst)))
-			fprintf(stderr, "Invalid node found: %p\n", cnode->leaf.value);
+		if(is_invalid(get_next(cnode)))
+			fprintf(stderr, "Invalid node found: %p\n", (void *) cnode);
 		else
-			return cnode->leaf.value;
+			return cnode;
 	}
-	struct lfht_node *next_node = valid_ptr(atomic_load_explicit(
-				&(cnode->leaf.next),
-				memory_order_seq_cst));
+	struct lfht_node *next_node = valid_ptr(get_next(cnode));
 	if(next_node == hnode)
 		return NULL;
 	else if(next_node->type == LEAF)
@@ -1,23 +1,63 @@
 #include <stddef.h>
+#include <stdint.h>
 
+#ifdef __cplusplus
+extern "C" {
+// atomic fields are only accessed by the C implementation
+#define LFHT_ATOMIC(type) type
+#else
+#define LFHT_ATOMIC(type) _Atomic(type)
+#endif
 
 #ifndef LFHT_DEBUG
 #define LFHT_DEBUG 0
 #endif
 
+// build lfht.c with -DLFHT_COMPACT=1 for 32 bit links
+// (see: lfht_set_arena())
+#ifndef LFHT_COMPACT
+#define LFHT_COMPACT 0
+#endif
+
 #define MAX_NODES 3
 #define ROOT_HASH_SIZE 16
 #define HASH_SIZE 4
 #define CACHE_SIZE 64
+// minimum age (ns) of a hash level before it may be compressed
+#define COMPRESS_GRACE 0
+// thread_id of a thread registered on its first call
+#define LFHT_THREAD_AUTO -1
+
+// bit mixing applied to hashes at the API entry points
+enum lfht_hash_mix {
+	LFHT_MIX_NONE,
+	// murmur3 64 bit finalizer
+	LFHT_MIX_MURMUR3,
+	// multiplication by a 64 bit odd constant,
+	// high bits folded into the low ones
+	LFHT_MIX_MULTIPLY
+};
+
+struct lfht_maintenance;
+struct lfht_reclaim;
+struct lfht_compact;
+struct lfht_thread;
+struct lfht_cache;
+struct lfht_expiry;
+struct lfht_snapshots;
+struct lfht_snapshot;
 
 #if LFHT_DEBUG
 struct lfht_stats {
 	int compression_counter;
 	int compression_rollback_counter;
+	int compression_deferred_counter;
 	int expansion_counter;
+	int expansion_help_counter;
 	int unfreeze_counter;
 	int freeze_counter;
 	int max_retry_counter;
+	int reclaimed_counter;
 	int operations;
 	int api_calls;
 	int max_depth;
@@ -26,12 +66,52 @@ struct lfht_stats {
 
 struct lfht_head {
 	struct lfht_node *entry_hash;
+	unsigned long table_id;
 	int max_threads;
+	// per thread state, allocated on first use
+	LFHT_ATOMIC(struct lfht_thread *) *threads;
 	int root_hash_size;
 	int hash_size;
 	int max_chain_nodes;
+	long compress_grace;
+	enum lfht_hash_mix hash_mix;
+	// 0 -> values are pointers
+	size_t value_size;
+	// NULL -> not a cache (see: lfht_set_capacity())
+	struct lfht_cache *cache;
+	// NULL -> entries do not expire (see: lfht_set_expiry())
+	struct lfht_expiry *expiry;
+	// NULL -> no point in time snapshots (see: lfht_set_snapshots())
+	struct lfht_snapshots *snapshots;
+	// 0 -> no change feed (see: lfht_set_change_feed())
+	size_t change_ring_size;
+	// 0 -> no latency histograms (see: lfht_set_latency_sampling())
+	unsigned int latency_period;
+	// 0 -> no workload trace (see: lfht_set_trace())
+	size_t trace_size;
+	// 0/1 several values per hash (see: lfht_set_multimap())
+	unsigned multimap;
+	// 0/1 leaves without a value (see: lfht_set_keys_only())
+	unsigned keys_only;
+	// 0/1 hash nodes carry fingerprint filters (see: lfht_set_filter())
+	unsigned filter;
+	// slots of per thread search caches (see: lfht_set_hot_cache())
+	unsigned hot_size;
+	// 0/1 leaves are allocated from chunks (see: lfht_set_arena())
+	unsigned arena;
+	LFHT_ATOMIC(void *) arena_chunks;
+	// NULL -> links are pointers (see: LFHT_COMPACT)
+	struct lfht_compact *compact;
+	struct lfht_maintenance *maintenance;
+	// NULL -> removed leaves are never freed (see: lfht_set_reclaim())
+	struct lfht_reclaim *reclaim;
+	// file mapping backing a table built by lfht_load_mmap()
+	void *snapshot_map;
+	size_t snapshot_size;
 #if LFHT_DEBUG
-	_Atomic(struct lfht_stats*) *stats;
+	LFHT_ATOMIC(struct lfht_stats*) *stats;
+	// 0 -> preemption points never yield (see: lfht_debug_set_interleave())
+	unsigned int interleave;
 #endif
 };
 
@@ -44,12 +124,281 @@ struct lfht_head *init_lfht_explicit(
 		int hash_size,
 		int max_chain_nodes);
 
+// frees the table and its nodes, values are owned by the caller
+// (and nodes removed while the table was shared are leaked,
+// unless reclaimed, see: lfht_set_reclaim())
 // not thread safe
 void free_lfht(struct lfht_head *lfht);
 
+// empty hash levels younger than "nanoseconds" are not
+// compressed, avoiding expand/compress thrashing
+// on workloads oscillating around the chain threshold
+// not thread safe, call before sharing the table
+void lfht_set_compress_grace(
+		struct lfht_head *head,
+		long nanoseconds);
+
+// maintenance mode: lfht_remove only invalidates nodes,
+// unlinking and compression of empty levels are deferred
+// to a background thread, woken every "interval" ns
+// removes push the node on a ring of 1024 slots of their thread
+// id (allocated by its first deferred remove, 16 KiB), and
+// unlink it themselves when the ring is full, or on the id shared
+// past max_threads, so removes allocate nothing after the first
+// thread_id (0 to max_threads - 1) is reserved for the maintenance
+// thread until it stops: lfht_init_thread() and LFHT_THREAD_AUTO
+// skip it, and no other thread may pass it (asserted with
+// LFHT_DEBUG), as the change feed ring of an id has a single
+// producer (LFHT_THREAD_AUTO -> registered by the maintenance thread)
+// returns: 0/1 success, 0 if it is already running, thread_id is
+//   out of range or registered by another thread
+int lfht_start_maintenance(
+		struct lfht_head *head,
+		int thread_id,
+		long interval);
+
+// processes pending removals and joins the maintenance thread
+void lfht_stop_maintenance(
+		struct lfht_head *head);
+
+// reclamation: the leaves the maintenance thread unlinks are
+// freed by its later runs, once every API call that could still
+// reach them has returned (freed leaves are counted by
+// LFHT_DEBUG stats)
+// every API call then announces itself, a store and a fence
+// at its start, and on the id shared past max_threads, as well
+// as lfht_foreach(), lfht_count(), lfht_scan_prefix() and
+// lfht_snapshot_write(), an atomic increment of a shared counter,
+// which holds every leaf back while it is not 0
+// leaves also wait while chains migrate to new levels, and
+// removes unlinked by their caller (full unlink ring, shared id,
+// maintenance thread stopped) are not freed before free_lfht()
+// inline values, hot caches, arenas and snapshots hand out
+// pointers to leaves that outlive the calls, so they cannot be
+// combined with it, nor can the node returned by lfht_insert()
+// be used past a remove of its entry, and change feed ids of
+// freed leaves may name later entries
+// returns: 0/1 enabled, 0 if one of them is set
+// not thread safe, call after the other setters, before the first insert
+int lfht_set_reclaim(
+		struct lfht_head *head);
+
+// buckets are indexed by the low bits of the hash, level by level,
+// so low entropy hashes (pointers, sequential integers) should be mixed
+// every mix is a bijection, distinct hashes never collide
+// not thread safe, call before the first insert
+void lfht_set_hash_mix(
+		struct lfht_head *head,
+		enum lfht_hash_mix mix);
+
+// inline values: the value_size bytes of every value are copied
+// into its leaf, saving an allocation per insert and a pointer
+// chase per search
+// value arguments of insert then point to the bytes to copy, and
+// returned values point to the bytes inside the leaf, which stay
+// readable until free_lfht() (even after a remove)
+// not thread safe, call before the first insert
+void lfht_set_value_size(
+		struct lfht_head *head,
+		size_t value_size);
+
+// negative lookup filters: every bucket gets a 64 bit word
+// with a bit per hash linked in it (8 more bytes per bucket),
+// searches and removes of absent hashes mostly stop at it
+// without reading the bucket's chain
+// bits of removed hashes are dropped when their chain moves to
+// a new level or their level is compressed
+// hits pay for it: every search also loads the filter word and
+// mixes the hash, about 1.5x the latency of a hit without filter
+// (measured 37 -> 55 ns and 602 -> 886 ns per hit), and
+// every insert sets its bit with an atomic or, so it only pays
+// off on miss heavy workloads
+// not thread safe, call before the first insert
+void lfht_set_filter(
+		struct lfht_head *head);
+
+// hot key cache: every thread id keeps the leaves found by its
+// last searches in a direct mapped array of "entries" slots
+// (rounded up to a power of 2, indexed by the low bits of the
+// hash, 8 bytes each), a search of a cached hash whose leaf is
+// still valid skips the traversal
+// removed leaves are invalidated, never freed while the table
+// lives, so cached ones are always safe to check
+// not thread safe, call before the first insert or lfht_init_thread()
+void lfht_set_hot_cache(
+		struct lfht_head *head,
+		unsigned int entries);
+
+// leaf arena: leaves are carved out of 64 KiB chunks, each
+// thread id filling its own, instead of being malloc()ed one by one
+// this saves the allocator's per chunk overhead (a 32 byte leaf
+// takes 48 bytes from glibc malloc) and keeps the leaves of a
+// thread's consecutive inserts together
+// only the allocation changes: buckets and links stay full
+// pointers, hash nodes are malloc()ed, and leaves larger than a
+// chunk (see: lfht_set_value_size()) get an allocation of their own
+// free_lfht() frees the chunks, including removed leaves
+// not thread safe, call before the first insert
+void lfht_set_arena(
+		struct lfht_head *head);
+
+// compact links, a build time mode (LFHT_COMPACT): every table
+// reserves 4 GiB of address space (backed as it is used) holding
+// all of its nodes, and bucket slots and chain links are 32 bit
+// offsets into it, with the invalid bit, the link version (4 bits,
+// it wraps after 16 relinks instead of 65536) and a hash node tag
+// packed in, halving bucket arrays (16 buckets per cache line
+// instead of 8)
+// leaves are allocated as with lfht_set_arena(), which every table
+// then has (so lfht_set_reclaim() refuses them), but 32 byte
+// aligned: keys only and value leaves take 32 bytes, larger ones
+// are rounded up (expiry leaves take 64 bytes, more than with
+// lfht_set_arena() alone), the link is followed by 4 bytes of
+// padding
+// a table holds at most 2 GiB of leaves (removed ones and
+// compression nodes included) and 2 GiB of hash nodes, past that
+// an insert aborts the process
+// init_lfht() returns NULL if the space cannot be reserved
+
+// set mode: leaves end before their value pointer (24 bytes
+// instead of 32 on 64 bit), values given to insert are ignored,
+// returned values are NULL and lfht_set_value_size() has no effect
+// (see: lfht_contains())
+// not thread safe, call before the first insert
+void lfht_set_keys_only(
+		struct lfht_head *head);
+
+// hash functions for callers without one of their own
+
+size_t lfht_hash_u64(uint64_t key);
+
+// processes 32 byte stripes on four independent lanes
+size_t lfht_hash_bytes(
+		const void *data,
+		size_t len);
+
+// snapshot files
+//
+// records of (hash, value bytes) grouped by root bucket,
+// positions are file offsets, so the file can be mapped anywhere
+// (native byte order)
+
+// writes the serialized value to buf
+// returns: size of the serialized value, if larger than len
+//   it is called again with a large enough buffer
+typedef size_t (*lfht_serializer)(
+		void *value,
+		void *buf,
+		size_t len);
+
+// value -> "len" bytes inside the file mapping
+// returns: the value to store in the table
+typedef void *(*lfht_deserializer)(
+		const void *value,
+		size_t len);
+
+// writes every entry of the table to fd (a file, at its start),
+// expired ones as of the start of the call excluded
+// value_serializer == NULL -> the value pointers themselves are written
+// (inline values are always written as they are)
+// concurrent updates may or may not be part of the snapshot
+// returns: 0/1 success
+int lfht_snapshot_write(
+		struct lfht_head *head,
+		int fd,
+		lfht_serializer value_serializer);
+
+// builds a table from a file written by lfht_snapshot_write(),
+// root buckets are built in parallel by nthreads threads,
+// without going through lfht_insert()
+// value_deserializer == NULL -> values point into the file mapping,
+//   which stays mapped until free_lfht()
+// snapshots of tables with inline values are loaded with the
+// same value_size, value_deserializer is ignored
+// expiry times are not part of snapshots, entries already expired
+// when it was written are left out of it
+// returns: NULL if the file is not a valid snapshot
+struct lfht_head *lfht_load_mmap(
+		int fd,
+		int max_threads,
+		lfht_deserializer value_deserializer,
+		int nthreads);
+
+// root size, quiescent utilities
+//
+// the root has 2^root_hash_size buckets from init on, levels
+// below it come and go with the entries, and the root itself is
+// never resized while the table is shared (there is no online
+// migration of entry_hash)
+// these are not lock-free: they rebuild the levels of a table in
+// place and free() the old hash nodes, so no other thread may use
+// the table during the call (maintenance stopped, no search,
+// update, foreach or snapshot in progress), e.g. between load phases
+
+// moves every entry under a new root of 2^root_hash_size buckets
+// (1 to 24 bits), leaves are relinked (not copied), hash levels
+// rebuilt from scratch
+// returns: 0 if root_hash_size is out of range, the maintenance
+//   thread is running or, with lfht_set_reclaim(), an API call
+//   is in progress, 1 otherwise
+int lfht_rebuild_root_quiescent(
+		struct lfht_head *head,
+		int root_hash_size);
+
+// counts the entries and rebuilds the root with the smallest size
+// whose buckets hold max_chain_nodes entries on average (between
+// hash_size and 24 bits), unless that is within a bit of the
+// current one; never called by the table itself, the caller
+// picks a quiescent point
+// returns: bits of the root
+int lfht_tune_root_quiescent(
+		struct lfht_head *head);
+
+// bulk loading
+
+struct lfht_pair {
+	size_t hash;
+	void *value;
+};
+
+// inserts the n pairs into a table no other thread is using:
+// they are partitioned by root bucket on nthreads threads, and
+// every empty root bucket is built privately (levels sized by
+// the pairs it gets, without expansions) and published with a
+// single store, root buckets holding entries already get
+// regular inserts (with thread_id)
+// of pairs with the same hash, the first one is inserted (multimap:
+// of equal (hash, value) pairs), entries do not expire
+// returns: number of entries inserted
+size_t lfht_bulk_build(
+		struct lfht_head *head,
+		const struct lfht_pair *pairs,
+		size_t n,
+		int nthreads,
+		int thread_id);
+
+// thread ids index per thread state and are either handed out
+// by the caller (dense, 0 <= thread_id < max_threads) or
+// registered, never both on the same table
+//
+// every thread_id argument accepts LFHT_THREAD_AUTO, the calling
+// thread is then registered on its first call and its id is kept
+// in thread local storage
+// an auto id stays taken until its thread calls lfht_end_thread(),
+// ids of threads exiting without it leak
+// threads registered once max_threads ids are taken share one
+// overflow id: correct, but without arena, hot cache, trace or
+// latency sampling, and every change feed event of theirs is
+// lost (see: lfht_changes_lost())
+
+// registers the calling thread
+// returns: a free thread id, or -1 if max_threads are registered
 int lfht_init_thread(
 		struct lfht_head *head);
 
+// releases the thread id for reuse by other threads
+// threads registered with LFHT_THREAD_AUTO must call it
+// (with LFHT_THREAD_AUTO) before exiting
 void lfht_end_thread(
 		struct lfht_head *head,
 		int thread_id);
@@ -70,9 +419,452 @@ void lfht_remove(
 		size_t hash,
 		int thread_id);
 
+// variants of search/insert/remove telling a NULL value apart
+// from a missing hash
+
+// returns: 0/1 found, the value is stored in *value
+int lfht_search_value(
+		struct lfht_head *head,
+		size_t hash,
+		void **value,
+		int thread_id);
+
+// returns: 0/1 inserted, if hash was already present
+//   its value is stored in *present (if not NULL)
+int lfht_insert_value(
+		struct lfht_head *head,
+		size_t hash,
+		void *value,
+		void **present,
+		int thread_id);
+
+// returns: 0/1 removed by this call, the value of the
+//   removed node is stored in *value
+int lfht_remove_value(
+		struct lfht_head *head,
+		size_t hash,
+		void **value,
+		int thread_id);
+
+// membership of hash, for sets and maps alike
+
+// returns: 0/1 present
+int lfht_contains(
+		struct lfht_head *head,
+		size_t hash,
+		int thread_id);
+
+// works on any table, the entry gets a NULL value (zero filled
+// with lfht_set_value_size()), multimaps add the (hash, NULL) pair
+// returns: 0/1 added by this call
+int lfht_add(
+		struct lfht_head *head,
+		size_t hash,
+		int thread_id);
+
+// returns: 0/1 removed by this call
+int lfht_discard(
+		struct lfht_head *head,
+		size_t hash,
+		int thread_id);
+
+// copies of inline values (see: lfht_set_value_size())
+
+// returns: 0/1 found, the value is copied to "value"
+int lfht_search_copy(
+		struct lfht_head *head,
+		size_t hash,
+		void *value,
+		int thread_id);
+
+// returns: 0/1 inserted
+int lfht_insert_copy(
+		struct lfht_head *head,
+		size_t hash,
+		const void *value,
+		int thread_id);
+
+typedef void (*lfht_visitor)(
+		size_t hash,
+		void *value,
+		void *arg);
+
+// calls visitor() for every entry of the table (expired ones
+// as of the start of the call excluded)
+// weakly consistent, entries inserted or removed concurrently
+// may or may not be visited, and entries moved by a concurrent
+// expansion may be visited twice
+void lfht_foreach(
+		struct lfht_head *head,
+		lfht_visitor visitor,
+		void *arg);
+
+// number of entries, counted by a walk of the whole table with
+// the consistency of lfht_foreach() (see: lfht_size() for the
+// constant time counter of cache mode)
+size_t lfht_count(
+		struct lfht_head *head);
+
+// calls visitor() for every entry whose hash has the prefix_bits
+// low bits of prefix (0 to 8*sizeof(size_t), larger values
+// match the whole hash, negative ones nothing), only the subtree
+// of the trie holding them is walked, with the consistency of
+// lfht_foreach()
+// the prefix is matched against the mixed hash
+// (see: lfht_set_hash_mix()), so with a mix it partitions the
+// entries but does not select the caller's hash bits
+void lfht_scan_prefix(
+		struct lfht_head *head,
+		size_t prefix,
+		int prefix_bits,
+		lfht_visitor visitor,
+		void *arg);
+
+// cache mode: once the table holds more than max_entries,
+// leaves not hit by a search since the last pass of a CLOCK sweep
+// are removed, and evict() (if not NULL) is called with each of them
+// the sweep runs on the maintenance thread if started,
+// otherwise on inserting threads, so the table may briefly
+// exceed max_entries
+// max_entries bounds the entries, not the memory: evicted leaves
+// are unlinked but, like removed ones, never freed (readers may
+// still hold them), so memory grows with every insert
+// not thread safe, call before sharing the table
+void lfht_set_capacity(
+		struct lfht_head *head,
+		size_t max_entries,
+		lfht_visitor evict,
+		void *arg);
+
+// approximate number of entries, only counted in cache mode
+// (0 otherwise, see: lfht_count())
+size_t lfht_size(
+		struct lfht_head *head);
+
+// sweeps until the table is back under its capacity
+// returns: number of evicted entries
+size_t lfht_evict(
+		struct lfht_head *head,
+		int thread_id);
+
+// multimap: a hash may hold several values, each (hash, value)
+// pair at most once, lfht_insert() refuses an existing pair
+// instead of an existing hash, and leaves of one hash
+// are kept in a single chain without triggering expansions
+// lfht_search()/lfht_remove() find any one value of the hash
+// not thread safe, call before the first insert
+void lfht_set_multimap(
+		struct lfht_head *head);
+
+// calls visitor() with every value of hash
+// returns: number of values
+size_t lfht_search_all(
+		struct lfht_head *head,
+		size_t hash,
+		lfht_visitor visitor,
+		void *arg,
+		int thread_id);
+
+// returns: 0/1 the (hash, value) pair was removed by this call
+int lfht_remove_pair(
+		struct lfht_head *head,
+		size_t hash,
+		void *value,
+		int thread_id);
+
+// expiry: leaves carry an expiry time, expired entries are absent
+// for search/insert/remove, which remove them on the way
+// the maintenance thread removes all expired entries at every
+// interval, and expired() (if not NULL) is called with each
+// entry removed on expiry, by whichever thread removed it
+// not thread safe, call before the first insert
+void lfht_set_expiry(
+		struct lfht_head *head,
+		lfht_visitor expired,
+		void *arg);
+
+// clock of expiry times, monotonic nanoseconds
+long lfht_time();
+
+// as lfht_insert(), the entry expires at "expires"
+// (see: lfht_time(), 0 -> never, as entries inserted otherwise)
+// returns: 0/1 inserted
+int lfht_insert_expiring(
+		struct lfht_head *head,
+		size_t hash,
+		void *value,
+		long expires,
+		int thread_id);
+
+// removes every expired entry in a single pass
+// returns: number of removed entries
+size_t lfht_expire(
+		struct lfht_head *head,
+		int thread_id);
+
+// sharded tables
+//
+// 2^shard_bits independent tables, an entry lives in the one
+// selected by the high bits of its mixed hash (see:
+// lfht_set_hash_mix()) while tries index by the low bits, so
+// writers to different shards share no hash node
+// the shards are plain tables: operations go to lfht_shard(),
+// thread ids are valid in every shard
+struct lfht_sharded {
+	int shard_bits;
+	struct lfht_head **shards;
+};
+
+// shards get the hash mix "mix" (LFHT_MIX_NONE -> the caller's
+// hashes must have random high bits) and a root of
+// ROOT_HASH_SIZE - shard_bits bits (at least HASH_SIZE),
+// keeping the total root size of a single table
+// other options are set on every shard before sharing
+// returns: NULL if shard_bits is not within 0 to ROOT_HASH_SIZE
+//   or an allocation failed
+struct lfht_sharded *init_lfht_sharded(
+		int shard_bits,
+		int max_threads,
+		enum lfht_hash_mix mix);
+
+// not thread safe
+void free_lfht_sharded(
+		struct lfht_sharded *sharded);
+
+struct lfht_head *lfht_shard(
+		struct lfht_sharded *sharded,
+		size_t hash);
+
+// lfht_foreach() of every shard
+void lfht_sharded_foreach(
+		struct lfht_sharded *sharded,
+		lfht_visitor visitor,
+		void *arg);
+
+// sum of lfht_size() of the shards, 0 unless they are caches
+size_t lfht_sharded_size(
+		struct lfht_sharded *sharded);
+
+// sum of lfht_count() of the shards
+size_t lfht_sharded_count(
+		struct lfht_sharded *sharded);
+
+#if LFHT_DEBUG
+// sum of the stats of every thread of every shard (maxima for
+// max_retry_counter and max_depth)
+void lfht_sharded_debug_stats(
+		struct lfht_sharded *sharded,
+		struct lfht_stats *stats);
+#endif
+
+// point in time snapshots: every insert and remove is stamped
+// with an epoch (16 more bytes per leaf), lfht_snapshot() moves
+// to the next epoch and its view holds the entries inserted
+// before and not removed by then, while writers continue
+// not lock-free: lfht_snapshot() and lfht_snapshot_release()
+// close a table wide gate, inserts and removes starting while
+// it is closed spin (sched_yield()) until it opens, and
+// lfht_snapshot() waits for every update in progress, a CAS
+// each unless its thread is preempted in it (then the snapshot
+// and, behind it, every writer wait for that thread)
+// leaves removed while snapshots are active are kept on a list
+// (16 bytes each, a malloc() per remove) until the last active
+// snapshot is released
+// not thread safe, call before the first insert
+void lfht_set_snapshots(
+		struct lfht_head *head);
+
+// returns: the table as of now, NULL if snapshots are not enabled
+struct lfht_snapshot *lfht_snapshot(
+		struct lfht_head *head);
+
+// calls visitor() once for every entry of the snapshot
+// (expired ones as of its creation excluded), in no particular
+// order, the entries are collected first
+void lfht_snapshot_foreach(
+		struct lfht_snapshot *snapshot,
+		lfht_visitor visitor,
+		void *arg);
+
+void lfht_snapshot_release(
+		struct lfht_snapshot *snapshot);
+
+// change feed
+
+enum lfht_change_type {
+	LFHT_CHANGE_INSERT,
+	// removes, evictions and expirations
+	LFHT_CHANGE_REMOVE
+};
+
+// "value" as returned by searches, "id" names the entry: the
+// remove of an entry carries the id of its insert
+struct lfht_change {
+	enum lfht_change_type type;
+	size_t hash;
+	void *value;
+	uintptr_t id;
+};
+
+// every thread id records the inserts and removes it makes in a
+// ring of ring_size events (rounded up to a power of 2), at the
+// CAS that makes them visible, events of a full ring are dropped
+// and counted (see: lfht_changes_lost())
+// events of different thread ids are not ordered, an insert and
+// the remove of the same entry are matched by their ids
+// entries of lfht_bulk_build() and lfht_load_mmap() have no events
+// not thread safe, call before the first insert
+void lfht_set_change_feed(
+		struct lfht_head *head,
+		size_t ring_size);
+
+// moves up to max_changes events from the rings to "changes",
+// one consumer at a time
+// returns: number of events
+size_t lfht_drain_changes(
+		struct lfht_head *head,
+		struct lfht_change *changes,
+		size_t max_changes);
+
+// returns: events dropped on full rings since the table was created,
+//   once nonzero the feed has gaps and a consumer mirroring the
+//   table must resync it in full (see: lfht_foreach())
+size_t lfht_changes_lost(
+		struct lfht_head *head);
+
+// latency histograms
+
+enum lfht_op {
+	LFHT_OP_SEARCH,
+	LFHT_OP_INSERT,
+	LFHT_OP_REMOVE,
+	LFHT_OPS
+};
+
+// slowest path a call took
+enum lfht_path {
+	LFHT_PATH_FAST,
+	// lost a CAS or a race with a concurrent restructuring
+	LFHT_PATH_RETRIED,
+	// added a hash level
+	LFHT_PATH_EXPANDED,
+	// froze a level to compress it (see: lfht_set_compress_grace())
+	LFHT_PATH_COMPRESSED,
+	LFHT_PATHS
+};
+
+// latencies in nanoseconds, 8 log-linear buckets per power of 2
+// (12.5% precision) up to 2^41, longer ones land in the last
+#define LFHT_LATENCY_BUCKETS 312
+
+struct lfht_latency {
+	size_t count;
+	size_t buckets[LFHT_LATENCY_BUCKETS];
+};
+
+// every thread id times one of every period searches, inserts
+// and removes (rounded up to a power of 2) with clock_gettime()
+// into its own histograms, tagged by the path each call took
+// calls that remove expired entries or unlink for others are
+// timed with them
+// not thread safe, call before the first operation or lfht_init_thread()
+void lfht_set_latency_sampling(
+		struct lfht_head *head,
+		unsigned int period);
+
+// merges the histograms of every thread id, may run concurrently
+// with the operations
+void lfht_latency(
+		struct lfht_head *head,
+		enum lfht_op op,
+		enum lfht_path path,
+		struct lfht_latency *histogram);
+
+// returns: highest latency of the bucket holding the percentile
+long lfht_latency_percentile(
+		const struct lfht_latency *histogram,
+		double percentile);
+
+// workload traces
+
+// events of a thread id, in the order they were made
+// ops[i] = enum lfht_op of hashes[i]
+// "dropped" = events not recorded once the buffer was full
+struct lfht_trace_stream {
+	int thread_id;
+	size_t count;
+	size_t dropped;
+	const uint64_t *hashes;
+	const unsigned char *ops;
+};
+
+// configuration of the traced table and its streams,
+// backed by a mapping of the trace file
+struct lfht_trace {
+	int max_threads;
+	int root_hash_size;
+	int hash_size;
+	int max_chain_nodes;
+	enum lfht_hash_mix hash_mix;
+	// modes changing what an operation does
+	// (see: lfht_set_value_size(), lfht_set_multimap(),
+	// lfht_set_keys_only()), other options are not traced
+	size_t value_size;
+	unsigned multimap;
+	unsigned keys_only;
+	int streams_count;
+	struct lfht_trace_stream *streams;
+	void *map;
+	size_t size;
+};
+
+// every thread id records the first max_events calls it makes of
+// the operations timed by lfht_set_latency_sampling(), as
+// (op, hash) at the API entry point, 9 bytes per event
+// events of different thread ids are not ordered
+// not thread safe, call before the first operation or lfht_init_thread()
+void lfht_set_trace(
+		struct lfht_head *head,
+		size_t max_events);
+
+// writes the events recorded so far to fd (a file, at its start)
+// returns: 0/1 success
+int lfht_trace_write(
+		struct lfht_head *head,
+		int fd);
+
+// returns: NULL if the file is not a valid trace
+struct lfht_trace *lfht_trace_read(int fd);
+
+void lfht_trace_free(struct lfht_trace *trace);
+
 //debug interface
 
 void *lfht_debug_search(
 		struct lfht_head *head,
 		size_t hash,
 		int thread_id);
+
+#if LFHT_DEBUG
+// the points before the CASes of inserts, removes, expansions and
+// compressions yield the processor one time in one_in (0 -> never),
+// to widen the windows between a read and its CAS under stress
+// not thread safe, call before sharing the table
+void lfht_debug_set_interleave(
+		struct lfht_head *head,
+		unsigned int one_in);
+
+// checks the structure of a quiescent table (no operation or
+// maintenance in progress), violations are reported on stderr:
+// compression nodes left in buckets, levels skipped or still
+// expanding, cycles, valid leaves in a bucket not matching their
+// hash or reachable more than once, hashes present more than
+// once (unless multimap)
+// returns: number of violations
+int lfht_debug_validate(
+		struct lfht_head *head);
+#endif
+
+#ifdef __cplusplus
+}
+#endif
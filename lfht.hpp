@@ -0,0 +1,461 @@
+// typed C++ interface of the lock-free hash trie (C++17, header only)
+//
+// the table is keyed by hash: two keys hashing to the same value
+// cannot be present at the same time, the second insert fails
+// and lookups of the other key miss
+
+#ifndef LFHT_HPP
+#define LFHT_HPP
+
+#include <atomic>
+#include <algorithm>
+#include <cstring>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <new>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include <lfht.h>
+
+namespace lfht {
+
+// shape of the table (see: init_lfht_explicit(), lfht_set_hash_mix())
+// it is only checked at compile time and passed to the C table on
+// construction: operations run the compiled library, which reads
+// level sizes, chain bounds and the mix from the table, so no shift,
+// mask or mix is specialized on Config
+struct default_config {
+	static constexpr int root_hash_size = ROOT_HASH_SIZE;
+	static constexpr int hash_size = HASH_SIZE;
+	static constexpr int max_chain_nodes = MAX_NODES;
+	static constexpr lfht_hash_mix hash_mix = LFHT_MIX_MURMUR3;
+};
+
+// any std::hash, entries also store the key
+template<typename Key, typename = void>
+struct hash {
+	size_t operator()(const Key &key) const
+	{
+		return std::hash<Key>()(key);
+	}
+};
+
+// integral, enum and pointer keys are their own hash (mixed by
+// the table), unhash() gives the key back, entries do not store it
+template<typename Key>
+struct hash<Key, std::enable_if_t<
+		(std::is_integral_v<Key> || std::is_enum_v<Key> || std::is_pointer_v<Key>) &&
+		sizeof(Key) <= sizeof(size_t)>> {
+	size_t operator()(Key key) const
+	{
+		size_t hash = 0;
+		std::memcpy(&hash, &key, sizeof(Key));
+		return hash;
+	}
+
+	Key unhash(size_t hash) const
+	{
+		Key key;
+		std::memcpy(&key, &hash, sizeof(Key));
+		return key;
+	}
+};
+
+template<>
+struct hash<std::string_view> {
+	size_t operator()(std::string_view key) const
+	{
+		return lfht_hash_bytes(key.data(), key.size());
+	}
+};
+
+template<>
+struct hash<std::string> {
+	size_t operator()(const std::string &key) const
+	{
+		return lfht_hash_bytes(key.data(), key.size());
+	}
+};
+
+template<typename Hash, typename Key, typename = void>
+struct has_unhash : std::false_type {};
+
+template<typename Hash, typename Key>
+struct has_unhash<Hash, Key, std::enable_if_t<std::is_same_v<
+		decltype(std::declval<const Hash &>().unhash(size_t())), Key>>>
+	: std::true_type {};
+
+// thread_id arguments default to LFHT_THREAD_AUTO, threads registered
+// that way must call end_thread() before exiting
+template<
+	typename Key,
+	typename Value,
+	typename Hash = hash<Key>,
+	typename Config = default_config>
+class map {
+	static_assert(Config::root_hash_size > 0 && Config::hash_size > 0,
+			"hash levels need at least one bucket bit");
+	static_assert(Config::root_hash_size + Config::hash_size <= 8 * sizeof(size_t),
+			"hash levels wider than the hash");
+	static_assert(Config::max_chain_nodes > 0,
+			"chains need at least one node");
+
+public:
+	// keys recovered from the hash are not stored
+	static constexpr bool key_in_hash = has_unhash<Hash, Key>::value;
+	// small trivially copyable values are stored in the
+	// value pointer of the leaf instead of being boxed
+	static constexpr bool inline_value =
+		key_in_hash &&
+		std::is_trivially_copyable_v<Value> &&
+		sizeof(Value) <= sizeof(void *);
+	// larger ones are copied into the leaf (see: lfht_set_value_size())
+	static constexpr bool copied_value =
+		key_in_hash &&
+		std::is_trivially_copyable_v<Value> &&
+		!inline_value;
+	static constexpr bool boxed_value = !inline_value && !copied_value;
+
+	using key_type = Key;
+	using mapped_type = Value;
+	using value_type = std::pair<const Key, Value>;
+
+	class iterator;
+
+	explicit map(int max_threads = 64, const Hash &hasher = Hash())
+		: head(init_lfht_explicit(
+					max_threads,
+					Config::root_hash_size,
+					Config::hash_size,
+					Config::max_chain_nodes)),
+		hasher(hasher),
+		retired(nullptr)
+	{
+		lfht_set_hash_mix(head, Config::hash_mix);
+		if constexpr(copied_value) {
+			lfht_set_value_size(head, sizeof(Value));
+		}
+	}
+
+	map(const map &) = delete;
+	map &operator=(const map &) = delete;
+
+	map(map &&other) noexcept
+		: head(std::exchange(other.head, nullptr)),
+		hasher(std::move(other.hasher)),
+		retired(other.retired.exchange(nullptr))
+	{
+	}
+
+	map &operator=(map &&other) noexcept
+	{
+		if(this != &other) {
+			destroy();
+			head = std::exchange(other.head, nullptr);
+			hasher = std::move(other.hasher);
+			retired.store(other.retired.exchange(nullptr));
+		}
+		return *this;
+	}
+
+	// not thread safe
+	~map()
+	{
+		destroy();
+	}
+
+	std::optional<Value> find(
+			const Key &key,
+			int thread_id = LFHT_THREAD_AUTO) const
+	{
+		if constexpr(copied_value) {
+			alignas(Value) unsigned char buf[sizeof(Value)];
+			if(!lfht_search_copy(head, hasher(key), buf, thread_id)) {
+				return std::nullopt;
+			}
+			return *std::launder(reinterpret_cast<Value *>(buf));
+		} else {
+			void *value;
+			if(!lfht_search_value(head, hasher(key), &value, thread_id)) {
+				return std::nullopt;
+			}
+			if constexpr(inline_value) {
+				return decode(value);
+			} else {
+				entry *e = static_cast<entry *>(value);
+				if(!same_key(e, key)) {
+					return std::nullopt;
+				}
+				return e->value;
+			}
+		}
+	}
+
+	bool contains(
+			const Key &key,
+			int thread_id = LFHT_THREAD_AUTO) const
+	{
+		return find(key, thread_id).has_value();
+	}
+
+	// returns: false if the key (or its hash) is already present
+	bool insert(
+			const Key &key,
+			const Value &value,
+			int thread_id = LFHT_THREAD_AUTO)
+	{
+		if constexpr(inline_value) {
+			return lfht_insert_value(head, hasher(key), encode(value), nullptr, thread_id);
+		} else if constexpr(copied_value) {
+			return lfht_insert_copy(head, hasher(key), &value, thread_id);
+		} else {
+			entry *e = new entry{key, value, nullptr};
+			if(lfht_insert_value(head, hasher(key), e, nullptr, thread_id)) {
+				return true;
+			}
+			// never shared
+			delete e;
+			return false;
+		}
+	}
+
+	// returns: false if the key was not present
+	bool erase(
+			const Key &key,
+			int thread_id = LFHT_THREAD_AUTO)
+	{
+		size_t hash = hasher(key);
+		void *value;
+
+		if constexpr(boxed_value) {
+			// do not remove a colliding key
+			if(!lfht_search_value(head, hash, &value, thread_id) ||
+					!same_key(static_cast<entry *>(value), key)) {
+				return false;
+			}
+		}
+
+		if(!lfht_remove_value(head, hash, &value, thread_id)) {
+			return false;
+		}
+
+		if constexpr(boxed_value) {
+			// concurrent readers may still hold it,
+			// freed with the table
+			entry *e = static_cast<entry *>(value);
+			e->retired = retired.load(std::memory_order_relaxed);
+			while(!retired.compare_exchange_weak(
+						e->retired,
+						e,
+						std::memory_order_release,
+						std::memory_order_relaxed));
+		}
+		return true;
+	}
+
+	// background unlinking of removed entries (see: lfht_start_maintenance())
+	bool start_maintenance(
+			long interval,
+			int thread_id = LFHT_THREAD_AUTO)
+	{
+		return lfht_start_maintenance(head, thread_id, interval);
+	}
+
+	void stop_maintenance()
+	{
+		lfht_stop_maintenance(head);
+	}
+
+	int init_thread()
+	{
+		return lfht_init_thread(head);
+	}
+
+	void end_thread(int thread_id = LFHT_THREAD_AUTO)
+	{
+		lfht_end_thread(head, thread_id);
+	}
+
+	struct lfht_head *native() const
+	{
+		return head;
+	}
+
+	// iterators walk a copy of the entries taken by begin(),
+	// weakly consistent (see: lfht_foreach())
+	iterator begin() const
+	{
+		std::vector<std::pair<size_t, void *>> raw;
+		lfht_foreach(head, collect, &raw);
+
+		// drop entries visited twice during a concurrent expansion
+		std::sort(raw.begin(), raw.end(), [](const auto &a, const auto &b) {
+			return a.first < b.first;
+		});
+		raw.erase(std::unique(raw.begin(), raw.end(), [](const auto &a, const auto &b) {
+			return a.first == b.first;
+		}), raw.end());
+
+		auto items = std::make_shared<std::vector<value_type>>();
+		items->reserve(raw.size());
+		for(const auto &[hash, value] : raw) {
+			if constexpr(inline_value) {
+				items->emplace_back(hasher.unhash(hash), decode(value));
+			} else if constexpr(copied_value) {
+				items->emplace_back(hasher.unhash(hash), copy(value));
+			} else {
+				entry *e = static_cast<entry *>(value);
+				items->emplace_back(e->key, e->value);
+			}
+		}
+		return iterator(std::move(items));
+	}
+
+	iterator end() const
+	{
+		return iterator();
+	}
+
+	class iterator {
+	public:
+		using iterator_category = std::forward_iterator_tag;
+		using value_type = typename map::value_type;
+		using difference_type = std::ptrdiff_t;
+		using pointer = const value_type *;
+		using reference = const value_type &;
+
+		iterator() : pos(0) {}
+
+		reference operator*() const
+		{
+			return (*items)[pos];
+		}
+
+		pointer operator->() const
+		{
+			return &(*items)[pos];
+		}
+
+		iterator &operator++()
+		{
+			pos++;
+			return *this;
+		}
+
+		iterator operator++(int)
+		{
+			iterator old = *this;
+			pos++;
+			return old;
+		}
+
+		bool operator==(const iterator &other) const
+		{
+			if(at_end() || other.at_end()) {
+				return at_end() == other.at_end();
+			}
+			return items == other.items && pos == other.pos;
+		}
+
+		bool operator!=(const iterator &other) const
+		{
+			return !(*this == other);
+		}
+
+	private:
+		friend class map;
+
+		explicit iterator(std::shared_ptr<const std::vector<value_type>> items)
+			: items(std::move(items)), pos(0) {}
+
+		bool at_end() const
+		{
+			return !items || pos == items->size();
+		}
+
+		std::shared_ptr<const std::vector<value_type>> items;
+		size_t pos;
+	};
+
+private:
+	// boxed entry
+	struct entry {
+		Key key;
+		Value value;
+		entry *retired;
+	};
+
+	static void *encode(const Value &value)
+	{
+		void *ptr = nullptr;
+		std::memcpy(&ptr, &value, sizeof(Value));
+		return ptr;
+	}
+
+	static Value decode(void *ptr)
+	{
+		alignas(Value) unsigned char buf[sizeof(Value)];
+		std::memcpy(buf, &ptr, sizeof(Value));
+		return *std::launder(reinterpret_cast<Value *>(buf));
+	}
+
+	static Value copy(const void *bytes)
+	{
+		alignas(Value) unsigned char buf[sizeof(Value)];
+		std::memcpy(buf, bytes, sizeof(Value));
+		return *std::launder(reinterpret_cast<Value *>(buf));
+	}
+
+	static bool same_key(const entry *e, const Key &key)
+	{
+		if constexpr(key_in_hash) {
+			return true;
+		} else {
+			return std::equal_to<Key>()(e->key, key);
+		}
+	}
+
+	static void collect(size_t hash, void *value, void *arg)
+	{
+		static_cast<std::vector<std::pair<size_t, void *>> *>(arg)
+			->emplace_back(hash, value);
+	}
+
+	static void delete_entry(size_t, void *value, void *)
+	{
+		delete static_cast<entry *>(value);
+	}
+
+	void destroy()
+	{
+		if(head == nullptr) {
+			return;
+		}
+		lfht_stop_maintenance(head);
+		if constexpr(boxed_value) {
+			lfht_foreach(head, delete_entry, nullptr);
+			entry *e = retired.exchange(nullptr);
+			while(e) {
+				entry *nxt = e->retired;
+				delete e;
+				e = nxt;
+			}
+		}
+		free_lfht(head);
+		head = nullptr;
+	}
+
+	struct lfht_head *head;
+	Hash hasher;
+	std::atomic<entry *> retired;
+};
+
+}
+
+#endif
@@ -0,0 +1,170 @@
+// replays a workload trace (see: lfht_trace_write()) on a table,
+// one thread per traced thread id, all starting together
+//
+// usage: lfht_replay trace [root_hash_size hash_size max_chain_nodes]
+// the traced configuration is used unless overridden, as are the
+// traced value size, multimap and keys only modes
+// values are not traced: inserts add zero filled values, and
+// distinct ones on multimaps (the traced values were probably
+// distinct, and equal pairs would be refused)
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <lfht.h>
+
+struct replay {
+	struct lfht_head *lfht;
+	const struct lfht_trace_stream *stream;
+	pthread_barrier_t *start;
+	size_t found;
+};
+
+// value of the i-th insert of a stream into a multimap, the
+// index itself, stored in the buffer for inline values
+void *multimap_value(
+		struct lfht_head *lfht,
+		const struct lfht_trace_stream *stream,
+		size_t i,
+		unsigned char *buf)
+{
+	uint64_t id = ((uint64_t) stream->thread_id << 48) | (i + 1);
+	if(lfht->value_size == 0) {
+		return (void *) (uintptr_t) id;
+	}
+	memcpy(buf, &id, lfht->value_size < sizeof(id) ? lfht->value_size : sizeof(id));
+	return buf;
+}
+
+void *replay_stream(void *arg)
+{
+	struct replay *replay = arg;
+	const struct lfht_trace_stream *stream = replay->stream;
+	struct lfht_head *lfht = replay->lfht;
+	int thread_id = stream->thread_id;
+	unsigned char *buf = calloc(1, lfht->value_size + 1);
+
+	pthread_barrier_wait(replay->start);
+	for(size_t i = 0; i < stream->count; i++) {
+		size_t hash = stream->hashes[i];
+		switch(stream->ops[i]) {
+		case LFHT_OP_SEARCH:
+			replay->found += lfht_contains(lfht, hash, thread_id);
+			break;
+		case LFHT_OP_INSERT:
+			replay->found += lfht->multimap && !lfht->keys_only ?
+				lfht_insert_value(
+						lfht,
+						hash,
+						multimap_value(lfht, stream, i, buf),
+						NULL,
+						thread_id) :
+				lfht_add(lfht, hash, thread_id);
+			break;
+		case LFHT_OP_REMOVE:
+			replay->found += lfht_discard(lfht, hash, thread_id);
+			break;
+		}
+	}
+	free(buf);
+	return NULL;
+}
+
+double elapsed(struct timespec *start)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+int main(int argc, char **argv)
+{
+	if(argc != 2 && argc != 5) {
+		fprintf(stderr, "usage: %s trace [root_hash_size hash_size max_chain_nodes]\n", argv[0]);
+		return 1;
+	}
+
+	int fd = open(argv[1], O_RDONLY);
+	struct lfht_trace *trace = fd < 0 ? NULL : lfht_trace_read(fd);
+	if(trace == NULL) {
+		fprintf(stderr, "%s: not a valid trace\n", argv[1]);
+		return 1;
+	}
+	close(fd);
+
+	int root_hash_size = trace->root_hash_size;
+	int hash_size = trace->hash_size;
+	int max_chain_nodes = trace->max_chain_nodes;
+	if(argc == 5) {
+		root_hash_size = atoi(argv[2]);
+		hash_size = atoi(argv[3]);
+		max_chain_nodes = atoi(argv[4]);
+	}
+
+	struct lfht_head *lfht = init_lfht_explicit(
+			trace->max_threads,
+			root_hash_size,
+			hash_size,
+			max_chain_nodes);
+	lfht_set_hash_mix(lfht, trace->hash_mix);
+	if(trace->value_size) {
+		lfht_set_value_size(lfht, trace->value_size);
+	}
+	if(trace->multimap) {
+		lfht_set_multimap(lfht);
+	}
+	if(trace->keys_only) {
+		lfht_set_keys_only(lfht);
+	}
+
+	pthread_barrier_t start;
+	pthread_barrier_init(&start, NULL, trace->streams_count + 1);
+	pthread_t *threads = malloc(trace->streams_count * sizeof(pthread_t));
+	struct replay *replays = malloc(trace->streams_count * sizeof(struct replay));
+	size_t events = 0;
+	size_t dropped = 0;
+	for(int i = 0; i < trace->streams_count; i++) {
+		replays[i].lfht = lfht;
+		replays[i].stream = &(trace->streams[i]);
+		replays[i].start = &start;
+		replays[i].found = 0;
+		events += trace->streams[i].count;
+		dropped += trace->streams[i].dropped;
+		pthread_create(&(threads[i]), NULL, replay_stream, &(replays[i]));
+	}
+
+	struct timespec begin;
+	pthread_barrier_wait(&start);
+	clock_gettime(CLOCK_MONOTONIC, &begin);
+	size_t found = 0;
+	for(int i = 0; i < trace->streams_count; i++) {
+		pthread_join(threads[i], NULL);
+		found += replays[i].found;
+	}
+	double seconds = elapsed(&begin);
+	size_t entries = lfht_count(lfht);
+
+	printf("config %d %d %d, %d threads%s%s, value size %zu\n",
+			root_hash_size, hash_size, max_chain_nodes, trace->streams_count,
+			trace->multimap ? ", multimap" : "",
+			trace->keys_only ? ", keys only" : "",
+			trace->value_size);
+	printf("%zu events (%zu dropped while tracing), %zu succeeded\n",
+			events, dropped, found);
+	printf("%.3f s, %.1f ns/op, %.2f Mops/s, %zu entries left\n",
+			seconds,
+			events ? seconds * 1e9 / events : 0,
+			events / seconds / 1e6,
+			entries);
+
+	free(replays);
+	free(threads);
+	pthread_barrier_destroy(&start);
+	free_lfht(lfht);
+	lfht_trace_free(trace);
+	return 0;
+}
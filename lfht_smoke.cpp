@@ -0,0 +1,149 @@
+// compiles lfht.hpp with each way of storing values and checks
+// the results of a few operations, single and multithreaded
+//
+// usage: lfht_smoke
+
+#include <cstdio>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <lfht.hpp>
+
+static int failures = 0;
+
+#define CHECK(cond) \
+	do { \
+		if(!(cond)) { \
+			std::fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #cond); \
+			failures++; \
+		} \
+	} while(0)
+
+struct point {
+	long x;
+	long y;
+	long z;
+};
+
+struct small_config {
+	static constexpr int root_hash_size = 4;
+	static constexpr int hash_size = 2;
+	static constexpr int max_chain_nodes = 2;
+	static constexpr lfht_hash_mix hash_mix = LFHT_MIX_MULTIPLY;
+};
+
+// values stored in the leaf's value pointer
+void inline_values()
+{
+	lfht::map<long, int> map(4);
+	static_assert(lfht::map<long, int>::inline_value);
+
+	for(long i = 0; i < 1000; i++) {
+		CHECK(map.insert(i, (int) i * 2));
+	}
+	CHECK(!map.insert(7, 0));
+	CHECK(map.find(7) == 14);
+	CHECK(!map.find(1000).has_value());
+	CHECK(map.erase(7));
+	CHECK(!map.erase(7));
+	CHECK(!map.contains(7));
+
+	size_t count = 0;
+	long sum = 0;
+	for(const auto &[key, value] : map) {
+		CHECK(value == key * 2);
+		sum += key;
+		count++;
+	}
+	CHECK(count == 999);
+	CHECK(sum == 999 * 1000 / 2 - 7);
+	map.end_thread();
+}
+
+// values copied into the leaf, on a small table that expands
+void copied_values()
+{
+	lfht::map<int, point, lfht::hash<int>, small_config> map(4);
+	static_assert(lfht::map<int, point, lfht::hash<int>, small_config>::copied_value);
+
+	for(int i = 0; i < 1000; i++) {
+		CHECK(map.insert(i, point{i, -i, 2 * i}));
+	}
+	auto found = map.find(500);
+	CHECK(found && found->x == 500 && found->y == -500 && found->z == 1000);
+	CHECK(map.erase(500));
+	CHECK(!map.find(500).has_value());
+	map.end_thread();
+}
+
+// keys and values boxed, removed ones retired until the table
+// is destroyed, also through a move
+void boxed_values()
+{
+	lfht::map<std::string, std::string> map(4);
+	static_assert(lfht::map<std::string, std::string>::boxed_value);
+
+	for(int i = 0; i < 100; i++) {
+		CHECK(map.insert("key" + std::to_string(i), "value" + std::to_string(i)));
+	}
+	CHECK(map.find("key42") == std::string("value42"));
+	CHECK(!map.find("key100").has_value());
+	CHECK(map.erase("key42"));
+	CHECK(!map.contains("key42"));
+
+	lfht::map<std::string, std::string> moved(std::move(map));
+	CHECK(moved.find("key41") == std::string("value41"));
+	CHECK(moved.native() != nullptr && map.native() == nullptr);
+	moved.end_thread();
+}
+
+// threads registered with LFHT_THREAD_AUTO, removes unlinked
+// by the maintenance thread
+void threads()
+{
+	const int nthreads = 4;
+	const long per_thread = 10000;
+	lfht::map<long, long> map(nthreads + 1);
+	CHECK(map.start_maintenance(100000, nthreads));
+
+	std::vector<std::thread> workers;
+	for(int t = 0; t < nthreads; t++) {
+		workers.emplace_back([&map, t, per_thread] {
+			for(long i = t * per_thread; i < (t + 1) * per_thread; i++) {
+				CHECK(map.insert(i, i + 1));
+			}
+			for(long i = t * per_thread; i < (t + 1) * per_thread; i += 2) {
+				CHECK(map.erase(i));
+			}
+			map.end_thread();
+		});
+	}
+	for(auto &worker : workers) {
+		worker.join();
+	}
+	map.stop_maintenance();
+
+	size_t count = 0;
+	for(const auto &[key, value] : map) {
+		CHECK(key % 2 == 1 && value == key + 1);
+		count++;
+	}
+	CHECK(count == nthreads * per_thread / 2);
+	map.end_thread();
+}
+
+int main()
+{
+	inline_values();
+	copied_values();
+	boxed_values();
+	threads();
+
+	if(failures) {
+		std::printf("FAIL %d checks\n", failures);
+		return 1;
+	}
+	std::printf("ok   lfht.hpp\n");
+	return 0;
+}
@@ -0,0 +1,945 @@
+// randomized multithreaded stress of the lock-free protocol,
+// built with LFHT_DEBUG (see: make stress)
+//
+// every thread inserts, removes and searches keys it owns, checked
+// against its own exact oracle, and races the other threads on a
+// few shared keys, checked by the balance of successful adds and
+// discards. keys of different threads collide in their low bits,
+// so chains keep expanding and compressing under contention.
+// after every run the table must match the oracles and pass
+// lfht_debug_validate()
+//
+// table modes change how entries are inserted and checked: pairs of
+// two values per key (multimap), keys only, inline values, entries
+// inserted already expired, a capacity evicting under the workers
+// (the oracle then only rules out entries that cannot be there) and
+// a change feed replayed against the final table
+// runs with snapshots or a root rebuild have two phases: in
+// between, the root is rebuilt and a snapshot of the oracle's state
+// is taken, which must not change while the second phase runs
+//
+// built with LFHT_COMPACT, modes with reclamation are left out
+// (see: make stress-compact)
+//
+// usage: lfht_stress [ops_per_thread [threads [seed]]]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <lfht.h>
+
+#if !LFHT_DEBUG
+#error "lfht_stress needs a LFHT_DEBUG build"
+#endif
+
+// keys owned by a thread: i | thread << OWNED_SHIFT, i < OWNED_KEYS
+#define OWNED_KEYS 1024
+#define OWNED_SHIFT 14
+// shared keys: OWNED_KEYS | i << OWNED_SHIFT, one in SHARED_ONE_IN
+// operations
+#define SHARED_KEYS 64
+#define SHARED_ONE_IN 8
+// expiring keys of a thread: OWNED_KEYS + 1 + i | thread << OWNED_SHIFT,
+// one in EXPIRING_ONE_IN operations (EXPIRY)
+#define EXPIRING_KEYS 16
+#define EXPIRING_ONE_IN 8
+#define THREAD_KEYS (OWNED_KEYS + EXPIRING_KEYS)
+#define INTERLEAVE_ONE_IN 64
+// bytes of inline values (VALUE_SIZE)
+#define VALUE_SIZE_BYTES 16
+// oracle bit of a lookup that found a value of no known pair
+#define WRONG_VALUE 0x80
+
+enum options {
+	MAINTENANCE = 1,
+	GRACE = 2,
+	FILTER = 4,
+	HOT_CACHE = 8,
+	ARENA = 16,
+	SNAPSHOTS = 32,
+	AUTO_THREADS = 64,
+	INTERLEAVED = 128,
+	MULTIMAP = 256,
+	KEYS_ONLY = 512,
+	VALUE_SIZE = 1024,
+	EXPIRY = 2048,
+	CACHE = 4096,
+	CHANGE_FEED = 8192,
+	REBUILD_ROOT = 16384,
+	RECLAIM = 32768
+};
+
+struct config {
+	int root_hash_size;
+	int hash_size;
+	int max_chain_nodes;
+	int options;
+};
+
+struct stress {
+	struct lfht_head *lfht;
+	struct config config;
+	int threads;
+	// per phase
+	long ops;
+	_Atomic(long) balance[SHARED_KEYS];
+	// owned and expiring keys evicted (CACHE)
+	_Atomic(long) evicted;
+	_Atomic(int) running;
+	_Atomic(int) failed;
+};
+
+struct worker {
+	struct stress *stress;
+	int thread_id;
+	unsigned int seed;
+	// oracle of the owned keys, bit j -> pair of value j present
+	// (value 1 only in multimaps)
+	unsigned char present[OWNED_KEYS];
+	// successful inserts - removes of owned keys (CACHE)
+	long live;
+};
+
+// entries visited by lfht_foreach() or lfht_snapshot_foreach()
+// "seen" = per slot (see: key_slot()), the values visited
+// "failed" = a key or value unknown to the oracle, or visited twice
+struct visit {
+	struct stress *stress;
+	unsigned char *seen;
+	size_t visits;
+	int failed;
+};
+
+// pairs of one key found by lfht_search_all()
+struct search_all {
+	struct stress *stress;
+	size_t key;
+	unsigned char found;
+};
+
+size_t owned_key(int thread, int i)
+{
+	return (size_t) i | ((size_t) (thread + 1) << OWNED_SHIFT);
+}
+
+size_t shared_key(int i)
+{
+	return OWNED_KEYS | ((size_t) i << OWNED_SHIFT);
+}
+
+size_t expiring_key(int thread, int i)
+{
+	return (size_t) (OWNED_KEYS + 1 + i) | ((size_t) (thread + 1) << OWNED_SHIFT);
+}
+
+size_t slots(struct stress *stress)
+{
+	return (size_t) stress->threads * THREAD_KEYS + SHARED_KEYS;
+}
+
+// index of key in the oracle: the THREAD_KEYS keys of every thread
+// (owned then expiring), then the shared keys
+// returns: the slot, -1 for keys the harness never inserts
+long key_slot(
+		struct stress *stress,
+		size_t key)
+{
+	size_t low = key & ((1 << OWNED_SHIFT) - 1);
+	size_t high = key >> OWNED_SHIFT;
+
+	if(low == OWNED_KEYS) {
+		return high < SHARED_KEYS ?
+			(long) stress->threads * THREAD_KEYS + (long) high :
+			-1;
+	}
+	if(high == 0 || high > (size_t) stress->threads || low > THREAD_KEYS) {
+		return -1;
+	}
+	return (long) (high - 1) * THREAD_KEYS + (long) (low < OWNED_KEYS ? low : low - 1);
+}
+
+void *value_of(size_t key, int j)
+{
+	return (void *) (key * 4 + 2 * j + 1);
+}
+
+// inline value j of key (VALUE_SIZE)
+void value_bytes(
+		size_t key,
+		int j,
+		unsigned char bytes[VALUE_SIZE_BYTES])
+{
+	uint64_t words[2] = {(uintptr_t) value_of(key, j), ~(uintptr_t) value_of(key, j)};
+	memcpy(bytes, words, VALUE_SIZE_BYTES);
+}
+
+// returns: j if value is value j of key, -1 if none
+int value_index(
+		struct stress *stress,
+		size_t key,
+		void *value)
+{
+	int options = stress->config.options;
+
+	if(options & KEYS_ONLY) {
+		return value == NULL ? 0 : -1;
+	}
+	for(int j = 0; j < (options & MULTIMAP ? 2 : 1); j++) {
+		if(options & VALUE_SIZE) {
+			unsigned char bytes[VALUE_SIZE_BYTES];
+			value_bytes(key, j, bytes);
+			if(value && memcmp(value, bytes, VALUE_SIZE_BYTES) == 0) {
+				return j;
+			}
+		} else if(value == value_of(key, j)) {
+			return j;
+		}
+	}
+	return -1;
+}
+
+void fail(
+		struct worker *worker,
+		const char *what,
+		size_t key)
+{
+	fprintf(stderr, "thread %d: %s (key %zx)\n", worker->thread_id, what, key);
+	atomic_store(&(worker->stress->failed), 1);
+}
+
+int api_thread(struct worker *worker)
+{
+	return worker->stress->config.options & AUTO_THREADS ?
+		LFHT_THREAD_AUTO :
+		worker->thread_id;
+}
+
+// returns: 0/1 the pair of value j was inserted
+int table_insert(
+		struct worker *worker,
+		size_t key,
+		int j)
+{
+	struct lfht_head *lfht = worker->stress->lfht;
+	int options = worker->stress->config.options;
+	int thread_id = api_thread(worker);
+
+	if(options & KEYS_ONLY) {
+		return lfht_add(lfht, key, thread_id);
+	}
+	if(options & VALUE_SIZE) {
+		unsigned char bytes[VALUE_SIZE_BYTES];
+		value_bytes(key, j, bytes);
+		return lfht_insert_copy(lfht, key, bytes, thread_id);
+	}
+
+	void *value;
+	int inserted = lfht_insert_value(lfht, key, value_of(key, j), &value, thread_id);
+	if(!inserted && !(options & MULTIMAP) && value != value_of(key, j)) {
+		fail(worker, "insert found a wrong value", key);
+	}
+	return inserted;
+}
+
+// returns: 0/1 the pair of value j was removed
+int table_remove(
+		struct worker *worker,
+		size_t key,
+		int j)
+{
+	struct stress *stress = worker->stress;
+	struct lfht_head *lfht = stress->lfht;
+	int options = stress->config.options;
+	int thread_id = api_thread(worker);
+
+	if(options & KEYS_ONLY) {
+		return lfht_discard(lfht, key, thread_id);
+	}
+	if(options & MULTIMAP) {
+		unsigned char bytes[VALUE_SIZE_BYTES];
+		value_bytes(key, j, bytes);
+		return lfht_remove_pair(
+				lfht,
+				key,
+				options & VALUE_SIZE ? (void *) bytes : value_of(key, j),
+				thread_id);
+	}
+
+	void *value;
+	int removed = lfht_remove_value(lfht, key, &value, thread_id);
+	if(removed && value_index(stress, key, value) != j) {
+		fail(worker, "removed a wrong value", key);
+	}
+	return removed;
+}
+
+void search_all_visit(size_t hash, void *value, void *arg)
+{
+	struct search_all *search = arg;
+	int j = hash == search->key ? value_index(search->stress, hash, value) : -1;
+	search->found |= j < 0 || (search->found & (1 << j)) ?
+		WRONG_VALUE :
+		1 << j;
+}
+
+// returns: the values of key found, as in worker->present
+unsigned char table_lookup(
+		struct stress *stress,
+		size_t key,
+		int thread_id)
+{
+	struct lfht_head *lfht = stress->lfht;
+	int options = stress->config.options;
+
+	if(options & KEYS_ONLY) {
+		return lfht_contains(lfht, key, thread_id);
+	}
+	if(options & MULTIMAP) {
+		struct search_all search = {
+			.stress = stress,
+			.key = key,
+			.found = 0
+		};
+		lfht_search_all(lfht, key, search_all_visit, &search, thread_id);
+		return search.found;
+	}
+
+	int j;
+	if(options & VALUE_SIZE) {
+		unsigned char bytes[VALUE_SIZE_BYTES];
+		if(!lfht_search_copy(lfht, key, bytes, thread_id)) {
+			return 0;
+		}
+		j = value_index(stress, key, bytes);
+	} else {
+		void *value = lfht_search(lfht, key, thread_id);
+		if(value == NULL) {
+			return 0;
+		}
+		j = value_index(stress, key, value);
+	}
+	return j < 0 ? WRONG_VALUE : 1 << j;
+}
+
+// evictions can take any owned key away, so with CACHE the oracle
+// only rules out entries that cannot be there
+void owned_op(struct worker *worker)
+{
+	int options = worker->stress->config.options;
+	int cache = options & CACHE;
+	int i = rand_r(&(worker->seed)) % OWNED_KEYS;
+	int j = options & MULTIMAP ? rand_r(&(worker->seed)) % 2 : 0;
+	unsigned char bit = 1 << j;
+	size_t key = owned_key(worker->thread_id, i);
+
+	switch(rand_r(&(worker->seed)) % 3) {
+	case 0: ;
+		int inserted = table_insert(worker, key, j);
+		if(inserted && (worker->present[i] & bit) && !cache) {
+			fail(worker, "inserted twice", key);
+		}
+		if(!inserted && !(worker->present[i] & bit)) {
+			fail(worker, "insert failed", key);
+		}
+		worker->present[i] |= bit;
+		worker->live += inserted;
+		break;
+	case 1: ;
+		int removed = table_remove(worker, key, j);
+		if(removed && !(worker->present[i] & bit)) {
+			fail(worker, "removed twice", key);
+		}
+		if(!removed && (worker->present[i] & bit) && !cache) {
+			fail(worker, "remove failed", key);
+		}
+		worker->present[i] &= ~bit;
+		worker->live -= removed;
+		break;
+	default: ;
+		unsigned char found = table_lookup(worker->stress, key, api_thread(worker));
+		if(found & ~worker->present[i]) {
+			fail(worker, "search found a removed key or a wrong value", key);
+		}
+		if(found != worker->present[i] && !cache) {
+			fail(worker, "search missed", key);
+		}
+		break;
+	}
+}
+
+void shared_op(struct worker *worker)
+{
+	struct stress *stress = worker->stress;
+	int thread_id = api_thread(worker);
+	int i = rand_r(&(worker->seed)) % SHARED_KEYS;
+	size_t key = shared_key(i);
+
+	if(rand_r(&(worker->seed)) % 2) {
+		if(lfht_add(stress->lfht, key, thread_id)) {
+			atomic_fetch_add(&(stress->balance[i]), 1);
+		}
+	} else if(lfht_discard(stress->lfht, key, thread_id)) {
+		atomic_fetch_sub(&(stress->balance[i]), 1);
+	}
+}
+
+// entries inserted already expired are absent at once, and
+// replace the expired entry of their key (if not removed yet)
+void expiring_op(struct worker *worker)
+{
+	struct lfht_head *lfht = worker->stress->lfht;
+	int thread_id = api_thread(worker);
+	size_t key = expiring_key(
+			worker->thread_id,
+			rand_r(&(worker->seed)) % EXPIRING_KEYS);
+
+	if(!lfht_insert_expiring(lfht, key, value_of(key, 0), 1, thread_id)) {
+		fail(worker, "insert over an expired entry failed", key);
+	}
+	if(lfht_contains(lfht, key, thread_id)) {
+		fail(worker, "expired entry found", key);
+	}
+}
+
+void *run_worker(void *arg)
+{
+	struct worker *worker = arg;
+	struct stress *stress = worker->stress;
+
+	for(long op = 0; op < stress->ops && !atomic_load(&(stress->failed)); op++) {
+		if(stress->config.options & EXPIRY &&
+				rand_r(&(worker->seed)) % EXPIRING_ONE_IN == 0) {
+			expiring_op(worker);
+		} else if(rand_r(&(worker->seed)) % SHARED_ONE_IN == 0) {
+			shared_op(worker);
+		} else {
+			owned_op(worker);
+		}
+	}
+
+	if(stress->config.options & AUTO_THREADS) {
+		lfht_end_thread(stress->lfht, LFHT_THREAD_AUTO);
+	}
+	atomic_fetch_sub(&(stress->running), 1);
+	return NULL;
+}
+
+void evicted(size_t hash, void *value, void *arg)
+{
+	(void) value;
+	struct stress *stress = arg;
+	long slot = key_slot(stress, hash);
+	long shared = (long) stress->threads * THREAD_KEYS;
+
+	if(slot >= shared) {
+		atomic_fetch_sub(&(stress->balance[slot - shared]), 1);
+	} else {
+		atomic_fetch_add(&(stress->evicted), 1);
+	}
+}
+
+void visit_entry(size_t hash, void *value, void *arg)
+{
+	struct visit *visit = arg;
+	long slot = key_slot(visit->stress, hash);
+	long shared = (long) visit->stress->threads * THREAD_KEYS;
+	int j = 0;
+
+	// values of shared keys come from lfht_add(), expiring keys
+	// are never visible
+	if(slot < 0 || (slot < shared && slot % THREAD_KEYS >= OWNED_KEYS)) {
+		j = -1;
+	} else if(slot < shared) {
+		j = value_index(visit->stress, hash, value);
+	}
+	if(j < 0 || (visit->seen[slot] & (1 << j))) {
+		if(!visit->failed) {
+			fprintf(stderr, "key %zx visited twice or with an unknown value\n", hash);
+		}
+		visit->failed = 1;
+		return;
+	}
+	visit->seen[slot] |= 1 << j;
+	visit->visits++;
+}
+
+// the entries the oracles hold, per slot (see: key_slot())
+void expected_entries(
+		struct stress *stress,
+		struct worker *workers,
+		unsigned char *expected)
+{
+	memset(expected, 0, slots(stress));
+	for(int t = 0; t < stress->threads; t++) {
+		memcpy(expected + (size_t) t * THREAD_KEYS, workers[t].present, OWNED_KEYS);
+	}
+	for(int i = 0; i < SHARED_KEYS; i++) {
+		expected[(size_t) stress->threads * THREAD_KEYS + i] =
+			atomic_load(&(stress->balance[i])) != 0;
+	}
+}
+
+// returns: 0/1 the slots visited are the ones expected
+//   (some of them, with subset)
+int compare_entries(
+		struct stress *stress,
+		const char *what,
+		unsigned char *seen,
+		unsigned char *expected,
+		int subset)
+{
+	int success = 1;
+	for(size_t slot = 0; slot < slots(stress); slot++) {
+		if(subset ? (seen[slot] & ~expected[slot]) != 0 : seen[slot] != expected[slot]) {
+			if(success) {
+				fprintf(stderr, "%s: slot %zu visited %x, expected %x\n",
+						what, slot, seen[slot], expected[slot]);
+			}
+			success = 0;
+		}
+	}
+	return success;
+}
+
+// returns: 0/1 snapshot holds exactly the expected entries
+int check_snapshot(
+		struct stress *stress,
+		struct lfht_snapshot *snapshot,
+		unsigned char *expected)
+{
+	struct visit visit = {
+		.stress = stress,
+		.seen = calloc(slots(stress), 1),
+		.visits = 0,
+		.failed = 0
+	};
+	lfht_snapshot_foreach(snapshot, visit_entry, &visit);
+	int success = !visit.failed &&
+		compare_entries(stress, "held snapshot", visit.seen, expected, 0);
+	free(visit.seen);
+	return success;
+}
+
+// a snapshot taken under writes: known entries, each once
+// returns: 0/1 success
+int check_fresh_snapshot(struct stress *stress)
+{
+	struct visit visit = {
+		.stress = stress,
+		.seen = calloc(slots(stress), 1),
+		.visits = 0,
+		.failed = 0
+	};
+	struct lfht_snapshot *snapshot = lfht_snapshot(stress->lfht);
+	lfht_snapshot_foreach(snapshot, visit_entry, &visit);
+	lfht_snapshot_release(snapshot);
+	free(visit.seen);
+	return !visit.failed;
+}
+
+// replays the change feed: per slot, inserts - removes must be
+// the entries the table holds
+// returns: 0/1 success
+int check_feed(
+		struct stress *stress,
+		unsigned char *seen)
+{
+	long *net = calloc(slots(stress), sizeof(long));
+	struct lfht_change changes[256];
+	int success = 1;
+	size_t n;
+
+	while((n = lfht_drain_changes(stress->lfht, changes, 256)) > 0) {
+		for(size_t i = 0; i < n; i++) {
+			long slot = key_slot(stress, changes[i].hash);
+			if(slot < 0) {
+				fprintf(stderr, "change of unknown key %zx\n", changes[i].hash);
+				success = 0;
+				continue;
+			}
+			net[slot] += changes[i].type == LFHT_CHANGE_INSERT ? 1 : -1;
+		}
+	}
+
+	if(lfht_changes_lost(stress->lfht)) {
+		fprintf(stderr, "%zu changes lost\n", lfht_changes_lost(stress->lfht));
+		success = 0;
+	}
+	for(size_t slot = 0; slot < slots(stress) && success; slot++) {
+		if(net[slot] != __builtin_popcount(seen[slot])) {
+			fprintf(stderr, "slot %zu: %ld entries from changes, %d in the table\n",
+					slot, net[slot], __builtin_popcount(seen[slot]));
+			success = 0;
+		}
+	}
+	free(net);
+	return success;
+}
+
+// returns: 0/1 success
+int check_table(
+		struct stress *stress,
+		struct worker *workers)
+{
+	struct lfht_head *lfht = stress->lfht;
+	int cache = stress->config.options & CACHE;
+	unsigned char *expected = malloc(slots(stress));
+	int success = 1;
+
+	if(stress->config.options & EXPIRY) {
+		// expired entries are absent, but visited until removed
+		lfht_expire(lfht, 0);
+	}
+	expected_entries(stress, workers, expected);
+
+	for(int t = 0; t < stress->threads; t++) {
+		for(int i = 0; i < OWNED_KEYS; i++) {
+			size_t key = owned_key(t, i);
+			unsigned char found = table_lookup(stress, key, 0);
+			if(cache ? (found & ~workers[t].present[i]) != 0 : found != workers[t].present[i]) {
+				fprintf(stderr, "key %zx: expected %x, found %x\n",
+						key, workers[t].present[i], found);
+				success = 0;
+			}
+		}
+		for(int i = 0; i < EXPIRING_KEYS; i++) {
+			if(lfht_contains(lfht, expiring_key(t, i), 0)) {
+				fprintf(stderr, "key %zx: expired, found\n", expiring_key(t, i));
+				success = 0;
+			}
+		}
+	}
+
+	for(int i = 0; i < SHARED_KEYS; i++) {
+		size_t key = shared_key(i);
+		long balance = atomic_load(&(stress->balance[i]));
+		if((balance != 0 && balance != 1) || lfht_contains(lfht, key, 0) != balance) {
+			fprintf(stderr, "shared key %zx: balance %ld, present %d\n",
+					key, balance, lfht_contains(lfht, key, 0));
+			success = 0;
+		}
+	}
+
+	struct visit visit = {
+		.stress = stress,
+		.seen = calloc(slots(stress), 1),
+		.visits = 0,
+		.failed = 0
+	};
+	lfht_foreach(lfht, visit_entry, &visit);
+	if(visit.failed || !compare_entries(stress, "table", visit.seen, expected, cache)) {
+		success = 0;
+	}
+	if(cache) {
+		// every owned entry inserted and not removed was evicted
+		long live = -atomic_load(&(stress->evicted));
+		for(int t = 0; t < stress->threads; t++) {
+			live += workers[t].live;
+		}
+		for(int i = 0; i < SHARED_KEYS; i++) {
+			live += atomic_load(&(stress->balance[i]));
+		}
+		if((long) visit.visits != live) {
+			fprintf(stderr, "%zu entries visited, %ld inserted and not removed or evicted\n",
+					visit.visits, live);
+			success = 0;
+		}
+	}
+
+	if(stress->config.options & CHANGE_FEED && !check_feed(stress, visit.seen)) {
+		success = 0;
+	}
+
+	if(lfht_debug_validate(lfht)) {
+		success = 0;
+	}
+	free(visit.seen);
+	free(expected);
+	return success;
+}
+
+// lfht_add() on tables with inline values, single threaded
+// returns: 0/1 success
+int check_add_modes(void)
+{
+	unsigned char zero[16] = {0};
+	unsigned char value[16];
+	unsigned char other[16] = {1};
+	int success = 1;
+
+	// the added entry reads back zero filled
+	struct lfht_head *lfht = init_lfht(1);
+	lfht_set_value_size(lfht, sizeof(value));
+	if(!lfht_add(lfht, 42, 0) || lfht_add(lfht, 42, 0) ||
+			!lfht_search_copy(lfht, 42, value, 0) ||
+			memcmp(value, zero, sizeof(value))) {
+		fprintf(stderr, "lfht_add() with inline values\n");
+		success = 0;
+	}
+	free_lfht(lfht);
+
+	// the zero filled value is a pair of its own in multimaps
+	lfht = init_lfht(1);
+	lfht_set_value_size(lfht, sizeof(value));
+	lfht_set_multimap(lfht);
+	if(!lfht_insert_copy(lfht, 42, other, 0) ||
+			!lfht_add(lfht, 42, 0) || lfht_add(lfht, 42, 0) ||
+			!lfht_remove_pair(lfht, 42, zero, 0) ||
+			lfht_remove_pair(lfht, 42, zero, 0) ||
+			!lfht_contains(lfht, 42, 0)) {
+		fprintf(stderr, "lfht_add() on an inline multimap\n");
+		success = 0;
+	}
+	free_lfht(lfht);
+
+	printf("%s lfht_add() on inline values and multimaps\n", success ? "ok  " : "FAIL");
+	return success;
+}
+
+// quiescent, between the two phases of a run
+// returns: the snapshot the second phase must not change (SNAPSHOTS)
+struct lfht_snapshot *between_phases(
+		struct stress *stress,
+		struct worker *workers,
+		unsigned char *expected)
+{
+	struct lfht_head *lfht = stress->lfht;
+	struct config config = stress->config;
+	struct lfht_snapshot *snapshot = NULL;
+
+	if(config.options & SNAPSHOTS) {
+		if(config.options & EXPIRY) {
+			lfht_expire(lfht, 0);
+		}
+		expected_entries(stress, workers, expected);
+		snapshot = lfht_snapshot(lfht);
+		if(!check_snapshot(stress, snapshot, expected)) {
+			atomic_store(&(stress->failed), 1);
+		}
+	}
+
+	if(config.options & REBUILD_ROOT) {
+		if(config.options & MAINTENANCE) {
+			lfht_stop_maintenance(lfht);
+		}
+		if(!lfht_rebuild_root_quiescent(lfht, config.root_hash_size + 1)) {
+			fprintf(stderr, "root rebuild to %d bits failed\n", config.root_hash_size + 1);
+			atomic_store(&(stress->failed), 1);
+		}
+		if(config.options & MAINTENANCE) {
+			lfht_start_maintenance(
+					lfht,
+					config.options & AUTO_THREADS ? LFHT_THREAD_AUTO : stress->threads,
+					10000);
+		}
+	}
+	return snapshot;
+}
+
+// returns: 0/1 success
+int run(
+		struct config config,
+		int threads,
+		long ops,
+		unsigned int seed)
+{
+	int phases = config.options & (SNAPSHOTS | REBUILD_ROOT) ? 2 : 1;
+	struct stress stress = {
+		.lfht = init_lfht_explicit(
+				threads + 1,
+				config.root_hash_size,
+				config.hash_size,
+				config.max_chain_nodes),
+		.config = config,
+		.threads = threads,
+		.ops = ops / phases
+	};
+	struct lfht_head *lfht = stress.lfht;
+	for(int i = 0; i < SHARED_KEYS; i++) {
+		atomic_init(&(stress.balance[i]), 0);
+	}
+	atomic_init(&(stress.evicted), 0);
+	atomic_init(&(stress.running), 0);
+	atomic_init(&(stress.failed), 0);
+
+	if(config.options & GRACE) {
+		lfht_set_compress_grace(lfht, 100000);
+	}
+	if(config.options & FILTER) {
+		lfht_set_filter(lfht);
+	}
+	if(config.options & HOT_CACHE) {
+		lfht_set_hot_cache(lfht, 16);
+	}
+	if(config.options & ARENA) {
+		lfht_set_arena(lfht);
+	}
+	if(config.options & SNAPSHOTS) {
+		lfht_set_snapshots(lfht);
+	}
+	if(config.options & MULTIMAP) {
+		lfht_set_multimap(lfht);
+	}
+	if(config.options & KEYS_ONLY) {
+		lfht_set_keys_only(lfht);
+	}
+	if(config.options & VALUE_SIZE) {
+		lfht_set_value_size(lfht, VALUE_SIZE_BYTES);
+	}
+	if(config.options & EXPIRY) {
+		lfht_set_expiry(lfht, NULL, NULL);
+	}
+	if(config.options & CACHE) {
+		lfht_set_capacity(lfht, (size_t) threads * OWNED_KEYS / 4, evicted, &stress);
+	}
+	if(config.options & CHANGE_FEED) {
+		// no event is lost: each operation records one at most,
+		// plus the removes of expired entries met on the way
+		lfht_set_change_feed(lfht, 2 * stress.ops + 1024);
+	}
+	if(config.options & INTERLEAVED) {
+		lfht_debug_set_interleave(lfht, INTERLEAVE_ONE_IN);
+	}
+	if(config.options & RECLAIM && !lfht_set_reclaim(lfht)) {
+		fprintf(stderr, "reclamation refused\n");
+		atomic_store(&(stress.failed), 1);
+	}
+	if(config.options & MAINTENANCE) {
+		lfht_start_maintenance(
+				lfht,
+				config.options & AUTO_THREADS ? LFHT_THREAD_AUTO : threads,
+				10000);
+	}
+
+	struct worker *workers = calloc(threads, sizeof(struct worker));
+	pthread_t *pthreads = malloc(threads * sizeof(pthread_t));
+	unsigned char *expected = malloc(slots(&stress));
+	struct lfht_snapshot *snapshot = NULL;
+	for(int t = 0; t < threads; t++) {
+		workers[t].stress = &stress;
+		workers[t].thread_id = t;
+		workers[t].seed = seed * 31 + t;
+	}
+	for(int phase = 0; phase < phases; phase++) {
+		if(phase > 0 && !atomic_load(&(stress.failed))) {
+			snapshot = between_phases(&stress, workers, expected);
+		}
+		atomic_store(&(stress.running), threads);
+		for(int t = 0; t < threads; t++) {
+			pthread_create(&(pthreads[t]), NULL, run_worker, &(workers[t]));
+		}
+		// the held snapshot must not see the writes of this phase
+		while(snapshot && atomic_load(&(stress.running)) &&
+				!atomic_load(&(stress.failed))) {
+			if(!check_snapshot(&stress, snapshot, expected) ||
+					!check_fresh_snapshot(&stress)) {
+				atomic_store(&(stress.failed), 1);
+			}
+		}
+		for(int t = 0; t < threads; t++) {
+			pthread_join(pthreads[t], NULL);
+		}
+	}
+	lfht_stop_maintenance(lfht);
+
+	int success = !atomic_load(&(stress.failed));
+	if(snapshot) {
+		success = success && check_snapshot(&stress, snapshot, expected);
+		lfht_snapshot_release(snapshot);
+	}
+	success = success && check_table(&stress, workers);
+
+	struct lfht_stats stats = {0};
+	for(int t = 0; t < threads + 1; t++) {
+		stats.expansion_counter += lfht->stats[t]->expansion_counter;
+		stats.compression_counter += lfht->stats[t]->compression_counter;
+		stats.compression_rollback_counter += lfht->stats[t]->compression_rollback_counter;
+		stats.unfreeze_counter += lfht->stats[t]->unfreeze_counter;
+		if(stats.max_retry_counter < lfht->stats[t]->max_retry_counter) {
+			stats.max_retry_counter = lfht->stats[t]->max_retry_counter;
+		}
+		stats.reclaimed_counter += lfht->stats[t]->reclaimed_counter;
+	}
+	if(config.options & RECLAIM && stats.reclaimed_counter == 0) {
+		// the last runs of the maintenance thread free the
+		// leaves removed before the workers returned
+		fprintf(stderr, "no removed leaf reclaimed\n");
+		success = 0;
+	}
+	printf("%s %d %d %d options %5d: %d expansions, %d compressions, "
+			"%d rollbacks, %d unfreezes, %d max retries\n",
+			success ? "ok  " : "FAIL",
+			config.root_hash_size,
+			config.hash_size,
+			config.max_chain_nodes,
+			config.options,
+			stats.expansion_counter,
+			stats.compression_counter,
+			stats.compression_rollback_counter,
+			stats.unfreeze_counter,
+			stats.max_retry_counter);
+
+	free(expected);
+	free(pthreads);
+	free(workers);
+	free_lfht(lfht);
+	return success;
+}
+
+int main(int argc, char **argv)
+{
+	long ops = argc > 1 ? atol(argv[1]) : 100000;
+	int threads = argc > 2 ? atoi(argv[2]) : 4;
+	unsigned int seed = argc > 3 ? atoi(argv[3]) : 1;
+
+	struct config shapes[] = {
+		{1, 1, 1, 0},
+		{2, 1, 1, 0},
+		{2, 3, 2, 0},
+		{4, 2, 3, 0},
+		{8, 4, 3, 0}
+	};
+	int options[] = {
+		0,
+		INTERLEAVED,
+		MAINTENANCE | INTERLEAVED,
+		GRACE | INTERLEAVED,
+		MAINTENANCE | GRACE | AUTO_THREADS,
+		FILTER | HOT_CACHE | INTERLEAVED,
+		ARENA | SNAPSHOTS | MAINTENANCE | INTERLEAVED,
+		SNAPSHOTS | REBUILD_ROOT | INTERLEAVED,
+		MULTIMAP | INTERLEAVED,
+		SNAPSHOTS | MULTIMAP | VALUE_SIZE | INTERLEAVED,
+		KEYS_ONLY | FILTER | INTERLEAVED,
+		VALUE_SIZE | ARENA | REBUILD_ROOT | INTERLEAVED,
+		EXPIRY | MAINTENANCE | INTERLEAVED,
+		CHANGE_FEED | EXPIRY | INTERLEAVED,
+		CACHE | INTERLEAVED,
+		CACHE | MAINTENANCE,
+		RECLAIM | MAINTENANCE | REBUILD_ROOT | INTERLEAVED,
+		RECLAIM | MAINTENANCE | MULTIMAP | EXPIRY | AUTO_THREADS,
+		RECLAIM | MAINTENANCE | CACHE | CHANGE_FEED | INTERLEAVED
+	};
+
+	int failures = !check_add_modes();
+	for(size_t i = 0; i < sizeof(shapes) / sizeof(shapes[0]); i++) {
+		for(size_t j = 0; j < sizeof(options) / sizeof(options[0]); j++) {
+			if(LFHT_COMPACT && options[j] & RECLAIM) {
+				// compact tables allocate leaves from an arena
+				continue;
+			}
+			struct config config = shapes[i];
+			config.options = options[j];
+			failures += !run(config, threads, ops, seed);
+		}
+	}
+
+	if(failures) {
+		printf("%d runs failed (seed %u)\n", failures, seed);
+		return 1;
+	}
+	return 0;
+}